@@ -1,16 +1,288 @@
+// Build: g++ -O2 main.cpp -o city -lGL -lGLU -lglut -lEGL -pthread
+// Define CITY_NO_HEADLESS to leave out the EGL benchmark mode (and -lEGL).
+// Define CITY_NO_SIMD to build the rain update with the scalar kernel only.
+// Define CITY_NO_PROFILER to compile the profiler scopes out.
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
+#include <GL/glext.h>
 #include <GL/glu.h>
 #include <GL/glut.h>
 
+#if defined(__linux__) && !defined(CITY_NO_HEADLESS)
+#define CITY_HEADLESS 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// Scene files are memory-mapped wherever POSIX mmap is available
+#if defined(__unix__) || defined(__APPLE__)
+#define CITY_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SSE2 rain kernel wherever the compiler targets it, AVX2 picked at runtime
+#if defined(__SSE2__) && !defined(CITY_NO_SIMD)
+#define CITY_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define CITY_AVX2 1
+#endif
+#endif
+
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
+// -------------------------- GL call accounting --------------------------
+// The GL calls that draw, change materials, nest the modelview stack or read
+// state back go through the counting wrappers below (the macros at the end
+// of this section rename them for the rest of the file). A display list
+// records what it contains while it is compiled and adds that to the frame
+// each time it is replayed, so the counts are the same on every driver and
+// --gl-budget can hold a build machine without a GPU to them.
+struct GlCallCounts {
+    long draws = 0;         // glDrawArrays/glDrawElements, including inside lists
+    long lists = 0;         // glCallList
+    long vertices = 0;      // vertices/indices submitted
+    long materials = 0;     // glMaterial* calls
+    long readbacks = 0;     // glGet*, glReadPixels
+    long matrixDepth = 0;   // deepest modelview glPushMatrix nesting
+
+    // Fold a replayed list into this frame (or into the list containing it)
+    void addList(const GlCallCounts &l, long depth) {
+        draws += l.draws;
+        lists += l.lists + 1;
+        vertices += l.vertices;
+        materials += l.materials;
+        matrixDepth = std::max(matrixDepth, depth + l.matrixDepth);
+    }
+};
+
+struct GlBudget {
+    long draws = -1, lists = -1, vertices = -1, materials = -1, readbacks = -1, matrixDepth = -1;  // -1: no limit
+    bool any = false;
+};
+
+struct GlAccounting {
+    GlCallCounts frame, last;       // frame being drawn, last finished frame
+    GlCallCounts peak;              // per-counter maximum over checked frames
+    GlBudget budget;
+    int framesChecked = 0, framesOver = 0;
+
+    GLenum matrixMode = GL_MODELVIEW;
+    long depth = 0;                 // modelview pushes outstanding
+    GLuint compiling = 0;           // list inside glNewList/glEndList, 0 if none
+    long compileDepth = 0;
+    std::vector<GlCallCounts> listCosts;    // by list name, depth relative to the call
+
+    GlCallCounts &target() { return compiling ? listCosts[compiling] : frame; }
+};
+GlAccounting glAccounting;
+
+inline void countedDrawArrays(GLenum mode, GLint first, GLsizei count) {
+    GlCallCounts &c = glAccounting.target();
+    c.draws++;
+    c.vertices += count;
+    glDrawArrays(mode, first, count);
+}
+
+inline void countedDrawElements(GLenum mode, GLsizei count, GLenum type, const void *indices) {
+    GlCallCounts &c = glAccounting.target();
+    c.draws++;
+    c.vertices += count;
+    glDrawElements(mode, count, type, indices);
+}
+
+inline void countedDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const void *indices,
+                                         GLsizei instances) {
+    GlCallCounts &c = glAccounting.target();
+    c.draws++;
+    c.vertices += (long) count * instances;
+    glDrawElementsInstanced(mode, count, type, indices, instances);
+}
+
+inline void countedCallList(GLuint list) {
+    GlAccounting &a = glAccounting;
+    static const GlCallCounts unknown;
+    const GlCallCounts &cost = list < a.listCosts.size() ? a.listCosts[list] : unknown;
+    if (a.compiling) a.listCosts[a.compiling].addList(cost, a.compileDepth);
+    else a.frame.addList(cost, a.depth);
+    glCallList(list);
+}
+
+inline void countedNewList(GLuint list, GLenum mode) {
+    GlAccounting &a = glAccounting;
+    if (list >= a.listCosts.size()) a.listCosts.resize(list + 1);
+    a.listCosts[list] = GlCallCounts();
+    a.compiling = list;
+    a.compileDepth = 0;
+    glNewList(list, mode);
+}
+
+inline void countedEndList() {
+    glAccounting.compiling = 0;
+    glEndList();
+}
+
+inline void countedMaterialfv(GLenum face, GLenum pname, const GLfloat *params) {
+    glAccounting.target().materials++;
+    glMaterialfv(face, pname, params);
+}
+
+inline void countedMaterialf(GLenum face, GLenum pname, GLfloat param) {
+    glAccounting.target().materials++;
+    glMaterialf(face, pname, param);
+}
+
+inline void countedMatrixMode(GLenum mode) {
+    glAccounting.matrixMode = mode;
+    glMatrixMode(mode);
+}
+
+inline void countedPushMatrix() {
+    GlAccounting &a = glAccounting;
+    if (a.matrixMode == GL_MODELVIEW) {
+        long &d = a.compiling ? a.compileDepth : a.depth;
+        GlCallCounts &c = a.target();
+        c.matrixDepth = std::max(c.matrixDepth, ++d);
+    }
+    glPushMatrix();
+}
+
+inline void countedPopMatrix() {
+    GlAccounting &a = glAccounting;
+    if (a.matrixMode == GL_MODELVIEW) {
+        long &d = a.compiling ? a.compileDepth : a.depth;
+        if (d > 0) d--;
+    }
+    glPopMatrix();
+}
+
+// Readbacks run immediately even while a list is compiling
+inline void countedGetIntegerv(GLenum pname, GLint *data) {
+    glAccounting.frame.readbacks++;
+    glGetIntegerv(pname, data);
+}
+
+inline void countedGetInteger64v(GLenum pname, GLint64 *data) {
+    glAccounting.frame.readbacks++;
+    glGetInteger64v(pname, data);
+}
+
+inline const GLubyte *countedGetString(GLenum name) {
+    glAccounting.frame.readbacks++;
+    return glGetString(name);
+}
+
+inline void countedGetQueryObjectiv(GLuint id, GLenum pname, GLint *params) {
+    glAccounting.frame.readbacks++;
+    glGetQueryObjectiv(id, pname, params);
+}
+
+inline void countedGetQueryObjectui64v(GLuint id, GLenum pname, GLuint64 *params) {
+    glAccounting.frame.readbacks++;
+    glGetQueryObjectui64v(id, pname, params);
+}
+
+inline void countedReadPixels(GLint x, GLint y, GLsizei w, GLsizei h, GLenum format, GLenum type, void *data) {
+    glAccounting.frame.readbacks++;
+    glReadPixels(x, y, w, h, format, type, data);
+}
+
+#define glDrawArrays countedDrawArrays
+#define glDrawElements countedDrawElements
+#define glDrawElementsInstanced countedDrawElementsInstanced
+#define glCallList countedCallList
+#define glNewList countedNewList
+#define glEndList countedEndList
+#define glMaterialfv countedMaterialfv
+#define glMaterialf countedMaterialf
+#define glMatrixMode countedMatrixMode
+#define glPushMatrix countedPushMatrix
+#define glPopMatrix countedPopMatrix
+#define glGetIntegerv countedGetIntegerv
+#define glGetInteger64v countedGetInteger64v
+#define glGetString countedGetString
+#define glGetQueryObjectiv countedGetQueryObjectiv
+#define glGetQueryObjectui64v countedGetQueryObjectui64v
+#define glReadPixels countedReadPixels
+
+// Parse "draws=N,vertices=N,..." for --gl-budget
+bool parseGlBudget(const char *spec, GlBudget &b) {
+    char name[32];
+    long value;
+    int used;
+    while (sscanf(spec, " %31[a-z_]=%ld%n", name, &value, &used) == 2) {
+        long *field = !strcmp(name, "draws") ? &b.draws : !strcmp(name, "lists") ? &b.lists
+                    : !strcmp(name, "vertices") ? &b.vertices : !strcmp(name, "materials") ? &b.materials
+                    : !strcmp(name, "readbacks") ? &b.readbacks : !strcmp(name, "depth") ? &b.matrixDepth
+                    : nullptr;
+        if (!field) break;
+        *field = value;
+        b.any = true;
+        spec += used;
+        if (*spec == ',') spec++;
+    }
+    if (*spec) fprintf(stderr, "gl budget: cannot parse \"%s\" (expected draws=N,lists=N,vertices=N,materials=N,readbacks=N,depth=N)\n", spec);
+    return *spec == 0;
+}
+
+// Close the frame: remember it, check it against the budget (when asked to)
+// and start counting the next one
+void glAccountingEndFrame(bool check = true) {
+    GlAccounting &a = glAccounting;
+    const GlCallCounts &f = a.frame;
+    a.last = f;
+    if (check) {
+        a.framesChecked++;
+        a.peak.draws = std::max(a.peak.draws, f.draws);
+        a.peak.lists = std::max(a.peak.lists, f.lists);
+        a.peak.vertices = std::max(a.peak.vertices, f.vertices);
+        a.peak.materials = std::max(a.peak.materials, f.materials);
+        a.peak.readbacks = std::max(a.peak.readbacks, f.readbacks);
+        a.peak.matrixDepth = std::max(a.peak.matrixDepth, f.matrixDepth);
+
+        const GlBudget &b = a.budget;
+        const struct { const char *name; long value, limit; } checks[] = {
+            { "draws", f.draws, b.draws }, { "lists", f.lists, b.lists },
+            { "vertices", f.vertices, b.vertices }, { "materials", f.materials, b.materials },
+            { "readbacks", f.readbacks, b.readbacks }, { "depth", f.matrixDepth, b.matrixDepth }
+        };
+        bool over = false;
+        for (const auto &c : checks) {
+            if (c.limit < 0 || c.value <= c.limit) continue;
+            if (a.framesOver < 10)
+                fprintf(stderr, "gl budget: frame %d: %s %ld > %ld\n", a.framesChecked, c.name, c.value, c.limit);
+            over = true;
+        }
+        if (over && ++a.framesOver == 10)
+            fprintf(stderr, "gl budget: further frames over budget not reported\n");
+    }
+    a.frame = GlCallCounts();
+}
+
 // -------------------------- Global scene & camera params --------------------------
 float camAngleY = 0.0f;    // yaw (left-right)
 float camAngleX = -18.0f;  // pitch (up-down)
@@ -32,16 +304,28 @@ int windowWidth = 1000, windowHeight = 700;
 float sunAngle = 45.0f;     // degrees; controls sun position
 const float SUN_RADIUS = 40.0f;
 
+// Seed for rand(); fixed with --seed (and by default in benchmark mode)
+unsigned int worldSeed = 0;
+
 // Timer
 const int TIMER_MS = 16;    // ~60 fps
 
+// Fixed-step simulation: update() feeds real elapsed time (scaled by
+// timeScale) into an accumulator and steps the world in SIM_DT increments;
+// display() interpolates between the last two steps by renderAlpha.
+const float SIM_DT = 1.0f / 60.0f;
+const float REFERENCE_TICK = TIMER_MS / 1000.0f; // per-step constants below were tuned for this tick
+const float MAX_FRAME_TIME = 0.25f;              // longer stalls are dropped, not caught up
+float timeScale = 1.0f;                          // '+' / '-' to speed up or slow down
+double simAccumulator = 0.0;
+float renderAlpha = 1.0f;
+
 // Weather system
 enum WeatherType { SUNNY, RAINY };
 WeatherType currentWeather = SUNNY;
 float weatherTimer = 0.0f;
 const float WEATHER_CHANGE_TIME = 10.0f; // Change weather every 10 seconds
 float rainIntensity = 0.0f;
-std::vector<std::pair<float, float>> rainDrops; // x, z positions
 
 // -------------------------- Scene objects --------------------------
 struct Car {
@@ -51,6 +335,12 @@ struct Car {
     float r,g,b;   // color
     int carType;   // 0: sedan, 1: SUV, 2: sports car, 3: truck
     float wheelRotation; // for rotating wheels
+    unsigned char lod = 0;   // level of detail picked at draw time
+    float prevZ = 0.0f, prevWheelRotation = 0.0f; // state at the previous sim step
+    int lane = -1;             // traffic lane, -1 before initTraffic()
+    float cruise = 0.0f;       // desired speed in units per second
+    float laneCooldown = 0.0f; // seconds until the next lane change is allowed
+    float prevLaneX = 0.0f;
 };
 std::vector<Car> cars;
 
@@ -59,6 +349,9 @@ struct Human {
     float dir;        // direction along sidewalk (+1 or -1)
     float speed;      // movement speed
     float phase;      // for simple arm/leg swing animation
+    unsigned char lod = 0; // level of detail picked at draw time
+    float prevX = 0.0f, prevZ = 0.0f, prevPhase = 0.0f; // state at the previous sim step
+    int walk = -1;    // sidewalk the crowd keeps them on, -1 before initCrowd()
 };
 std::vector<Human> humans;
 
@@ -70,6 +363,28 @@ struct Building {
 };
 std::vector<Building> buildings;
 
+// Trees layout
+struct Tree {
+    float x, z;   // trunk position
+    float scale;  // overall size multiplier
+};
+std::vector<Tree> trees;
+
+// Street layout: road surfaces (markings run along `alongZ`) and sidewalks
+struct Road {
+    float x0, z0, x1, z1;   // extent
+    bool alongZ;            // true: traffic runs along z
+};
+std::vector<Road> roads;
+
+struct GroundRect {
+    float x0, z0, x1, z1;
+};
+std::vector<GroundRect> sidewalks;
+
+// Humans turn around at this z limit
+float walkEndZ = 110.0f;
+
 // -------------------------- Utility helpers --------------------------
 void setMaterialRGB(float r, float g, float b, float shininess)
 {
@@ -84,785 +399,5558 @@ void setMaterialRGB(float r, float g, float b, float shininess)
     glMaterialf (GL_FRONT_AND_BACK, GL_SHININESS, shine);
 }
 
-// Simple box (centered) helper using glutSolidCube scaled
-void drawBox(float cx, float cy, float cz, float sx, float sy, float sz) {
-    glPushMatrix();
-    glTranslatef(cx, cy, cz);
-    glScalef(sx, sy, sz);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+// Small seeded xorshift32 generator for procedural content (city layout,
+// buildings, trees, grass blades, rain, generated traffic and streamed tiles),
+// so that none of it depends on or consumes the global rand() stream
+struct Rng {
+    uint32_t state;
+
+    explicit Rng(uint32_t seed) : state(seed ? seed : 0x9E3779B9u) {}
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    float uniform() { return (next() >> 8) * (1.0f / 16777216.0f); }   // [0,1)
+    int range(int n) { return (int) (next() % (uint32_t) n); }           // [0,n)
+};
+
+// Buffer objects are core since GL 1.5; older drivers use client-side arrays
+bool hasVertexBufferObjects() {
+    static int cached = -1;
+    if (cached < 0) {
+        const char* ver = (const char*) glGetString(GL_VERSION);
+        int major = 0, minor = 0;
+        if (ver) sscanf(ver, "%d.%d", &major, &minor);
+        cached = (major > 1 || (major == 1 && minor >= 5)) ? 1 : 0;
+    }
+    return cached == 1;
 }
 
-// -------------------------- Weather system --------------------------
-void initRain() {
-    rainDrops.clear();
-    for (int i = 0; i < 500; i++) { // Create 500 rain drops
-        rainDrops.push_back(std::make_pair(
-            (rand() % 200) - 100.0f,  // x: -100 to 100
-            (rand() % 200) - 100.0f   // z: -100 to 100
-        ));
+// Framebuffer objects are core since GL 3.0, or come with ARB_framebuffer_object
+bool hasFramebufferObjects() {
+    static int cached = -1;
+    if (cached < 0) {
+        const char* ver = (const char*) glGetString(GL_VERSION);
+        const char* ext = (const char*) glGetString(GL_EXTENSIONS);
+        int major = 0, minor = 0;
+        if (ver) sscanf(ver, "%d.%d", &major, &minor);
+        cached = (major >= 3 || (ext && strstr(ext, "GL_ARB_framebuffer_object"))) ? 1 : 0;
     }
+    return cached == 1;
 }
 
-void updateWeather(float deltaTime) {
-    weatherTimer += deltaTime;
+// Instanced drawing with per-instance attributes (glVertexAttribDivisor) and
+// the GLSL it needs are core since GL 3.3
+bool hasInstancing() {
+    static int cached = -1;
+    if (cached < 0) {
+        const char* ver = (const char*) glGetString(GL_VERSION);
+        int major = 0, minor = 0;
+        if (ver) sscanf(ver, "%d.%d", &major, &minor);
+        cached = (major > 3 || (major == 3 && minor >= 3)) ? 1 : 0;
+    }
+    return cached == 1;
+}
 
-    if (weatherTimer >= WEATHER_CHANGE_TIME) {
-        weatherTimer = 0.0f;
+// Pixel buffer objects are core since GL 2.1, or come with ARB_pixel_buffer_object
+bool hasPixelBufferObjects() {
+    static int cached = -1;
+    if (cached < 0) {
+        const char* ver = (const char*) glGetString(GL_VERSION);
+        const char* ext = (const char*) glGetString(GL_EXTENSIONS);
+        int major = 0, minor = 0;
+        if (ver) sscanf(ver, "%d.%d", &major, &minor);
+        cached = (major > 2 || (major == 2 && minor >= 1) || (ext && strstr(ext, "GL_ARB_pixel_buffer_object"))) ? 1 : 0;
+    }
+    return cached == 1;
+}
 
-        if (currentWeather == SUNNY) {
-            currentWeather = RAINY;
-            rainIntensity = 0.0f;
-            initRain();
-        } else {
-            currentWeather = SUNNY;
-            rainIntensity = 0.0f;
+// -------------------------- Job system --------------------------
+// A fixed pool of worker threads, each owning a deque of jobs. A thread pops
+// from the back of its own deque and, when that runs dry, steals from the
+// front of the others. parallelFor() cuts [0, n) into chunks spread over all
+// deques and the calling thread works through them too until every chunk is
+// done. Chunks must only touch their own iterations, which keeps the result
+// identical to the serial loop.
+struct Job {
+    void (*run)(const void *body, int begin, int end);
+    const void *body;
+    int begin, end;
+    std::atomic<int> *pending;
+};
+
+struct JobSystem {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;   // [0] belongs to the calling thread
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> queued{0};
+    bool quit = false;
+
+    int threadCount() const { return (int) queues.size(); }
+    ~JobSystem() { stop(); }
+
+    // `threads` counts the calling thread; 1 runs everything inline
+    void start(int threads) {
+        stop();
+        threads = std::max(1, threads);
+        for (int i = 0; i < threads; ++i) queues.emplace_back(new Queue());
+        for (int i = 1; i < threads; ++i) workers.emplace_back(&JobSystem::workerLoop, this, i);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            quit = true;
         }
+        wake.notify_all();
+        for (std::thread &t : workers) t.join();
+        workers.clear();
+        queues.clear();
+        quit = false;
     }
 
-    // Smooth transition between weather states
-    if (currentWeather == RAINY) {
-        rainIntensity = fmin(rainIntensity + deltaTime * 0.5f, 1.0f);
-    } else {
-        rainIntensity = fmax(rainIntensity - deltaTime * 0.5f, 0.0f);
+    // Own deque first (newest job), then the oldest job of any other deque
+    bool take(int self, Job &job) {
+        {
+            Queue &q = *queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue &q = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
     }
-}
 
-void updateRain(float deltaTime) {
-    for (auto& drop : rainDrops) {
-        // Move drops downward
-        drop.second -= deltaTime * 50.0f * rainIntensity; // Move faster with higher intensity
+    static void execute(const Job &job) {
+        job.run(job.body, job.begin, job.end);
+        job.pending->fetch_sub(1, std::memory_order_release);
+    }
 
-        // Reset drops that fall below ground level
-        if (drop.second < -100.0f) {
-            drop.first = (rand() % 200) - 100.0f;
-            drop.second = 100.0f + (rand() % 50);
+    void workerLoop(int self) {
+        Job job;
+        for (;;) {
+            if (take(self, job)) {
+                execute(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return quit || queued.load() > 0; });
+            if (quit) return;
         }
     }
-}
 
-void drawRain() {
-    if (rainIntensity <= 0.0f) return;
+    // body(begin, end) over [0, n) in chunks of about `grain` iterations
+    template <typename F>
+    void parallelFor(int n, int grain, const F &body) {
+        if (n <= 0) return;
+        int chunks = (n + grain - 1) / grain;
+        if (chunks <= 1 || queues.size() <= 1) {
+            body(0, n);
+            return;
+        }
 
-    glDisable(GL_LIGHTING);
-    glColor4f(0.7f, 0.7f, 1.0f, 0.6f * rainIntensity);
-    glLineWidth(1.0f);
+        std::atomic<int> pending(chunks);
+        Job job;
+        job.run = [](const void *b, int begin, int end) { (*(const F*) b)(begin, end); };
+        job.body = &body;
+        job.pending = &pending;
+        for (int c = 0; c < chunks; ++c) {
+            Queue &q = *queues[c % queues.size()];
+            job.begin = c * grain;
+            job.end = std::min(n, job.begin + grain);
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.jobs.push_back(job);
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            queued += chunks;
+        }
+        wake.notify_all();
 
-    glBegin(GL_LINES);
-    for (const auto& drop : rainDrops) {
-        float y = 20.0f + fmod(drop.second * 0.3f, 5.0f); // Vary height slightly
-        glVertex3f(drop.first, y, drop.second);
-        glVertex3f(drop.first, y - 2.0f, drop.second - 0.5f); // Angled rain
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (take(0, job)) execute(job);
+            else std::this_thread::yield();
+        }
     }
-    glEnd();
-
-    glEnable(GL_LIGHTING);
-}
+};
+JobSystem jobSystem;
+int jobThreads = 0;     // --threads; 0 uses every hardware thread
+
+// -------------------------- Frame statistics --------------------------
+struct FrameStats {
+    int drawItems = 0;              // meshes submitted through the render queue
+    int materialRequests = 0;       // material() calls made by the draw functions
+    int materialChanges = 0;        // materials actually applied after sorting
+    int stateChanges = 0;           // lighting/blend/line width changes applied
+    int stateChangesAvoided = 0;    // redundant state changes skipped
+    int meshBinds = 0;
+    int drawCalls = 0;              // glDrawArrays/glDrawElements/glBegin issued directly
+    int listCalls = 0;              // display lists replayed
+
+    // Frustum culling
+    int cellsVisible = 0, cellsCulled = 0;
+    int buildingsDrawn = 0, buildingsCulled = 0;
+    int treesDrawn = 0, treesCulled = 0;
+    int carsDrawn = 0, carsCulled = 0;
+    int humansDrawn = 0, humansCulled = 0;
+
+    // Drawn cars, humans and trees per level of detail
+    int lodCounts[3] = { 0, 0, 0 };
+
+    int shadowRenders = 0;          // static shadow map re-renders
+    int shadowBlocks = 0;           // shadow map blocks redrawn for actors
+    int cellsCompiled = 0;          // grid cells whose display lists were (re)built
+    int cellsOccluded = 0;          // in the frustum but hidden behind buildings
+    int tilesVisible = 0, tilesOccluded = 0;    // streamed tiles
+    int tilesCompiled = 0;
+
+    int materialChangesAvoided() const { return materialRequests - materialChanges; }
+
+    void add(const FrameStats &o) {
+        drawItems += o.drawItems;
+        materialRequests += o.materialRequests;
+        materialChanges += o.materialChanges;
+        stateChanges += o.stateChanges;
+        stateChangesAvoided += o.stateChangesAvoided;
+        meshBinds += o.meshBinds;
+        drawCalls += o.drawCalls;
+        listCalls += o.listCalls;
+        cellsVisible += o.cellsVisible;       cellsCulled += o.cellsCulled;
+        buildingsDrawn += o.buildingsDrawn;   buildingsCulled += o.buildingsCulled;
+        treesDrawn += o.treesDrawn;           treesCulled += o.treesCulled;
+        carsDrawn += o.carsDrawn;             carsCulled += o.carsCulled;
+        humansDrawn += o.humansDrawn;         humansCulled += o.humansCulled;
+        for (int i = 0; i < 3; ++i) lodCounts[i] += o.lodCounts[i];
+        shadowRenders += o.shadowRenders;
+        shadowBlocks += o.shadowBlocks;
+        cellsCompiled += o.cellsCompiled;
+        cellsOccluded += o.cellsOccluded;
+        tilesVisible += o.tilesVisible;       tilesOccluded += o.tilesOccluded;
+        tilesCompiled += o.tilesCompiled;
+    }
+};
+FrameStats frameStats;
+bool printFrameStats = false;   // toggled with 'i'
+
+// -------------------------- Profiler --------------------------
+// PROFILE_SCOPE("name") times the rest of the enclosing block on the CPU;
+// PROFILE_GPU_SCOPE also brackets it with a pair of GL_TIMESTAMP queries
+// where timer queries exist. Scopes nest, and zones with the same name are
+// summed. A frame's events are kept until its queries have had
+// PROFILE_LATENCY - 1 more frames to come back, then go into the per-zone history shown by
+// the HUD ('p') and into the --profile-trace file as Chrome trace events.
+// Closing the trace waits for the frames still in flight, so it ends with
+// the last frame drawn. With neither on, a scope costs one branch.
+#define CITY_CONCAT2(a, b) a##b
+#define CITY_CONCAT(a, b) CITY_CONCAT2(a, b)
+#ifdef CITY_NO_PROFILER
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#else
+#define PROFILE_SCOPE_IMPL(name, gpu) \
+    static const int CITY_CONCAT(profileZone_, __LINE__) = profilerZone(name); \
+    ProfileScope CITY_CONCAT(profileScope_, __LINE__)(CITY_CONCAT(profileZone_, __LINE__), gpu)
+#define PROFILE_SCOPE(name) PROFILE_SCOPE_IMPL(name, false)
+#define PROFILE_GPU_SCOPE(name) PROFILE_SCOPE_IMPL(name, true)
+#endif
 
-void setWeatherLighting(float& sunX, float& sunY, float& sunZ) {
-    if (currentWeather == SUNNY) {
-        // Sunny weather - bright and warm
-        GLfloat sunDiff[] = { 1.0f, 0.88f, 0.55f, 1.0f };
-        GLfloat sunAmb[]  = { 0.28f, 0.23f, 0.15f, 1.0f };
-        GLfloat global_amb[] = {0.22f, 0.22f, 0.22f, 1.0f};
+const int PROFILE_MAX_ZONES = 32;
+const int PROFILE_HISTORY = 120;    // frames kept for the HUD graphs
+const int PROFILE_LATENCY = 3;      // frames in flight before GPU results are read
 
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, sunDiff);
-        glLightfv(GL_LIGHT0, GL_AMBIENT, sunAmb);
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, global_amb);
+struct ProfileEvent {
+    int zone;
+    int depth;
+    double startUs, durUs;          // CPU time from the profiler epoch
+    int query;                      // begin/end timestamp pair, -1 when CPU only
+};
 
-        // Set sky color to bright blue
-        glClearColor(0.53f, 0.81f, 0.98f, 1.0f);
-    } else {
-        // Rainy weather - dark and cool
-        GLfloat rainDiff[] = { 0.4f, 0.4f, 0.5f, 1.0f };
-        GLfloat rainAmb[]  = { 0.15f, 0.15f, 0.2f, 1.0f };
-        GLfloat global_amb[] = {0.1f, 0.1f, 0.15f, 1.0f};
+struct ProfileFrame {
+    std::vector<ProfileEvent> events;
+    std::vector<GLuint> queries;
+    int queriesUsed = 0;
+};
 
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, rainDiff);
-        glLightfv(GL_LIGHT0, GL_AMBIENT, rainAmb);
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, global_amb);
+struct Profiler {
+    bool hud = false;
+    FILE *trace = nullptr;
+    bool active = false;            // hud || trace
+    int gpu = -1;                   // timer queries usable, -1 until checked
+    double gpuOffsetUs = 0.0;       // GL_TIMESTAMP microseconds to the CPU clock
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    std::vector<const char*> zones;
+    std::vector<int> stack;         // open events of the current frame
+    ProfileFrame frames[PROFILE_LATENCY];
+    int current = 0;
+
+    // Per-zone milliseconds of the last PROFILE_HISTORY resolved frames
+    float cpuMs[PROFILE_HISTORY][PROFILE_MAX_ZONES] = {};
+    float gpuMs[PROFILE_HISTORY][PROFILE_MAX_ZONES] = {};
+    int zoneDepth[PROFILE_MAX_ZONES] = {};
+    int historyHead = 0, historyCount = 0;
+
+    double nowUs() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+    }
+};
+Profiler profiler;
+
+// GL_TIMESTAMP queries are core since GL 3.3, or come with ARB_timer_query
+bool hasTimerQueries() {
+    const char* ver = (const char*) glGetString(GL_VERSION);
+    const char* ext = (const char*) glGetString(GL_EXTENSIONS);
+    int major = 0, minor = 0;
+    if (ver) sscanf(ver, "%d.%d", &major, &minor);
+    return major > 3 || (major == 3 && minor >= 3) || (ext && strstr(ext, "GL_ARB_timer_query"));
+}
 
-        // Set sky color to gray
-        glClearColor(0.4f, 0.4f, 0.5f, 1.0f);
+// Zone index for a name, registered once per call site
+int profilerZone(const char *name) {
+    Profiler &p = profiler;
+    for (size_t i = 0; i < p.zones.size(); ++i) {
+        if (!strcmp(p.zones[i], name)) return (int) i;
     }
+    if ((int) p.zones.size() >= PROFILE_MAX_ZONES) return -1;
+    p.zones.push_back(name);
+    return (int) p.zones.size() - 1;
 }
 
-// -------------------------- Scene building/initialization --------------------------
-void setupBuildings() {
-    buildings.clear();
-    // left side (x negative)
-    for (int i = 0; i < 6; ++i) {
-        float z = -50.0f + i * 20.0f;
-        if (i==2) z += 3.0f; // slight irregularity
-        float h = 6.0f + (i % 4) * 2.5f; // variety in heights
-        buildings.push_back({ -9.0f, z, 6.0f, 8.0f, h }); // left column
+int profilerBegin(int zone, bool gpu) {
+    Profiler &p = profiler;
+    if (p.gpu < 0) {
+        p.gpu = hasTimerQueries() ? 1 : 0;
+        if (p.gpu) {
+            GLint64 t = 0;
+            glGetInteger64v(GL_TIMESTAMP, &t);
+            p.gpuOffsetUs = p.nowUs() - t / 1000.0;
+        }
     }
-    // right side (x positive)
-    for (int i = 0; i < 6; ++i) {
-        float z = -50.0f + i * 20.0f;
-        float h = 5.0f + (i % 5) * 2.0f;
-        buildings.push_back({ 9.0f, z + ((i%2)?-2.0f:2.0f), 6.0f, 8.0f, h });
+    ProfileFrame &f = p.frames[p.current];
+    ProfileEvent e = { zone, (int) p.stack.size(), p.nowUs(), 0.0, -1 };
+    if (gpu && p.gpu) {
+        if (f.queriesUsed + 2 > (int) f.queries.size()) {
+            size_t n = f.queries.size();
+            f.queries.resize(n + 64);
+            glGenQueries(64, &f.queries[n]);
+        }
+        e.query = f.queriesUsed;
+        f.queriesUsed += 2;
+        glQueryCounter(f.queries[e.query], GL_TIMESTAMP);
     }
+    f.events.push_back(e);
+    p.stack.push_back((int) f.events.size() - 1);
+    return p.stack.back();
 }
 
-void initActors() {
-    cars.clear();
-    // Two lanes:
-    // - Left lane (x = -1.2f): cars moving in +Z direction (forward)
-    // - Right lane (x = 1.2f): cars moving in -Z direction (backward)
-
-    // Left lane cars (moving forward +Z)
-    cars.push_back({ -1.2f, -30.0f, 0.02f, 0.9f, 0.1f, 0.1f, 0, 0.0f }); // red sedan
-    cars.push_back({ -1.2f, -10.0f, 0.018f, 0.1f, 0.8f, 0.2f, 2, 0.0f }); // green sports car
+void profilerEnd(int event) {
+    Profiler &p = profiler;
+    ProfileFrame &f = p.frames[p.current];
+    ProfileEvent &e = f.events[event];
+    e.durUs = p.nowUs() - e.startUs;
+    if (e.query >= 0) glQueryCounter(f.queries[e.query + 1], GL_TIMESTAMP);
+    p.stack.pop_back();
+}
 
-    // Right lane cars (moving backward -Z) - negative speed
-    cars.push_back({  1.2f, 30.0f, -0.015f, 0.1f, 0.1f, 0.9f, 1, 0.0f }); // blue SUV
-    cars.push_back({  1.2f, 10.0f, -0.016f, 0.95f, 0.6f, 0.12f, 3, 0.0f }); // orange truck
+struct ProfileScope {
+    int event = -1;
+    ProfileScope(int zone, bool gpu) {
+        if (profiler.active && zone >= 0) event = profilerBegin(zone, gpu);
+    }
+    ~ProfileScope() {
+        if (event >= 0) profilerEnd(event);
+    }
+};
 
-    humans.clear();
-    for (int i = 0; i < 8; ++i) {
-        float z = -60.0f + i * 15.0f + (rand()%10 - 5) * 0.4f;
+void writeTraceEvent(const char *name, const char *cat, int tid, double ts, double dur) {
+    fprintf(profiler.trace, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f}",
+            name, cat, tid, ts, dur);
+}
 
-        // Left sidewalk humans
-        humans.push_back({
-            -4.8f + (rand()%100)/500.0f,
-            z,
-            1.0f * ((i%2)?1.0f:-1.0f),
-            0.005f + (rand()%3)/300.0f,
-            (float) (rand()%100)/100.0f
-        });
+// Fold a finished frame into the history and the trace; `wait` blocks on its
+// GPU queries instead of dropping them when they are not back yet
+void profilerResolve(ProfileFrame &f, bool wait = false) {
+    Profiler &p = profiler;
+    bool gpuReady = wait && f.queriesUsed > 0;
+    if (f.queriesUsed > 0 && !wait) {
+        GLint available = 0;
+        glGetQueryObjectiv(f.queries[f.queriesUsed - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        gpuReady = available != 0;     // otherwise drop this frame's GPU times rather than stall
+    }
 
-        // Right sidewalk humans
-        humans.push_back({
-            4.8f + (rand()%100)/500.0f,
-            z + (rand()%10-5),
-            -1.0f * ((i%2)?1.0f:-1.0f),
-            0.005f + (rand()%3)/300.0f,
-            (float) (rand()%100)/100.0f
-        });
+    float *cpu = p.cpuMs[p.historyHead];
+    float *gpu = p.gpuMs[p.historyHead];
+    std::fill(cpu, cpu + PROFILE_MAX_ZONES, 0.0f);
+    std::fill(gpu, gpu + PROFILE_MAX_ZONES, 0.0f);
+    for (const ProfileEvent &e : f.events) {
+        const char *name = p.zones[e.zone];
+        cpu[e.zone] += (float) (e.durUs / 1000.0);
+        p.zoneDepth[e.zone] = e.depth;
+        if (p.trace) writeTraceEvent(name, "cpu", 1, e.startUs, e.durUs);
+        if (e.query >= 0 && gpuReady) {
+            GLuint64 t0 = 0, t1 = 0;
+            glGetQueryObjectui64v(f.queries[e.query], GL_QUERY_RESULT, &t0);
+            glGetQueryObjectui64v(f.queries[e.query + 1], GL_QUERY_RESULT, &t1);
+            double durUs = (t1 - t0) / 1000.0;
+            gpu[e.zone] += (float) (durUs / 1000.0);
+            if (p.trace) writeTraceEvent(name, "gpu", 2, t0 / 1000.0 + p.gpuOffsetUs, durUs);
+        }
     }
+    p.historyHead = (p.historyHead + 1) % PROFILE_HISTORY;
+    p.historyCount = std::min(p.historyCount + 1, PROFILE_HISTORY);
 }
 
-// -------------------------- Drawing primitives --------------------------
-void drawWindowPanel(int rows, int cols, float b_w, float b_h, float sill_y) {
-    float pad = 0.15f;
-    float winW = (b_w - (cols+1)*pad) / cols;
-    float winH = (b_h - (rows+1)*pad) / rows;
-
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            float cx = -b_w/2 + pad + (c * (winW + pad)) + winW/2;
-            float cy = sill_y + b_h/2 - pad - (r * (winW + pad)) - winH/2;
-
-            glPushMatrix();
-              glTranslatef(cx, cy, 0.0f);
-
-              // Window frame
-              glPushMatrix();
-                glTranslatef(0, 0, -0.1f);
-                glScalef(winW, winH, 0.15f);
-                setMaterialRGB(0.15f, 0.15f, 0.15f, 5.0f);
-                glutSolidCube(1.0f);
-              glPopMatrix();
-
-              // Glass pane
-              glPushMatrix();
-                glTranslatef(0, 0, 0.02f);
-                glScalef(winW * 0.85f, winH * 0.85f, 0.01f);
-
-                // Adjust glass color based on weather
-                if (currentWeather == SUNNY) {
-                    setMaterialRGB(0.7f, 0.85f, 1.0f, 80.0f);
-                } else {
-                    setMaterialRGB(0.5f, 0.6f, 0.8f, 60.0f); // Darker glass for rainy weather
-                }
-
-                GLfloat prevEmission[4];
-                glGetMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, prevEmission);
-                GLfloat emis[4] = {0.1f, 0.12f, 0.15f, 1.0f};
-                glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emis);
-                glutSolidCube(1.0f);
-                glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, prevEmission);
-              glPopMatrix();
-
-              // Window sill
-              glPushMatrix();
-                glTranslatef(0, -winH/2 - 0.02f, 0.05f);
-                glScalef(winW * 1.1f, 0.04f, 0.1f);
-                setMaterialRGB(0.3f, 0.3f, 0.3f, 10.0f);
-                glutSolidCube(1.0f);
-              glPopMatrix();
+// Close the current frame and resolve the one PROFILE_LATENCY - 1 frames back
+void profilerEndFrame() {
+    Profiler &p = profiler;
+    if (!p.active) return;
+    p.current = (p.current + 1) % PROFILE_LATENCY;
+    ProfileFrame &f = p.frames[p.current];
+    if (!f.events.empty()) profilerResolve(f);
+    f.events.clear();
+    f.queriesUsed = 0;
+    p.stack.clear();
+}
 
-            glPopMatrix();
+void profilerUpdateActive() {
+    Profiler &p = profiler;
+    bool active = p.hud || p.trace;
+    if (active && !p.active) {
+        // Start clean; frames left over from an earlier session are stale
+        for (ProfileFrame &f : p.frames) {
+            f.events.clear();
+            f.queriesUsed = 0;
         }
+        p.stack.clear();
+        p.historyCount = 0;
     }
+    p.active = active;
 }
 
-void drawBuildingWithDetails(const Building &B) {
-    float bx = B.x;
-    float bz = B.z;
-    float w = B.w;
-    float d = B.d;
-    float h = B.h;
-
-    // Adjust building color based on weather
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.58f, 0.58f, 0.62f, 30.0f);
-    } else {
-        setMaterialRGB(0.45f, 0.45f, 0.5f, 20.0f); // Darker, wet look
+// Resolve every frame still waiting on its queries, oldest first
+void profilerDrain() {
+    Profiler &p = profiler;
+    if (!p.active || !p.stack.empty()) return;
+    for (int k = 1; k <= PROFILE_LATENCY; ++k) {
+        ProfileFrame &f = p.frames[(p.current + k) % PROFILE_LATENCY];
+        if (!f.events.empty()) profilerResolve(f, true);
+        f.events.clear();
+        f.queriesUsed = 0;
     }
-    drawBox(bx, h/2.0f, bz, w, h, d);
+}
 
-    // Draw windows on all four sides
-    float faceW, faceH;
+// Terminate the trace file as it stands; no GL calls, so it is also safe
+// from atexit() when the program leaves some other way
+void profilerEndTrace() {
+    Profiler &p = profiler;
+    if (!p.trace) return;
+    fprintf(p.trace, "\n]}\n");
+    fclose(p.trace);
+    p.trace = nullptr;
+    profilerUpdateActive();
+}
 
-    // Front face
-    glPushMatrix();
-      glTranslatef(bx, h/2.0f, bz - d/2.0f);
-      glRotatef(180.0f, 0,1,0);
-      faceW = w * 0.92f;
-      faceH = h * 0.62f;
-      drawWindowPanel( (int) (h/2.2f), 3, faceW, faceH, 0.0f );
+// Write out the frames in flight and close the trace; needs the GL context
+void profilerCloseTrace() {
+    if (!profiler.trace) return;
+    profilerDrain();
+    profilerEndTrace();
+}
 
-      // door
-      glPushMatrix();
-        glTranslatef(0.0f, -h/2.0f + 1.2f, 0.1f);
-        glScalef(0.9f, 1.8f, 0.15f);
-        setMaterialRGB(0.36f, 0.22f, 0.1f, 10.0f);
-        glutSolidCube(1.0f);
-        // door knob
-        setMaterialRGB(0.9f, 0.82f, 0.2f, 10.0f);
-        glPushMatrix();
-          glTranslatef(0.35f, 0.0f, 0.5f);
-          glutSolidSphere(0.05f, 8,8);
-        glPopMatrix();
-      glPopMatrix();
-    glPopMatrix();
+bool profilerOpenTrace(const char *path) {
+    Profiler &p = profiler;
+    p.trace = fopen(path, "w");
+    if (!p.trace) {
+        fprintf(stderr, "profiler: cannot write %s\n", path);
+        return false;
+    }
+    fprintf(p.trace, "{\"traceEvents\":[\n"
+                     "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+                     "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+    atexit(profilerEndTrace);
+    profilerUpdateActive();
+    return true;
+}
 
-    // Back face
-    glPushMatrix();
-      glTranslatef(bx, h/2.0f, bz + d/2.0f);
-      faceW = w * 0.92f;
-      faceH = h * 0.62f;
-      drawWindowPanel( (int) (h/2.2f), 3, faceW, faceH, 0.0f );
-    glPopMatrix();
+// -------------------------- Mesh library --------------------------
+// Every primitive the scene uses (cube, spheres, tori, cones, cylinders) is
+// tessellated once at startup into an indexed mesh and kept in a pool, so the
+// frame loop never recomputes trig or allocates GLU quadrics. Meshes follow
+// the GLUT/GLU conventions they replace: spheres, tori and cones are built
+// around +Z, cones and cylinders start at z = 0.
+struct Mesh {
+    std::vector<GLfloat> verts;     // interleaved GL_N3F_V3F
+    std::vector<GLushort> indices;  // GL_TRIANGLES
+    GLuint vbo = 0, ibo = 0;
+
+    void vertex(float nx, float ny, float nz, float x, float y, float z) {
+        verts.push_back(nx); verts.push_back(ny); verts.push_back(nz);
+        verts.push_back(x);  verts.push_back(y);  verts.push_back(z);
+    }
+    GLushort vertexCount() const { return (GLushort) (verts.size() / 6); }
+    // Two triangles for the grid cell whose top-left corner is vertex a,
+    // in a grid with `stride` vertices per row
+    void quad(int a, int stride) {
+        GLushort i0 = a, i1 = a + 1, i2 = a + stride, i3 = a + stride + 1;
+        indices.push_back(i0); indices.push_back(i2); indices.push_back(i1);
+        indices.push_back(i1); indices.push_back(i2); indices.push_back(i3);
+    }
+};
 
-    // Left side face
-    glPushMatrix();
-      glTranslatef(bx - w/2.0f, h/2.0f, bz);
-      glRotatef(-90.0f, 0,1,0);
-      faceW = d * 0.92f;
-      faceH = h * 0.62f;
-      drawWindowPanel( (int) (h/2.2f), 2, faceW, faceH, 0.0f );
-    glPopMatrix();
+enum MeshKind { MESH_CUBE, MESH_SPHERE, MESH_TORUS, MESH_CONE, MESH_CYLINDER };
 
-    // Right side face
-    glPushMatrix();
-      glTranslatef(bx + w/2.0f, h/2.0f, bz);
-      glRotatef(90.0f, 0,1,0);
-      faceW = d * 0.92f;
-      faceH = h * 0.62f;
-      drawWindowPanel( (int) (h/2.2f), 2, faceW, faceH, 0.0f );
-    glPopMatrix();
+struct MeshKey {
+    int kind;
+    float a, b, c;   // shape parameters (radii, height)
+    int n1, n2;      // tessellation
 
-    // Roof detail - darker when rainy
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.15f, 0.15f, 0.15f, 5.0f);
-    } else {
-        setMaterialRGB(0.1f, 0.1f, 0.12f, 3.0f); // Darker, wet roof
+    bool operator<(const MeshKey &o) const {
+        if (kind != o.kind) return kind < o.kind;
+        if (a != o.a) return a < o.a;
+        if (b != o.b) return b < o.b;
+        if (c != o.c) return c < o.c;
+        if (n1 != o.n1) return n1 < o.n1;
+        return n2 < o.n2;
     }
-    drawBox(bx, h + 0.25f, bz, w*1.02f, 0.4f, d*1.02f);
-}
-
-void drawBuildingShadow(const Building &B, float sunX, float sunY, float sunZ) {
-    // Don't draw shadows during heavy rain
-    if (currentWeather == RAINY && rainIntensity > 0.7f) return;
-
-    glDisable(GL_LIGHTING);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+};
 
-    // Lighter shadows during rainy weather
-    if (currentWeather == SUNNY) {
-        glColor4f(0.0f, 0.0f, 0.0f, 0.3f);
-    } else {
-        glColor4f(0.0f, 0.0f, 0.0f, 0.15f * (1.0f - rainIntensity));
+std::vector<Mesh> meshPool;
+std::map<MeshKey, int> meshIndex;
+
+void buildCube(Mesh &m) {
+    static const float n[6][3] = {
+        { 1,0,0 }, { -1,0,0 }, { 0,1,0 }, { 0,-1,0 }, { 0,0,1 }, { 0,0,-1 }
+    };
+    static const float v[6][4][3] = {
+        { { 1,-1, 1}, { 1,-1,-1}, { 1, 1,-1}, { 1, 1, 1} },
+        { {-1,-1,-1}, {-1,-1, 1}, {-1, 1, 1}, {-1, 1,-1} },
+        { {-1, 1, 1}, { 1, 1, 1}, { 1, 1,-1}, {-1, 1,-1} },
+        { {-1,-1,-1}, { 1,-1,-1}, { 1,-1, 1}, {-1,-1, 1} },
+        { {-1,-1, 1}, { 1,-1, 1}, { 1, 1, 1}, {-1, 1, 1} },
+        { { 1,-1,-1}, {-1,-1,-1}, {-1, 1,-1}, { 1, 1,-1} }
+    };
+    for (int f = 0; f < 6; ++f) {
+        GLushort base = m.vertexCount();
+        for (int k = 0; k < 4; ++k) {
+            m.vertex(n[f][0], n[f][1], n[f][2], v[f][k][0]*0.5f, v[f][k][1]*0.5f, v[f][k][2]*0.5f);
+        }
+        GLushort idx[6] = { 0, 1, 2, 0, 2, 3 };
+        for (GLushort i : idx) m.indices.push_back(base + i);
     }
+}
 
-    glPushMatrix();
-      glTranslatef(B.x, 0.005f, B.z);
-      float lightDirX = B.x - sunX;
-      float lightDirZ = B.z - sunZ;
-      float shadowOffsetX = -lightDirX * 0.05f;
-      float shadowOffsetZ = -lightDirZ * 0.05f;
-
-      glBegin(GL_QUADS);
-        glNormal3f(0,1,0);
-        glVertex3f(-B.w/2 + shadowOffsetX, 0, -B.d/2 + shadowOffsetZ);
-        glVertex3f( B.w/2 + shadowOffsetX, 0, -B.d/2 + shadowOffsetZ);
-        glVertex3f( B.w/2 + shadowOffsetX, 0,  B.d/2 + shadowOffsetZ);
-        glVertex3f(-B.w/2 + shadowOffsetX, 0,  B.d/2 + shadowOffsetZ);
-      glEnd();
-    glPopMatrix();
+// Unit-radius sphere
+void buildSphere(Mesh &m, int slices, int stacks) {
+    for (int st = 0; st <= stacks; ++st) {
+        float phi = M_PI * st / stacks;
+        for (int sl = 0; sl <= slices; ++sl) {
+            float theta = 2.0f * M_PI * sl / slices;
+            float x = sinf(phi) * cosf(theta), y = sinf(phi) * sinf(theta), z = cosf(phi);
+            m.vertex(x, y, z, x, y, z);
+        }
+    }
+    for (int st = 0; st < stacks; ++st)
+        for (int sl = 0; sl < slices; ++sl)
+            m.quad(st * (slices + 1) + sl, slices + 1);
+}
 
-    glDisable(GL_BLEND);
-    glEnable(GL_LIGHTING);
+// Torus around +Z: tube radius `inner`, ring radius `outer` (glutSolidTorus)
+void buildTorus(Mesh &m, float inner, float outer, int sides, int rings) {
+    for (int i = 0; i <= rings; ++i) {
+        float theta = 2.0f * M_PI * i / rings;
+        for (int j = 0; j <= sides; ++j) {
+            float phi = 2.0f * M_PI * j / sides;
+            float nx = cosf(phi) * cosf(theta), ny = cosf(phi) * sinf(theta), nz = sinf(phi);
+            float dist = outer + inner * cosf(phi);
+            m.vertex(nx, ny, nz, dist * cosf(theta), dist * sinf(theta), inner * sinf(phi));
+        }
+    }
+    for (int i = 0; i < rings; ++i)
+        for (int j = 0; j < sides; ++j)
+            m.quad(i * (sides + 1) + j, sides + 1);
 }
 
-void drawTree(float x, float z, float scale=1.0f) {
-    // trunk
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.45f, 0.25f, 0.1f, 10.0f);
-    } else {
-        setMaterialRGB(0.35f, 0.2f, 0.08f, 8.0f); // Darker, wet trunk
+// Unit cone: base radius 1 at z = 0, apex at z = 1, with a base cap
+void buildCone(Mesh &m, int slices, int stacks) {
+    const float k = 1.0f / sqrtf(2.0f);
+    for (int st = 0; st <= stacks; ++st) {
+        float z = (float) st / stacks;
+        float r = 1.0f - z;
+        for (int sl = 0; sl <= slices; ++sl) {
+            float theta = 2.0f * M_PI * sl / slices;
+            m.vertex(cosf(theta) * k, sinf(theta) * k, k, r * cosf(theta), r * sinf(theta), z);
+        }
     }
-    glPushMatrix();
-      glTranslatef(x, 0.8f, z);
-      glRotatef(-90, 1, 0, 0);
-      GLUquadric* q = gluNewQuadric();
-      gluCylinder(q, 0.18f*scale, 0.15f*scale, 1.6f*scale, 8, 1);
-      gluDeleteQuadric(q);
-    glPopMatrix();
+    for (int st = 0; st < stacks; ++st)
+        for (int sl = 0; sl < slices; ++sl)
+            m.quad(st * (slices + 1) + sl, slices + 1);
+
+    GLushort center = m.vertexCount();
+    m.vertex(0, 0, -1, 0, 0, 0);
+    for (int sl = 0; sl <= slices; ++sl) {
+        float theta = 2.0f * M_PI * sl / slices;
+        m.vertex(0, 0, -1, cosf(theta), sinf(theta), 0);
+    }
+    for (int sl = 0; sl < slices; ++sl) {
+        m.indices.push_back(center);
+        m.indices.push_back(center + 2 + sl);
+        m.indices.push_back(center + 1 + sl);
+    }
+}
 
-    // leaves
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.1f, 0.5f, 0.12f, 10.0f);
-    } else {
-        setMaterialRGB(0.08f, 0.4f, 0.1f, 8.0f); // Darker, wet leaves
+// Open cylinder along +Z from z = 0 to z = height (gluCylinder)
+void buildCylinder(Mesh &m, float base, float top, float height, int slices, int stacks) {
+    float nz = (base - top) / height;
+    float len = sqrtf(1.0f + nz * nz);
+    for (int st = 0; st <= stacks; ++st) {
+        float t = (float) st / stacks;
+        float r = base + (top - base) * t;
+        for (int sl = 0; sl <= slices; ++sl) {
+            float theta = 2.0f * M_PI * sl / slices;
+            m.vertex(cosf(theta) / len, sinf(theta) / len, nz / len,
+                     r * cosf(theta), r * sinf(theta), height * t);
+        }
     }
-    for (int i=0;i<3;i++) {
-        glPushMatrix();
-          glTranslatef(x, 1.6f + i*0.7f*scale, z);
-          glRotatef(-90, 1, 0, 0);
-          glutSolidCone(0.9f*scale - 0.2f*i*scale, 1.0f*scale, 12, 4);
-        glPopMatrix();
+    for (int st = 0; st < stacks; ++st)
+        for (int sl = 0; sl < slices; ++sl)
+            m.quad(st * (slices + 1) + sl, slices + 1);
+}
+
+// Put a tessellated mesh in the pool (and in buffer objects when available)
+int addMesh(const MeshKey &key, Mesh &m) {
+    if (hasVertexBufferObjects()) {
+        glGenBuffers(1, &m.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+        glBufferData(GL_ARRAY_BUFFER, m.verts.size() * sizeof(GLfloat), m.verts.data(), GL_STATIC_DRAW);
+        glGenBuffers(1, &m.ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.indices.size() * sizeof(GLushort), m.indices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    meshPool.push_back(std::move(m));
+    meshIndex[key] = (int) meshPool.size() - 1;
+    return (int) meshPool.size() - 1;
+}
+
+int findOrCreateMesh(const MeshKey &key) {
+    auto it = meshIndex.find(key);
+    if (it != meshIndex.end()) return it->second;
+
+    Mesh m;
+    switch (key.kind) {
+        case MESH_CUBE:     buildCube(m); break;
+        case MESH_SPHERE:   buildSphere(m, key.n1, key.n2); break;
+        case MESH_TORUS:    buildTorus(m, key.a, key.b, key.n1, key.n2); break;
+        case MESH_CONE:     buildCone(m, key.n1, key.n2); break;
+        case MESH_CYLINDER: buildCylinder(m, key.a, key.b, key.c, key.n1, key.n2); break;
     }
+    return addMesh(key, m);
+}
+
+int cubeMesh()                                 { return findOrCreateMesh({ MESH_CUBE, 0, 0, 0, 0, 0 }); }
+int sphereMesh(int slices, int stacks)         { return findOrCreateMesh({ MESH_SPHERE, 0, 0, 0, slices, stacks }); }
+int coneMesh(int slices, int stacks)           { return findOrCreateMesh({ MESH_CONE, 0, 0, 0, slices, stacks }); }
+int torusMesh(float inner, float outer, int sides, int rings) {
+    return findOrCreateMesh({ MESH_TORUS, inner, outer, 0, sides, rings });
+}
+int cylinderMesh(float base, float top, float height, int slices, int stacks) {
+    return findOrCreateMesh({ MESH_CYLINDER, base, top, height, slices, stacks });
+}
+
+// Handles to every mesh the draw functions use, filled by initMeshLibrary()
+struct MeshLibrary {
+    int cube;
+    int doorKnob, head, headlight;        // spheres
+    int sunOuter, sunInner;               // spheres
+    int wheelSedan, wheelSUV, wheelSports, wheelTruck;
+    int treeTrunk, treeCone;
+
+    // Reduced tessellation for the distant levels of detail
+    int headLow;
+    int wheelSedanLow, wheelSUVLow, wheelSportsLow, wheelTruckLow;
+    int treeTrunkLow, treeConeLow, treeImpostor;
+};
+MeshLibrary meshes;
+
+void initMeshLibrary() {
+    meshes.cube        = cubeMesh();
+    meshes.doorKnob    = sphereMesh(8, 8);
+    meshes.head        = sphereMesh(10, 8);
+    meshes.headlight   = sphereMesh(8, 8);
+    meshes.sunOuter    = sphereMesh(24, 20);
+    meshes.sunInner    = sphereMesh(20, 16);
+    meshes.wheelSedan  = torusMesh(0.08f, 0.12f, 8, 12);
+    meshes.wheelSUV    = torusMesh(0.1f, 0.15f, 8, 12);
+    meshes.wheelSports = torusMesh(0.06f, 0.1f, 8, 12);
+    meshes.wheelTruck  = torusMesh(0.12f, 0.18f, 8, 12);
+    meshes.treeTrunk   = cylinderMesh(0.18f, 0.15f, 1.6f, 8, 1);
+    meshes.treeCone    = coneMesh(12, 4);
+
+    meshes.headLow        = sphereMesh(5, 4);
+    meshes.wheelSedanLow  = torusMesh(0.08f, 0.12f, 4, 6);
+    meshes.wheelSUVLow    = torusMesh(0.1f, 0.15f, 4, 6);
+    meshes.wheelSportsLow = torusMesh(0.06f, 0.1f, 4, 6);
+    meshes.wheelTruckLow  = torusMesh(0.12f, 0.18f, 4, 6);
+    meshes.treeTrunkLow   = cylinderMesh(0.18f, 0.15f, 1.6f, 4, 1);
+    meshes.treeConeLow    = coneMesh(6, 1);
+    meshes.treeImpostor   = coneMesh(4, 1);
 }
 
-void drawGrassPatch(float x, float z, float w, float d) {
-    // Base grass surface - adjust color based on weather
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.16f, 0.55f, 0.2f, 2.0f);
+void bindMesh(int id) {
+    const Mesh &m = meshPool[id];
+    if (m.vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+        glInterleavedArrays(GL_N3F_V3F, 0, nullptr);
     } else {
-        setMaterialRGB(0.12f, 0.45f, 0.16f, 1.0f); // Darker, wet grass
+        glInterleavedArrays(GL_N3F_V3F, 0, m.verts.data());
     }
+}
+
+// Draw the mesh last passed to bindMesh()
+void drawBoundMesh(int id) {
+    const Mesh &m = meshPool[id];
+    frameStats.drawCalls++;
+    glDrawElements(GL_TRIANGLES, (GLsizei) m.indices.size(), GL_UNSIGNED_SHORT,
+                   m.vbo ? nullptr : m.indices.data());
+}
+
+void unbindMesh(int id) {
+    if (meshPool[id].vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+void drawMesh(int id) {
+    bindMesh(id);
+    drawBoundMesh(id);
+    unbindMesh(id);
+}
 
+// Unit-radius sphere mesh scaled to `radius`
+void drawSphere(int id, float radius) {
     glPushMatrix();
-      glTranslatef(x, 0.001f, z);
-      glBegin(GL_QUADS);
-        glNormal3f(0,1,0);
-        glVertex3f(-w/2, 0, -d/2);
-        glVertex3f( w/2, 0, -d/2);
-        glVertex3f( w/2, 0,  d/2);
-        glVertex3f(-w/2, 0,  d/2);
-      glEnd();
+    glScalef(radius, radius, radius);
+    drawMesh(id);
     glPopMatrix();
+}
 
-    // Detailed grass blades
-    glDisable(GL_LIGHTING);
+// Simple box (centered) helper using the unit cube scaled
+void drawBox(float cx, float cy, float cz, float sx, float sy, float sz) {
     glPushMatrix();
-      glTranslatef(x, 0.0f, z);
-
-      GLfloat darkGreen[3], mediumGreen[3], lightGreen[3];
-      if (currentWeather == SUNNY) {
-          darkGreen[0]=0.08f; darkGreen[1]=0.45f; darkGreen[2]=0.12f;
-          mediumGreen[0]=0.12f; mediumGreen[1]=0.55f; mediumGreen[2]=0.15f;
-          lightGreen[0]=0.15f; lightGreen[1]=0.65f; lightGreen[2]=0.18f;
-      } else {
-          darkGreen[0]=0.06f; darkGreen[1]=0.35f; darkGreen[2]=0.1f;
-          mediumGreen[0]=0.09f; mediumGreen[1]=0.45f; mediumGreen[2]=0.12f;
-          lightGreen[0]=0.12f; lightGreen[1]=0.55f; lightGreen[2]=0.14f;
-      }
+    glTranslatef(cx, cy, cz);
+    glScalef(sx, sy, sz);
+    drawMesh(meshes.cube);
+    glPopMatrix();
+}
 
-      glLineWidth(1.5f);
-      glBegin(GL_LINES);
-        for (int i=0; i < 200; i++) {
-          float rx = (rand()%1000)/1000.0f * w - w/2;
-          float rz = (rand()%1000)/1000.0f * d - d/2;
-          float height = 0.15f + (rand()%30)/200.0f;
-          float curve = (rand()%100)/500.0f - 0.1f;
-          float leanX = (rand()%100)/300.0f - 0.16f;
-          float leanZ = (rand()%100)/300.0f - 0.16f;
+// -------------------------- Matrix helpers --------------------------
+// Column-major 4x4 matrices with the same conventions as the GL matrix stack
+struct Mat4 {
+    float m[16];
+};
 
-          int shade = rand() % 3;
-          switch(shade) {
-            case 0: glColor3fv(darkGreen); break;
-            case 1: glColor3fv(mediumGreen); break;
-            case 2: glColor3fv(lightGreen); break;
-          }
+Mat4 mat4Identity() {
+    Mat4 r = {{ 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 }};
+    return r;
+}
 
-          glVertex3f(rx, 0.0f, rz);
-          glVertex3f(rx + leanX + curve, height, rz + leanZ);
+Mat4 mat4Mul(const Mat4 &a, const Mat4 &b) {
+    Mat4 r;
+    for (int c = 0; c < 4; ++c) {
+        for (int row = 0; row < 4; ++row) {
+            r.m[c*4 + row] = a.m[0*4 + row] * b.m[c*4 + 0] + a.m[1*4 + row] * b.m[c*4 + 1]
+                           + a.m[2*4 + row] * b.m[c*4 + 2] + a.m[3*4 + row] * b.m[c*4 + 3];
         }
-      glEnd();
+    }
+    return r;
+}
 
-    glPopMatrix();
-    glEnable(GL_LIGHTING);
+// In-place equivalents of glTranslatef / glScalef / glRotatef
+void mat4Translate(Mat4 &a, float x, float y, float z) {
+    for (int row = 0; row < 4; ++row)
+        a.m[12 + row] += a.m[row] * x + a.m[4 + row] * y + a.m[8 + row] * z;
 }
 
-void drawHuman(const Human &h) {
-    glPushMatrix();
-      glTranslatef(h.x, 0.0f, h.z);
+void mat4Scale(Mat4 &a, float x, float y, float z) {
+    for (int row = 0; row < 4; ++row) {
+        a.m[row] *= x;
+        a.m[4 + row] *= y;
+        a.m[8 + row] *= z;
+    }
+}
 
-      // body
-      if (currentWeather == SUNNY) {
-          setMaterialRGB(0.8f,0.55f,0.45f, 10.0f);
-      } else {
-          setMaterialRGB(0.7f,0.5f,0.4f, 8.0f); // Darker skin tone in rain
-      }
+void mat4Rotate(Mat4 &a, float angleDeg, float x, float y, float z) {
+    float len = sqrtf(x*x + y*y + z*z);
+    if (len == 0.0f) return;
+    x /= len; y /= len; z /= len;
+    float rad = angleDeg * M_PI / 180.0f;
+    float c = cosf(rad), s = sinf(rad), t = 1.0f - c;
+    Mat4 r = {{ t*x*x + c,   t*x*y + s*z, t*x*z - s*y, 0,
+                t*x*y - s*z, t*y*y + c,   t*y*z + s*x, 0,
+                t*x*z + s*y, t*y*z - s*x, t*z*z + c,   0,
+                0, 0, 0, 1 }};
+    a = mat4Mul(a, r);
+}
 
-      glPushMatrix();
-        glTranslatef(0.0f, 0.9f, 0.0f);
-        glScalef(0.35f, 0.7f, 0.25f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
+// Equivalent of gluPerspective
+Mat4 mat4Perspective(float fovyDeg, float aspect, float zNear, float zFar) {
+    float f = 1.0f / tanf(fovyDeg * M_PI / 360.0f);
+    Mat4 r = {{ f / aspect, 0, 0, 0,
+                0, f, 0, 0,
+                0, 0, (zFar + zNear) / (zNear - zFar), -1,
+                0, 0, 2.0f * zFar * zNear / (zNear - zFar), 0 }};
+    return r;
+}
 
-      // head
-      if (currentWeather == SUNNY) {
-          setMaterialRGB(0.95f, 0.85f, 0.76f, 10.0f);
-      } else {
-          setMaterialRGB(0.85f, 0.75f, 0.66f, 8.0f);
-      }
+// Equivalent of gluLookAt
+Mat4 mat4LookAt(float ex, float ey, float ez, float cx, float cy, float cz,
+                float ux, float uy, float uz) {
+    float fx = cx - ex, fy = cy - ey, fz = cz - ez;
+    float fl = sqrtf(fx*fx + fy*fy + fz*fz);
+    fx /= fl; fy /= fl; fz /= fl;
+    float sx = fy*uz - fz*uy, sy = fz*ux - fx*uz, sz = fx*uy - fy*ux;
+    float sl = sqrtf(sx*sx + sy*sy + sz*sz);
+    sx /= sl; sy /= sl; sz /= sl;
+    float vx = sy*fz - sz*fy, vy = sz*fx - sx*fz, vz = sx*fy - sy*fx;
+    Mat4 r = {{ sx, vx, -fx, 0,
+                sy, vy, -fy, 0,
+                sz, vz, -fz, 0,
+                -(sx*ex + sy*ey + sz*ez), -(vx*ex + vy*ey + vz*ez), fx*ex + fy*ey + fz*ez, 1 }};
+    return r;
+}
 
-      glPushMatrix();
-        glTranslatef(0.0f, 1.5f, 0.0f);
-        glutSolidSphere(0.18f, 10, 8);
-      glPopMatrix();
+// -------------------------- Frustum --------------------------
+struct AABB {
+    float minX, minY, minZ;
+    float maxX, maxY, maxZ;
 
-      // legs
-      setMaterialRGB(0.15f, 0.15f, 0.18f, 5.0f);
-      float swing = sinf(h.phase*6.28f) * 0.25f;
-      glPushMatrix();
-        glTranslatef(-0.09f + 0.02f*swing, 0.35f, 0.0f);
-        glScalef(0.12f, 0.7f, 0.12f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      glPushMatrix();
-        glTranslatef(0.09f - 0.02f*swing, 0.35f, 0.0f);
-        glScalef(0.12f, 0.7f, 0.12f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
+    void expand(const AABB &o) {
+        minX = fminf(minX, o.minX); minY = fminf(minY, o.minY); minZ = fminf(minZ, o.minZ);
+        maxX = fmaxf(maxX, o.maxX); maxY = fmaxf(maxY, o.maxY); maxZ = fmaxf(maxZ, o.maxZ);
+    }
+};
 
-      // arms
-      setMaterialRGB(0.18f, 0.14f, 0.1f, 5.0f);
-      glPushMatrix();
-        glTranslatef(-0.28f, 1.05f, 0.0f);
-        glRotatef(swing*30.0f, 1,0,0);
-        glScalef(0.1f, 0.6f, 0.1f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      glPushMatrix();
-        glTranslatef(0.28f, 1.05f, 0.0f);
-        glRotatef(-swing*30.0f, 1,0,0);
-        glScalef(0.1f, 0.6f, 0.1f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-    glPopMatrix();
+const AABB EMPTY_AABB = { 1e30f, 1e30f, 1e30f, -1e30f, -1e30f, -1e30f };
+
+struct Plane {
+    float a, b, c, d;   // a*x + b*y + c*z + d >= 0 inside
+};
+
+enum CullResult { CULL_OUTSIDE, CULL_INTERSECT, CULL_INSIDE };
+
+struct Frustum {
+    Plane planes[6];   // left, right, bottom, top, near, far
+
+    // Gribb/Hartmann plane extraction from projection * view
+    void extract(const Mat4 &clip) {
+        const float *m = clip.m;
+        for (int i = 0; i < 3; ++i) {
+            Plane &lo = planes[i*2];
+            Plane &hi = planes[i*2 + 1];
+            lo = { m[3] + m[i], m[7] + m[4 + i], m[11] + m[8 + i], m[15] + m[12 + i] };
+            hi = { m[3] - m[i], m[7] - m[4 + i], m[11] - m[8 + i], m[15] - m[12 + i] };
+        }
+    }
+
+    CullResult classify(const AABB &box) const {
+        CullResult result = CULL_INSIDE;
+        for (const Plane &p : planes) {
+            // Corner furthest along the plane normal, and the opposite one
+            float px = p.a >= 0 ? box.maxX : box.minX;
+            float py = p.b >= 0 ? box.maxY : box.minY;
+            float pz = p.c >= 0 ? box.maxZ : box.minZ;
+            if (p.a*px + p.b*py + p.c*pz + p.d < 0) return CULL_OUTSIDE;
+            float nx = p.a >= 0 ? box.minX : box.maxX;
+            float ny = p.b >= 0 ? box.minY : box.maxY;
+            float nz = p.c >= 0 ? box.minZ : box.maxZ;
+            if (p.a*nx + p.b*ny + p.c*nz + p.d < 0) result = CULL_INTERSECT;
+        }
+        return result;
+    }
+
+    bool visible(const AABB &box) const { return classify(box) != CULL_OUTSIDE; }
+};
+
+Mat4 projMatrix = mat4Identity();
+Mat4 viewMatrix = mat4Identity();
+Frustum viewFrustum;
+
+// -------------------------- Weather palette --------------------------
+// Every weather-dependent colour lives in one table with a sunny and a rainy
+// value per material. The palette blends them by rainIntensity, quantized to
+// PALETTE_STEPS, and is only recomputed when that step changes. Each material
+// also gets a tiny display list holding its glMaterial calls; the cached city
+// lists call those instead of baking colours, so recompiling the tiny lists
+// recolours the whole city without touching its geometry.
+enum MaterialId {
+    MAT_GROUND, MAT_GRASS, MAT_ROAD, MAT_SIDEWALK,
+    MAT_BUILDING, MAT_ROOF, MAT_DOOR, MAT_DOOR_KNOB,
+    MAT_WINDOW_FRAME, MAT_GLASS, MAT_SILL,
+    MAT_TRUNK, MAT_LEAVES,
+    MAT_SKIN, MAT_FACE, MAT_TROUSERS, MAT_SLEEVES,
+    MAT_BLADE_DARK, MAT_BLADE_MID, MAT_BLADE_LIGHT,     // unlit grass blade colours
+    MAT_COUNT
+};
+
+struct PaletteEntry {
+    float sunny[4];     // r, g, b, shininess
+    float rainy[4];
+};
+
+// Rain darkens most surfaces and gives them a duller highlight
+const PaletteEntry PALETTE_TABLE[MAT_COUNT] = {
+    { { 0.16f, 0.55f, 0.2f, 2.0f },    { 0.12f, 0.45f, 0.16f, 1.0f } },   // ground
+    { { 0.16f, 0.55f, 0.2f, 2.0f },    { 0.12f, 0.45f, 0.16f, 1.0f } },   // grass strip
+    { { 0.08f, 0.08f, 0.08f, 5.0f },   { 0.05f, 0.05f, 0.06f, 3.0f } },   // road
+    { { 0.5f, 0.5f, 0.5f, 2.0f },      { 0.4f, 0.4f, 0.45f, 1.0f } },     // sidewalk
+    { { 0.58f, 0.58f, 0.62f, 30.0f },  { 0.45f, 0.45f, 0.5f, 20.0f } },   // building walls
+    { { 0.15f, 0.15f, 0.15f, 5.0f },   { 0.1f, 0.1f, 0.12f, 3.0f } },     // roof
+    { { 0.36f, 0.22f, 0.1f, 10.0f },   { 0.36f, 0.22f, 0.1f, 10.0f } },   // door
+    { { 0.9f, 0.82f, 0.2f, 10.0f },    { 0.9f, 0.82f, 0.2f, 10.0f } },    // door knob
+    { { 0.15f, 0.15f, 0.15f, 5.0f },   { 0.15f, 0.15f, 0.15f, 5.0f } },   // window frame
+    { { 0.7f, 0.85f, 1.0f, 80.0f },    { 0.5f, 0.6f, 0.8f, 60.0f } },     // glass
+    { { 0.3f, 0.3f, 0.3f, 10.0f },     { 0.3f, 0.3f, 0.3f, 10.0f } },     // window sill
+    { { 0.45f, 0.25f, 0.1f, 10.0f },   { 0.35f, 0.2f, 0.08f, 8.0f } },    // trunk
+    { { 0.1f, 0.5f, 0.12f, 10.0f },    { 0.08f, 0.4f, 0.1f, 8.0f } },     // leaves
+    { { 0.8f, 0.55f, 0.45f, 10.0f },   { 0.7f, 0.5f, 0.4f, 8.0f } },      // body
+    { { 0.95f, 0.85f, 0.76f, 10.0f },  { 0.85f, 0.75f, 0.66f, 8.0f } },   // head
+    { { 0.15f, 0.15f, 0.18f, 5.0f },   { 0.15f, 0.15f, 0.18f, 5.0f } },   // legs
+    { { 0.18f, 0.14f, 0.1f, 5.0f },    { 0.18f, 0.14f, 0.1f, 5.0f } },    // arms
+    { { 0.08f, 0.45f, 0.12f, 0.0f },   { 0.06f, 0.35f, 0.1f, 0.0f } },    // blades
+    { { 0.12f, 0.55f, 0.15f, 0.0f },   { 0.09f, 0.45f, 0.12f, 0.0f } },
+    { { 0.15f, 0.65f, 0.18f, 0.0f },   { 0.12f, 0.55f, 0.14f, 0.0f } },
+};
+
+struct WeatherLight {
+    float sunDiffuse[4];
+    float sunAmbient[4];
+    float globalAmbient[4];
+    float sky[4];
+};
+// Sunny is bright and warm under a blue sky, rainy dark and cool under grey
+const WeatherLight SUNNY_LIGHT = {
+    { 1.0f, 0.88f, 0.55f, 1.0f }, { 0.28f, 0.23f, 0.15f, 1.0f },
+    { 0.22f, 0.22f, 0.22f, 1.0f }, { 0.53f, 0.81f, 0.98f, 1.0f }
+};
+const WeatherLight RAINY_LIGHT = {
+    { 0.4f, 0.4f, 0.5f, 1.0f }, { 0.15f, 0.15f, 0.2f, 1.0f },
+    { 0.1f, 0.1f, 0.15f, 1.0f }, { 0.4f, 0.4f, 0.5f, 1.0f }
+};
+
+const int PALETTE_STEPS = 32;
+
+struct WeatherPalette {
+    int step = -1;                      // quantized rain weight, -1 before the first update
+    unsigned version = 0;               // bumped on every recompute
+    float colors[MAT_COUNT][4];
+    GLuint lists = 0;                   // MAT_COUNT consecutive material lists
+};
+WeatherPalette weatherPalette;
+
+void lerp4(const float *a, const float *b, float t, float *out) {
+    for (int k = 0; k < 4; ++k) out[k] = a[k] + (b[k] - a[k]) * t;
 }
 
-// Car drawing functions (sedan, SUV, sports car, truck) remain the same
-void drawSedan(const Car &c) {
-    glPushMatrix();
-      glTranslatef(c.laneX, 0.3f, c.z);
-      setMaterialRGB(c.r, c.g, c.b, 30.0f);
-      glPushMatrix();
-        glScalef(1.0f, 0.45f, 2.2f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.85f, 0.95f, 1.0f, 10.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.25f, -0.3f);
-        glScalef(0.7f, 0.4f, 1.0f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.9f, 0.9f, 0.7f, 50.0f);
-      glPushMatrix();
-        glTranslatef(0.4f, 0.1f, 0.9f);
-        glutSolidSphere(0.08f, 8, 8);
-      glPopMatrix();
-      glPushMatrix();
-        glTranslatef(-0.4f, 0.1f, 0.9f);
-        glutSolidSphere(0.08f, 8, 8);
-      glPopMatrix();
-      setMaterialRGB(0.02f, 0.02f, 0.02f, 5.0f);
-      for (int i=-1;i<=1;i+=2) {
-        for (int j=-1;j<=1;j+=2) {
-          glPushMatrix();
-            glTranslatef(0.55f*j, -0.15f, 0.6f*i);
-            glRotatef(90, 0,1,0);
-            glRotatef(c.wheelRotation, 0,0,1);
-            glutSolidTorus(0.08, 0.12, 8, 12);
-          glPopMatrix();
+// Blend the table and the lights for the current rainIntensity, if it moved a step
+void updateWeatherPalette() {
+    WeatherPalette &p = weatherPalette;
+    int step = (int) lroundf(rainIntensity * PALETTE_STEPS);
+    if (step == p.step) return;
+    p.step = step;
+    p.version++;
+    float w = (float) step / PALETTE_STEPS;
+
+    if (p.lists == 0) p.lists = glGenLists(MAT_COUNT);
+    for (int id = 0; id < MAT_COUNT; ++id) {
+        float *c = p.colors[id];
+        lerp4(PALETTE_TABLE[id].sunny, PALETTE_TABLE[id].rainy, w, c);
+        glNewList(p.lists + id, GL_COMPILE);
+          setMaterialRGB(c[0], c[1], c[2], c[3]);
+        glEndList();
+    }
+
+    WeatherLight l;
+    lerp4(SUNNY_LIGHT.sunDiffuse, RAINY_LIGHT.sunDiffuse, w, l.sunDiffuse);
+    lerp4(SUNNY_LIGHT.sunAmbient, RAINY_LIGHT.sunAmbient, w, l.sunAmbient);
+    lerp4(SUNNY_LIGHT.globalAmbient, RAINY_LIGHT.globalAmbient, w, l.globalAmbient);
+    lerp4(SUNNY_LIGHT.sky, RAINY_LIGHT.sky, w, l.sky);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, l.sunDiffuse);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, l.sunAmbient);
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, l.globalAmbient);
+    glClearColor(l.sky[0], l.sky[1], l.sky[2], l.sky[3]);
+}
+
+// Set a palette material; inside a display list this records a call to the
+// material's list, so the compiled geometry follows later palette changes
+void applyMaterial(MaterialId id) {
+    glCallList(weatherPalette.lists + id);
+}
+
+const float* paletteColor(MaterialId id) {
+    return weatherPalette.colors[id];
+}
+
+// -------------------------- Render queue --------------------------
+// The dynamic actors record what they draw instead of issuing GL calls right
+// away. Each item carries a material key and a model matrix; flush() sorts by
+// material, then mesh, and applies a material only when it differs from the
+// previous item. Every actor part is lit and opaque, so the queue carries no
+// GL state of its own; the vertex stream below groups its batches by StateKey.
+struct MaterialKey {
+    float r, g, b, shininess;
+
+    bool operator<(const MaterialKey &o) const {
+        if (r != o.r) return r < o.r;
+        if (g != o.g) return g < o.g;
+        if (b != o.b) return b < o.b;
+        return shininess < o.shininess;
+    }
+    bool operator==(const MaterialKey &o) const {
+        return r == o.r && g == o.g && b == o.b && shininess == o.shininess;
+    }
+};
+
+struct StateKey {
+    bool lighting;
+    bool blend;
+    float lineWidth;
+
+    bool operator==(const StateKey &o) const {
+        return lighting == o.lighting && blend == o.blend && lineWidth == o.lineWidth;
+    }
+};
+
+// Apply `st`, skipping whatever already matches `prev` (null: apply everything)
+void applyState(const StateKey &st, const StateKey *prev) {
+    if (!prev || prev->lighting != st.lighting) {
+        if (st.lighting) glEnable(GL_LIGHTING); else glDisable(GL_LIGHTING);
+        frameStats.stateChanges++;
+    } else {
+        frameStats.stateChangesAvoided++;
+    }
+    if (!prev || prev->blend != st.blend) {
+        if (st.blend) glEnable(GL_BLEND); else glDisable(GL_BLEND);
+        frameStats.stateChanges++;
+    } else {
+        frameStats.stateChangesAvoided++;
+    }
+    if (!prev || prev->lineWidth != st.lineWidth) {
+        glLineWidth(st.lineWidth);
+        frameStats.stateChanges++;
+    } else {
+        frameStats.stateChangesAvoided++;
+    }
+}
+
+struct DrawItem {
+    uint64_t sortKey;   // material | mesh
+    int material;
+    int mesh;
+    Mat4 model;
+};
+
+struct RenderQueue {
+    std::vector<DrawItem> items;
+    std::vector<MaterialKey> materials;
+    std::map<MaterialKey, int> materialLookup;
+    std::vector<Mat4> stack;
+    int currentMaterial = -1;
+
+    void begin() {
+        items.clear();
+        materials.clear();
+        materialLookup.clear();
+        stack.assign(1, mat4Identity());
+        currentMaterial = -1;
+    }
+
+    // Matrix stack mirroring glPushMatrix/glPopMatrix and friends
+    void push() { stack.push_back(stack.back()); }
+    void pop() { stack.pop_back(); }
+    void translate(float x, float y, float z) { mat4Translate(stack.back(), x, y, z); }
+    void rotate(float a, float x, float y, float z) { mat4Rotate(stack.back(), a, x, y, z); }
+    void scale(float x, float y, float z) { mat4Scale(stack.back(), x, y, z); }
+
+    void material(float r, float g, float b, float shininess) {
+        frameStats.materialRequests++;
+        MaterialKey key = { r, g, b, shininess };
+        if (currentMaterial >= 0 && materials[currentMaterial] == key) return;
+        auto it = materialLookup.find(key);
+        if (it == materialLookup.end()) {
+            materials.push_back(key);
+            it = materialLookup.insert(std::make_pair(key, (int) materials.size() - 1)).first;
         }
-      }
-    glPopMatrix();
+        currentMaterial = it->second;
+    }
+    void material(MaterialId id) {
+        const float *c = paletteColor(id);
+        material(c[0], c[1], c[2], c[3]);
+    }
+
+    void mesh(int id) {
+        DrawItem item;
+        item.material = currentMaterial;
+        item.mesh = id;
+        item.model = stack.back();
+        item.sortKey = ((uint64_t) (currentMaterial + 1) << 16)
+                     | (uint64_t) id;
+        items.push_back(item);
+    }
+
+    // Unit-radius sphere mesh scaled to `radius`
+    void sphere(int id, float radius) {
+        push();
+        scale(radius, radius, radius);
+        mesh(id);
+        pop();
+    }
+
+    void flush() {
+        std::sort(items.begin(), items.end(),
+                  [](const DrawItem &a, const DrawItem &b) { return a.sortKey < b.sortKey; });
+
+        int lastMaterial = -1, lastMesh = -1;
+        for (const DrawItem &item : items) {
+            if (item.material != lastMaterial && item.material >= 0) {
+                const MaterialKey &mk = materials[item.material];
+                setMaterialRGB(mk.r, mk.g, mk.b, mk.shininess);
+                frameStats.materialChanges++;
+                lastMaterial = item.material;
+            }
+            if (item.mesh != lastMesh) {
+                if (lastMesh >= 0) unbindMesh(lastMesh);
+                bindMesh(item.mesh);
+                frameStats.meshBinds++;
+                lastMesh = item.mesh;
+            }
+            glPushMatrix();
+              glMultMatrixf(item.model.m);
+              drawBoundMesh(item.mesh);
+            glPopMatrix();
+            frameStats.drawItems++;
+        }
+        if (lastMesh >= 0) unbindMesh(lastMesh);
+        items.clear();
+    }
+};
+RenderQueue renderQueue;
+
+// -------------------------- Vertex stream --------------------------
+// Replacement for glBegin/glEnd on the per-frame and ground paths. Draw code
+// appends vertices under a primitive type and state; flush() uploads them
+// into a ring-buffered VBO and issues one glDrawArrays per distinct
+// (primitive, state), in the order each state first appeared. The ring is
+// orphaned when it wraps so the driver never waits on draws still in flight.
+// While a display list is being compiled the data goes through client-side
+// arrays instead, which the list copies.
+const size_t STREAM_RING_BYTES = 4 << 20;
+
+struct StreamKey {
+    GLenum prim;
+    StateKey state;
+    float polygonOffset;    // 0: GL_POLYGON_OFFSET_FILL off
+    float r, g, b, a;       // glColor when unlit, material colour when lit
+    float shininess;
+    int material;           // palette material when lit, -1 for r, g, b, shininess
+
+    bool operator==(const StreamKey &o) const {
+        return prim == o.prim && state == o.state && polygonOffset == o.polygonOffset
+            && r == o.r && g == o.g && b == o.b && a == o.a && shininess == o.shininess
+            && material == o.material;
+    }
+};
+
+struct StreamBatch {
+    StreamKey key;
+    std::vector<GLfloat> data;  // GL_N3F_V3F when lit, GL_V3F otherwise
+    size_t offset = 0;          // byte offset in the ring after upload
+};
+
+struct VertexStream {
+    std::vector<StreamBatch> batches;
+    int current = -1;
+    float nx = 0.0f, ny = 1.0f, nz = 0.0f;
+    GLuint vbo = 0;
+    size_t capacity = 0, cursor = 0;    // ring size and write position in bytes
+
+    void select(const StreamKey &key) {
+        if (current >= 0 && batches[current].key == key) return;
+        for (size_t i = 0; i < batches.size(); ++i) {
+            if (batches[i].key == key) { current = (int) i; return; }
+        }
+        batches.push_back(StreamBatch());
+        batches.back().key = key;
+        current = (int) batches.size() - 1;
+    }
+
+    // Flat colour, no lighting
+    void begin(GLenum prim, float r, float g, float b, float a = 1.0f,
+               bool blend = false, float lineWidth = 1.0f) {
+        select({ prim, { false, blend, lineWidth }, 0.0f, r, g, b, a, 0.0f, -1 });
+    }
+    // Lit with a setMaterialRGB material
+    void beginLit(GLenum prim, float r, float g, float b, float shininess,
+                  float polygonOffset = 0.0f) {
+        select({ prim, { true, false, 1.0f }, polygonOffset, r, g, b, 1.0f, shininess, -1 });
+    }
+    // Lit with a palette material, which display lists pick up by reference
+    void beginLit(GLenum prim, MaterialId id, float polygonOffset = 0.0f) {
+        select({ prim, { true, false, 1.0f }, polygonOffset, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, (int) id });
+    }
+
+    void normal(float x, float y, float z) { nx = x; ny = y; nz = z; }
+
+    void vertex(float x, float y, float z) {
+        std::vector<GLfloat> &d = batches[current].data;
+        if (batches[current].key.state.lighting) {
+            d.push_back(nx); d.push_back(ny); d.push_back(nz);
+        }
+        d.push_back(x); d.push_back(y); d.push_back(z);
+    }
+
+    // Room for `count` unlit vertices, for callers that fill in bulk
+    GLfloat* allocate(int count) {
+        std::vector<GLfloat> &d = batches[current].data;
+        size_t at = d.size();
+        d.resize(at + (size_t) count * 3);
+        return d.data() + at;
+    }
+
+    void upload(size_t total) {
+        if (vbo == 0) glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (cursor + total > capacity) {
+            capacity = std::max(std::max(capacity, STREAM_RING_BYTES), total);
+            glBufferData(GL_ARRAY_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+            cursor = 0;
+        }
+        for (StreamBatch &b : batches) {
+            size_t bytes = b.data.size() * sizeof(GLfloat);
+            if (bytes == 0) continue;
+            glBufferSubData(GL_ARRAY_BUFFER, cursor, bytes, b.data.data());
+            b.offset = cursor;
+            cursor += bytes;
+        }
+    }
+
+    void flush() {
+        size_t total = 0;
+        for (const StreamBatch &b : batches) total += b.data.size() * sizeof(GLfloat);
+        if (total == 0) {
+            batches.clear();
+            current = -1;
+            return;
+        }
+
+        // The client attribute stack also saves GL_ARRAY_BUFFER_BINDING, so bind
+        // the ring inside it and let glPopClientAttrib() unbind it again
+        bool useVbo = hasVertexBufferObjects() && glAccounting.compiling == 0;
+        glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+        if (useVbo) upload(total);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        StateKey defaults = { true, false, 1.0f };
+        const StateKey *prev = &defaults;
+        float offset = 0.0f;
+        for (const StreamBatch &b : batches) {
+            if (b.data.empty()) continue;
+            const StreamKey &k = b.key;
+            applyState(k.state, prev);
+            prev = &k.state;
+            if (k.polygonOffset != offset) {
+                if (k.polygonOffset != 0.0f) {
+                    glEnable(GL_POLYGON_OFFSET_FILL);
+                    glPolygonOffset(k.polygonOffset, k.polygonOffset);
+                } else {
+                    glDisable(GL_POLYGON_OFFSET_FILL);
+                }
+                offset = k.polygonOffset;
+            }
+            if (k.state.lighting && k.material >= 0) applyMaterial((MaterialId) k.material);
+            else if (k.state.lighting) setMaterialRGB(k.r, k.g, k.b, k.shininess);
+            else glColor4f(k.r, k.g, k.b, k.a);
+
+            const char *base = useVbo ? (const char*) nullptr + b.offset : (const char*) b.data.data();
+            GLsizei stride = k.state.lighting ? 6 : 3;
+            if (k.state.lighting) {
+                glEnableClientState(GL_NORMAL_ARRAY);
+                glNormalPointer(GL_FLOAT, stride * sizeof(GLfloat), base);
+                glVertexPointer(3, GL_FLOAT, stride * sizeof(GLfloat), base + 3 * sizeof(GLfloat));
+            } else {
+                glDisableClientState(GL_NORMAL_ARRAY);
+                glVertexPointer(3, GL_FLOAT, stride * sizeof(GLfloat), base);
+            }
+            frameStats.drawCalls++;
+            glDrawArrays(k.prim, 0, (GLsizei) (b.data.size() / stride));
+        }
+        glPopClientAttrib();
+
+        // Leave the fixed-function defaults the rest of the frame expects
+        applyState(defaults, prev);
+        if (offset != 0.0f) glDisable(GL_POLYGON_OFFSET_FILL);
+        batches.clear();
+        current = -1;
+    }
+};
+VertexStream vertexStream;
+
+// -------------------------- Rain particles --------------------------
+// Drops are kept as structure-of-arrays in a box that travels with the camera
+// target. Every drop carries its own xorshift32 state, so respawning needs no
+// shared generator and the update runs 4 or 8 drops per instruction. Only
+// the first `capacity * rainIntensity` drops are simulated and drawn.
+const float RAIN_HALF_EXTENT = 100.0f;  // box half-size in x and z
+const float RAIN_TOP = 40.0f;           // height drops fall from
+const float RAIN_SLANT = 0.25f;         // z drift per unit of fall (streak angle)
+const float RAIN_STREAK = 2.0f;         // streak length in y
+const int RAIN_LANES = 8;               // capacity is padded to the widest kernel
+
+enum RainKernel { RAIN_AUTO, RAIN_SCALAR, RAIN_SSE2, RAIN_AVX2 };
+
+struct RainSystem {
+    std::vector<float> x, y, z, speed;
+    std::vector<uint32_t> seed;
+    int capacity = 20000;           // --rain-drops
+    int active = 0;
+    RainKernel kernel = RAIN_AUTO;  // --rain-kernel
+};
+RainSystem rain;
+
+inline uint32_t xorshift32(uint32_t s) {
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
 }
 
-void drawSUV(const Car &c) {
-    glPushMatrix();
-      glTranslatef(c.laneX, 0.4f, c.z);
-      setMaterialRGB(c.r, c.g, c.b, 30.0f);
-      glPushMatrix();
-        glScalef(1.2f, 0.6f, 2.4f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.85f, 0.95f, 1.0f, 10.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.35f, -0.2f);
-        glScalef(0.9f, 0.5f, 1.2f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.3f, 0.3f, 0.3f, 10.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.7f, 0.0f);
-        glScalef(0.8f, 0.05f, 1.8f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.02f, 0.02f, 0.02f, 5.0f);
-      for (int i=-1;i<=1;i+=2) {
-        for (int j=-1;j<=1;j+=2) {
-          glPushMatrix();
-            glTranslatef(0.65f*j, -0.2f, 0.7f*i);
-            glRotatef(90, 0,1,0);
-            glRotatef(c.wheelRotation, 0,0,1);
-            glutSolidTorus(0.1, 0.15, 8, 12);
-          glPopMatrix();
+// Map the top 24 bits of a random word to [-RAIN_HALF_EXTENT, RAIN_HALF_EXTENT)
+inline float rainCoord(uint32_t s) {
+    return (float) (s >> 8) * (2.0f * RAIN_HALF_EXTENT / 16777216.0f) - RAIN_HALF_EXTENT;
+}
+
+void initRain() {
+    int padded = (rain.capacity + RAIN_LANES - 1) / RAIN_LANES * RAIN_LANES;
+    rain.x.resize(padded);
+    rain.y.resize(padded);
+    rain.z.resize(padded);
+    rain.speed.resize(padded);
+    rain.seed.resize(padded);
+
+    Rng rng(worldSeed ^ 0x5EEDF00Du);
+    for (int i = 0; i < padded; i++) {
+        uint32_t s = rng.next() | 1u;   // xorshift must never hold 0
+        rain.seed[i] = s;
+        rain.x[i] = rainCoord(s = xorshift32(s));
+        rain.z[i] = rainCoord(s = xorshift32(s));
+        rain.y[i] = rng.uniform() * RAIN_TOP;
+        rain.speed[i] = 30.0f + 15.0f * rng.uniform();
+    }
+    rain.active = 0;
+}
+
+// Advance drops [begin, end) by `fall` seconds of fall time
+void updateRainScalar(RainSystem &r, int begin, int end, float fall) {
+    for (int i = begin; i < end; i++) {
+        float dy = r.speed[i] * fall;
+        float y = r.y[i] - dy;
+        float z = r.z[i] - RAIN_SLANT * dy;
+        if (y < 0.0f) {
+            uint32_t s = xorshift32(r.seed[i]);
+            r.x[i] = rainCoord(s);
+            s = xorshift32(s);
+            z = rainCoord(s);
+            r.seed[i] = s;
+            y += RAIN_TOP;
         }
-      }
-    glPopMatrix();
+        r.y[i] = y;
+        r.z[i] = z;
+    }
 }
 
-void drawSportsCar(const Car &c) {
-    glPushMatrix();
-      glTranslatef(c.laneX, 0.25f, c.z);
-      setMaterialRGB(c.r, c.g, c.b, 60.0f);
-      glPushMatrix();
-        glScalef(0.9f, 0.3f, 1.8f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.2f, 0.2f, 0.2f, 40.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.2f, -0.2f);
-        glScalef(0.7f, 0.25f, 0.9f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(c.r*0.7f, c.g*0.7f, c.b*0.7f, 30.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.4f, -0.8f);
-        glScalef(0.6f, 0.05f, 0.2f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.02f, 0.02f, 0.02f, 5.0f);
-      for (int i=-1;i<=1;i+=2) {
-        for (int j=-1;j<=1;j+=2) {
-          glPushMatrix();
-            glTranslatef(0.5f*j, -0.1f, 0.5f*i);
-            glRotatef(90, 0,1,0);
-            glRotatef(c.wheelRotation, 0,0,1);
-            glutSolidTorus(0.06, 0.1, 8, 12);
-          glPopMatrix();
+#ifdef CITY_SSE2
+inline __m128i xorshift32x4(__m128i s) {
+    s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+    s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+    return _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+}
+
+inline __m128 rainCoordx4(__m128i s) {
+    __m128 u = _mm_cvtepi32_ps(_mm_srli_epi32(s, 8));
+    return _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(2.0f * RAIN_HALF_EXTENT / 16777216.0f)),
+                      _mm_set1_ps(RAIN_HALF_EXTENT));
+}
+
+// SSE2 has no blendv, so lanes are selected with and/andnot/or
+inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+int updateRainSSE2(RainSystem &r, int begin, int end, float fall) {
+    const __m128 vfall = _mm_set1_ps(fall);
+    const __m128 slant = _mm_set1_ps(RAIN_SLANT);
+    const __m128 top = _mm_set1_ps(RAIN_TOP);
+    const __m128 zero = _mm_setzero_ps();
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 dy = _mm_mul_ps(_mm_loadu_ps(&r.speed[i]), vfall);
+        __m128 y = _mm_sub_ps(_mm_loadu_ps(&r.y[i]), dy);
+        __m128 z = _mm_sub_ps(_mm_loadu_ps(&r.z[i]), _mm_mul_ps(slant, dy));
+        __m128 landed = _mm_cmplt_ps(y, zero);
+        if (_mm_movemask_ps(landed)) {
+            __m128i seed = _mm_loadu_si128((const __m128i*) &r.seed[i]);
+            __m128i s1 = xorshift32x4(seed);
+            __m128i s2 = xorshift32x4(s1);
+            __m128i keep = _mm_castps_si128(landed);
+            seed = _mm_or_si128(_mm_and_si128(keep, s2), _mm_andnot_si128(keep, seed));
+            _mm_storeu_si128((__m128i*) &r.seed[i], seed);
+            _mm_storeu_ps(&r.x[i], select4(landed, rainCoordx4(s1), _mm_loadu_ps(&r.x[i])));
+            z = select4(landed, rainCoordx4(s2), z);
+            y = _mm_add_ps(y, _mm_and_ps(landed, top));
         }
-      }
-    glPopMatrix();
+        _mm_storeu_ps(&r.y[i], y);
+        _mm_storeu_ps(&r.z[i], z);
+    }
+    return i;
 }
+#endif
 
-void drawTruck(const Car &c) {
-    glPushMatrix();
-      glTranslatef(c.laneX, 0.5f, c.z);
-      setMaterialRGB(c.r, c.g, c.b, 30.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.3f, -0.8f);
-        glScalef(1.0f, 0.8f, 1.0f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(c.r*0.8f, c.g*0.8f, c.b*0.8f, 30.0f);
-      glPushMatrix();
-        glTranslatef(0.0f, 0.4f, 0.8f);
-        glScalef(1.4f, 0.9f, 2.0f);
-        glutSolidCube(1.0f);
-      glPopMatrix();
-      setMaterialRGB(0.02f, 0.02f, 0.02f, 5.0f);
-      float wheelPositions[] = {-0.7f, 0.7f, -1.5f, 1.5f};
-      for (int i=0; i<4; i++) {
-        for (int j=-1;j<=1;j+=2) {
-          glPushMatrix();
-            glTranslatef(wheelPositions[i]*j, -0.3f, -0.5f);
-            glRotatef(90, 0,1,0);
-            glRotatef(c.wheelRotation, 0,0,1);
-            glutSolidTorus(0.12, 0.18, 8, 12);
-          glPopMatrix();
+#ifdef CITY_AVX2
+__attribute__((target("avx2")))
+int updateRainAVX2(RainSystem &r, int begin, int end, float fall) {
+    const __m256 vfall = _mm256_set1_ps(fall);
+    const __m256 slant = _mm256_set1_ps(RAIN_SLANT);
+    const __m256 top = _mm256_set1_ps(RAIN_TOP);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 scale = _mm256_set1_ps(2.0f * RAIN_HALF_EXTENT / 16777216.0f);
+    const __m256 half = _mm256_set1_ps(RAIN_HALF_EXTENT);
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 dy = _mm256_mul_ps(_mm256_loadu_ps(&r.speed[i]), vfall);
+        __m256 y = _mm256_sub_ps(_mm256_loadu_ps(&r.y[i]), dy);
+        __m256 z = _mm256_sub_ps(_mm256_loadu_ps(&r.z[i]), _mm256_mul_ps(slant, dy));
+        __m256 landed = _mm256_cmp_ps(y, zero, _CMP_LT_OQ);
+        if (_mm256_movemask_ps(landed)) {
+            __m256i seed = _mm256_loadu_si256((const __m256i*) &r.seed[i]);
+            __m256i s1 = _mm256_xor_si256(seed, _mm256_slli_epi32(seed, 13));
+            s1 = _mm256_xor_si256(s1, _mm256_srli_epi32(s1, 17));
+            s1 = _mm256_xor_si256(s1, _mm256_slli_epi32(s1, 5));
+            __m256i s2 = _mm256_xor_si256(s1, _mm256_slli_epi32(s1, 13));
+            s2 = _mm256_xor_si256(s2, _mm256_srli_epi32(s2, 17));
+            s2 = _mm256_xor_si256(s2, _mm256_slli_epi32(s2, 5));
+            __m256 nx = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(s1, 8)), scale), half);
+            __m256 nz = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(s2, 8)), scale), half);
+            seed = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(seed), _mm256_castsi256_ps(s2), landed));
+            _mm256_storeu_si256((__m256i*) &r.seed[i], seed);
+            _mm256_storeu_ps(&r.x[i], _mm256_blendv_ps(_mm256_loadu_ps(&r.x[i]), nx, landed));
+            z = _mm256_blendv_ps(z, nz, landed);
+            y = _mm256_add_ps(y, _mm256_and_ps(landed, top));
         }
-      }
-      for (int j=-1;j<=1;j+=2) {
-        glPushMatrix();
-          glTranslatef(wheelPositions[3]*j, -0.3f, 1.2f);
-          glRotatef(90, 0,1,0);
-          glRotatef(c.wheelRotation, 0,0,1);
-          glutSolidTorus(0.12, 0.18, 8, 12);
-        glPopMatrix();
-      }
-    glPopMatrix();
+        _mm256_storeu_ps(&r.y[i], y);
+        _mm256_storeu_ps(&r.z[i], z);
+    }
+    return i;
+}
+#endif
+
+// Widest kernel the build and the CPU both support, unless forced
+RainKernel resolveRainKernel(RainKernel wanted) {
+#ifdef CITY_AVX2
+    static const bool cpuAvx2 = __builtin_cpu_supports("avx2");
+    if ((wanted == RAIN_AUTO || wanted == RAIN_AVX2) && cpuAvx2) return RAIN_AVX2;
+#endif
+#ifdef CITY_SSE2
+    if (wanted != RAIN_SCALAR) return RAIN_SSE2;
+#else
+    (void) wanted;
+#endif
+    return RAIN_SCALAR;
 }
 
-void drawCarModel(const Car &c) {
-    switch(c.carType) {
-        case 0: drawSedan(c); break;
-        case 1: drawSUV(c); break;
-        case 2: drawSportsCar(c); break;
-        case 3: drawTruck(c); break;
-        default: drawSedan(c); break;
+void updateRain(float dt) {
+    int capacity = (int) rain.y.size();
+    rain.active = std::min(capacity, (int) (rain.capacity * rainIntensity));
+    if (rain.active == 0) return;
+
+    // Heavier rain falls faster
+    float fall = dt * (0.4f + 0.6f * rainIntensity);
+    RainKernel kernel = resolveRainKernel(rain.kernel);
+    // Chunks are a multiple of RAIN_LANES so only the last one has a scalar tail
+    jobSystem.parallelFor(rain.active, 64 * 1024, [&](int begin, int end) {
+        int done = begin;
+        switch (kernel) {
+#ifdef CITY_AVX2
+            case RAIN_AVX2: done = updateRainAVX2(rain, begin, end, fall); break;
+#endif
+#ifdef CITY_SSE2
+            case RAIN_SSE2: done = updateRainSSE2(rain, begin, end, fall); break;
+#endif
+            default: break;
+        }
+        updateRainScalar(rain, done, end, fall);
+    });
+}
+
+void drawRain() {
+    if (rainIntensity <= 0.0f || rain.active == 0) return;
+
+    int n = rain.active;
+    vertexStream.begin(GL_LINES, 0.7f, 0.7f, 1.0f, 0.6f * rainIntensity);
+    GLfloat* v = vertexStream.allocate(n * 2);
+    for (int i = 0; i < n; i++, v += 6) {
+        float x = rain.x[i] + targetX, y = rain.y[i], z = rain.z[i] + targetZ;
+        v[0] = x; v[1] = y;               v[2] = z;
+        v[3] = x; v[4] = y - RAIN_STREAK; v[5] = z - RAIN_SLANT * RAIN_STREAK;
+    }
+    vertexStream.flush();
+}
+
+// -------------------------- Weather system --------------------------
+void updateWeather(float deltaTime) {
+    weatherTimer += deltaTime;
+
+    if (weatherTimer >= WEATHER_CHANGE_TIME) {
+        weatherTimer = 0.0f;
+
+        currentWeather = (currentWeather == SUNNY) ? RAINY : SUNNY;
+    }
+
+    // Smooth transition between weather states
+    if (currentWeather == RAINY) {
+        rainIntensity = fmin(rainIntensity + deltaTime * 0.5f, 1.0f);
+    } else {
+        rainIntensity = fmax(rainIntensity - deltaTime * 0.5f, 0.0f);
+    }
+}
+
+// -------------------------- Scene building/initialization --------------------------
+void setupBuildings() {
+    buildings.clear();
+    // left side (x negative)
+    for (int i = 0; i < 6; ++i) {
+        float z = -50.0f + i * 20.0f;
+        if (i==2) z += 3.0f; // slight irregularity
+        float h = 6.0f + (i % 4) * 2.5f; // variety in heights
+        buildings.push_back({ -9.0f, z, 6.0f, 8.0f, h }); // left column
+    }
+    // right side (x positive)
+    for (int i = 0; i < 6; ++i) {
+        float z = -50.0f + i * 20.0f;
+        float h = 5.0f + (i % 5) * 2.0f;
+        buildings.push_back({ 9.0f, z + ((i%2)?-2.0f:2.0f), 6.0f, 8.0f, h });
+    }
+}
+
+void setupStreets() {
+    roads.clear();
+    roads.push_back({ -3.5f, -120.0f, 3.5f, 120.0f, true });
+    sidewalks.clear();
+    sidewalks.push_back({ -7.5f, -120.0f, -3.5f, 120.0f });
+    sidewalks.push_back({  3.5f, -120.0f,  7.5f, 120.0f });
+    walkEndZ = 110.0f;
+}
+
+void setupTrees() {
+    trees.clear();
+    float leftTreePositions[] = {-16.5f, -15.0f, -17.0f, -14.5f, -16.0f, -15.5f, -17.5f, -14.0f, -16.8f, -15.2f};
+    float leftTreeZPositions[] = {-85.0f, -65.0f, -45.0f, -25.0f, -5.0f, 15.0f, 35.0f, 55.0f, 75.0f, 95.0f};
+    for (int i = 0; i < 10; ++i) {
+        trees.push_back({ leftTreePositions[i], leftTreeZPositions[i], 0.9f + (i % 3) * 0.1f });
+    }
+    float rightTreePositions[] = {16.5f, 15.0f, 17.0f, 14.5f, 16.0f, 15.5f, 17.5f, 14.0f, 16.8f, 15.2f};
+    float rightTreeZPositions[] = {-80.0f, -60.0f, -40.0f, -20.0f, 0.0f, 20.0f, 40.0f, 60.0f, 80.0f, 100.0f};
+    for (int i = 0; i < 10; ++i) {
+        trees.push_back({ rightTreePositions[i], rightTreeZPositions[i], 0.95f + (i % 3) * 0.1f });
+    }
+    for (int i = 0; i < 6; ++i) {
+        trees.push_back({ -28.0f + (i % 3) * 2.0f, -90.0f + i * 35.0f, 1.2f });
+        trees.push_back({ 28.0f - (i % 3) * 2.0f, -85.0f + i * 33.0f, 1.2f });
+    }
+}
+
+void initActors() {
+    cars.clear();
+    // Two lanes:
+    // - Left lane (x = -1.2f): cars moving in +Z direction (forward)
+    // - Right lane (x = 1.2f): cars moving in -Z direction (backward)
+
+    // Left lane cars (moving forward +Z)
+    cars.push_back({ -1.2f, -30.0f, 0.02f, 0.9f, 0.1f, 0.1f, 0, 0.0f }); // red sedan
+    cars.push_back({ -1.2f, -10.0f, 0.018f, 0.1f, 0.8f, 0.2f, 2, 0.0f }); // green sports car
+
+    // Right lane cars (moving backward -Z) - negative speed
+    cars.push_back({  1.2f, 30.0f, -0.015f, 0.1f, 0.1f, 0.9f, 1, 0.0f }); // blue SUV
+    cars.push_back({  1.2f, 10.0f, -0.016f, 0.95f, 0.6f, 0.12f, 3, 0.0f }); // orange truck
+
+    humans.clear();
+    for (int i = 0; i < 8; ++i) {
+        float z = -60.0f + i * 15.0f + (rand()%10 - 5) * 0.4f;
+
+        // Left sidewalk humans
+        humans.push_back({
+            -4.8f + (rand()%100)/500.0f,
+            z,
+            1.0f * ((i%2)?1.0f:-1.0f),
+            0.005f + (rand()%3)/300.0f,
+            (float) (rand()%100)/100.0f
+        });
+
+        // Right sidewalk humans
+        humans.push_back({
+            4.8f + (rand()%100)/500.0f,
+            z + (rand()%10-5),
+            -1.0f * ((i%2)?1.0f:-1.0f),
+            0.005f + (rand()%3)/300.0f,
+            (float) (rand()%100)/100.0f
+        });
+    }
+}
+
+// -------------------------- Traffic --------------------------
+// Every north-south road carries one or more lanes per direction. A lane
+// keeps its cars in structure-of-arrays form sorted by the distance driven
+// from its entry, so a car's leader is simply the next entry (the last car
+// follows the first one around the loop). Each step computes Intelligent
+// Driver Model accelerations for all lanes in parallel, integrates, wraps
+// cars that leave the far end back to the entry and restores the order with
+// one rotate plus an insertion pass. Lane changes follow afterwards on one
+// thread: a car held up by its leader moves over when the adjacent lane lets
+// it accelerate harder without making the new follower brake hard.
+const float LANE_WIDTH = 2.4f;
+const float CAR_LENGTH = 4.5f;
+const float SPEED_SCALE = 12.0f / REFERENCE_TICK;   // Car::speed to units per second
+
+struct TrafficParams {
+    float headway = 1.2f;       // desired time gap T (s)
+    float minGap = 2.0f;        // jam distance s0
+    float accel = 1.5f;         // maximum acceleration a
+    float brake = 2.5f;         // comfortable deceleration b
+    float safeBrake = 4.0f;     // hardest braking a lane change may force on others
+    float changeGain = 0.3f;    // acceleration advantage needed to change lanes
+    float changeCooldown = 3.0f;
+    float lateralSpeed = 2.0f;  // units per second while drifting into a new lane
+
+    float brakeTerm() const { return 0.5f / sqrtf(accel * brake); }
+};
+TrafficParams trafficParams;
+
+struct Lane {
+    float x;                    // centre line
+    float z0, z1;
+    float dir;                  // +1 drives towards +z, -1 towards -z
+    int inner = -1, outer = -1; // neighbouring lanes in the same direction
+    std::vector<int> ids;       // cars, back to front
+    std::vector<float> pos;     // distance from the entry
+    std::vector<float> vel;     // units per second
+    std::vector<float> cruise;  // desired speed of each car
+    std::vector<float> acc;     // scratch, this step's accelerations
+
+    float length() const { return z1 - z0; }
+    float zAt(float p) const { return dir > 0 ? z0 + p : z1 - p; }
+    float posAt(float z) const { return dir > 0 ? z - z0 : z1 - z; }
+    int size() const { return (int) ids.size(); }
+};
+std::vector<Lane> lanes;
+
+int lanesPerDirection(const Road &r) {
+    float width = r.alongZ ? r.x1 - r.x0 : r.z1 - r.z0;
+    return std::max(1, (int) ((width * 0.5f - 0.1f) / LANE_WIDTH));
+}
+
+// Lanes of every north-south road; traffic keeps to the right of the centre line
+void buildLanes() {
+    lanes.clear();
+    for (const Road &r : roads) {
+        if (!r.alongZ) continue;
+        float cx = 0.5f * (r.x0 + r.x1);
+        int n = lanesPerDirection(r);
+        for (int side = 0; side < 2; ++side) {
+            float dir = side == 0 ? 1.0f : -1.0f;
+            int first = (int) lanes.size();
+            for (int k = 0; k < n; ++k) {
+                Lane l;
+                l.x = cx - dir * (0.5f * LANE_WIDTH + k * LANE_WIDTH);
+                l.z0 = r.z0;
+                l.z1 = r.z1;
+                l.dir = dir;
+                if (k > 0) l.inner = first + k - 1;
+                if (k + 1 < n) l.outer = first + k + 1;
+                lanes.push_back(l);
+            }
+        }
+    }
+}
+
+float idmAccel(float v, float v0, float gap, float dv) {
+    const TrafficParams &p = trafficParams;
+    float sStar = p.minGap + fmaxf(0.0f, v * p.headway + v * dv * p.brakeTerm());
+    float r = v / v0;
+    float g = sStar / fmaxf(gap, 0.1f);
+    return p.accel * (1.0f - r*r*r*r - g*g);
+}
+
+// Bumper-to-bumper gap and closing speed to the car ahead of slot i
+void leaderOf(const Lane &l, int i, float &gap, float &dv) {
+    int n = l.size();
+    if (n < 2) {
+        gap = 1e9f;
+        dv = 0.0f;
+        return;
+    }
+    int j = i + 1 < n ? i + 1 : 0;
+    float ahead = l.pos[j] - l.pos[i];
+    if (j <= i) ahead += l.length();
+    gap = ahead - CAR_LENGTH;
+    dv = l.vel[i] - l.vel[j];
+}
+
+// Insert a car keeping the lane sorted; returns its slot
+int laneInsert(Lane &l, int id, float pos, float vel) {
+    int at = (int) (std::upper_bound(l.pos.begin(), l.pos.end(), pos) - l.pos.begin());
+    l.ids.insert(l.ids.begin() + at, id);
+    l.pos.insert(l.pos.begin() + at, pos);
+    l.vel.insert(l.vel.begin() + at, vel);
+    l.cruise.insert(l.cruise.begin() + at, cars[id].cruise);
+    return at;
+}
+
+void laneErase(Lane &l, int i) {
+    l.ids.erase(l.ids.begin() + i);
+    l.pos.erase(l.pos.begin() + i);
+    l.vel.erase(l.vel.begin() + i);
+    l.cruise.erase(l.cruise.begin() + i);
+}
+
+// Put every car into the lane of its direction nearest to it. A car beyond
+// the ends of every lane is pulled onto the nearest one; a car with no lane
+// of its direction at all is dropped rather than left parked on the road.
+void initTraffic() {
+    for (Lane &l : lanes) {
+        l.ids.clear();
+        l.pos.clear();
+        l.vel.clear();
+        l.cruise.clear();
+    }
+    size_t before = cars.size();
+    cars.erase(std::remove_if(cars.begin(), cars.end(), [](const Car &c) {
+        float dir = c.speed >= 0 ? 1.0f : -1.0f;
+        for (const Lane &l : lanes)
+            if (l.dir == dir) return false;
+        return true;
+    }), cars.end());
+    if (cars.size() < before)
+        fprintf(stderr, "traffic: dropped %zu cars with no lane in their direction\n", before - cars.size());
+
+    int moved = 0;
+    for (size_t id = 0; id < cars.size(); ++id) {
+        Car &c = cars[id];
+        float dir = c.speed >= 0 ? 1.0f : -1.0f;
+        int best = -1;
+        float bestDist = 1e9f;
+        for (size_t k = 0; k < lanes.size(); ++k) {
+            const Lane &l = lanes[k];
+            if (l.dir != dir) continue;
+            float d = fabsf(l.x - c.laneX) + fmaxf(0.0f, fmaxf(l.z0 - c.z, c.z - l.z1));
+            if (d < bestDist) { bestDist = d; best = (int) k; }
+        }
+        Lane &l = lanes[best];
+        if (c.z < l.z0 || c.z > l.z1) {
+            c.z = c.prevZ = fminf(fmaxf(c.z, l.z0), l.z1);
+            moved++;
+        }
+        c.lane = best;
+        if (c.cruise <= 0.0f) c.cruise = fabsf(c.speed) * SPEED_SCALE;
+        c.laneX = c.prevLaneX = l.x;
+        laneInsert(l, (int) id, l.posAt(c.z), c.cruise);
+    }
+    if (moved > 0) fprintf(stderr, "traffic: moved %d cars beyond the lane ends onto the nearest lane\n", moved);
+}
+
+// Car-following for one lane: accelerate, move, wrap and re-sort
+void stepLane(Lane &l, float dt) {
+    int n = l.size();
+    if (n == 0) return;
+    l.acc.resize(n);
+    for (int i = 0; i < n; ++i) {
+        float gap, dv;
+        leaderOf(l, i, gap, dv);
+        l.acc[i] = idmAccel(l.vel[i], l.cruise[i], gap, dv);
+    }
+
+    float len = l.length();
+    int wrapped = 0;
+    for (int i = 0; i < n; ++i) {
+        float v = fmaxf(0.0f, l.vel[i] + l.acc[i] * dt);
+        l.pos[i] += 0.5f * (l.vel[i] + v) * dt;
+        l.vel[i] = v;
+        if (l.pos[i] >= len) {
+            l.pos[i] -= len;
+            wrapped++;
+        }
+    }
+
+    // Cars that wrapped were at the front; move them to the back, then fix
+    // any order the step itself swapped
+    if (wrapped > 0 && wrapped < n) {
+        std::rotate(l.ids.begin(), l.ids.end() - wrapped, l.ids.end());
+        std::rotate(l.pos.begin(), l.pos.end() - wrapped, l.pos.end());
+        std::rotate(l.vel.begin(), l.vel.end() - wrapped, l.vel.end());
+        std::rotate(l.cruise.begin(), l.cruise.end() - wrapped, l.cruise.end());
+    }
+    for (int i = 1; i < n; ++i) {
+        for (int j = i; j > 0 && l.pos[j] < l.pos[j - 1]; --j) {
+            std::swap(l.ids[j], l.ids[j - 1]);
+            std::swap(l.pos[j], l.pos[j - 1]);
+            std::swap(l.vel[j], l.vel[j - 1]);
+            std::swap(l.cruise[j], l.cruise[j - 1]);
+        }
+    }
+
+    // Mirror the lane state into the cars the renderer reads
+    for (int i = 0; i < n; ++i) {
+        Car &c = cars[l.ids[i]];
+        c.z = l.zAt(l.pos[i]);
+        c.speed = l.dir * l.vel[i] / SPEED_SCALE;
+        c.wheelRotation += l.dir * l.vel[i] * (300.0f / SPEED_SCALE) * (dt / REFERENCE_TICK);
+        if (c.wheelRotation > 360.0f) c.wheelRotation -= 360.0f;
+        if (c.wheelRotation < -360.0f) c.wheelRotation += 360.0f;
+        float dx = l.x - c.laneX, maxDx = trafficParams.lateralSpeed * dt;
+        c.laneX += fmaxf(-maxDx, fminf(dx, maxDx));
+        c.laneCooldown = fmaxf(0.0f, c.laneCooldown - dt);
+    }
+}
+
+// Try to move slot i of lane `from` into lane `to`
+bool tryLaneChange(int from, int i, int to) {
+    Lane &src = lanes[from];
+    Lane &dst = lanes[to];
+    const TrafficParams &p = trafficParams;
+    int id = src.ids[i];
+    float pos = src.pos[i], v = src.vel[i], cruise = src.cruise[i];
+
+    float gap, dv;
+    leaderOf(src, i, gap, dv);
+    float accHere = idmAccel(v, cruise, gap, dv);
+
+    int n = dst.size();
+    float accThere = p.accel, followerAcc = 0.0f;
+    if (n > 0) {
+        float len = dst.length();
+        int at = (int) (std::upper_bound(dst.pos.begin(), dst.pos.end(), pos) - dst.pos.begin());
+        int lead = at < n ? at : 0;
+        int follow = at > 0 ? at - 1 : n - 1;
+        float leadGap = dst.pos[lead] - pos + (at < n ? 0.0f : len) - CAR_LENGTH;
+        float followGap = pos - dst.pos[follow] + (at > 0 ? 0.0f : len) - CAR_LENGTH;
+        if (leadGap < p.minGap || followGap < p.minGap) return false;
+        accThere = idmAccel(v, cruise, leadGap, v - dst.vel[lead]);
+        followerAcc = idmAccel(dst.vel[follow], dst.cruise[follow], followGap, dst.vel[follow] - v);
+    }
+    if (followerAcc < -p.safeBrake || accThere < accHere + p.changeGain) return false;
+
+    laneErase(src, i);
+    laneInsert(dst, id, pos, v);
+    cars[id].lane = to;
+    cars[id].laneCooldown = p.changeCooldown;
+    return true;
+}
+
+// Each step only every LANE_CHANGE_STRIDE-th car (by id) considers changing
+const int LANE_CHANGE_STRIDE = 8;
+
+void changeLanes() {
+    static unsigned step = 0;
+    unsigned phase = step++ % LANE_CHANGE_STRIDE;
+    for (size_t k = 0; k < lanes.size(); ++k) {
+        Lane &l = lanes[k];
+        if (l.inner < 0 && l.outer < 0) continue;
+        for (int i = l.size() - 1; i >= 0; --i) {
+            if ((unsigned) l.ids[i] % LANE_CHANGE_STRIDE != phase) continue;
+            // Only cars held below their cruise speed look for a way past
+            if (l.vel[i] > 0.9f * l.cruise[i] || cars[l.ids[i]].laneCooldown > 0.0f) continue;
+            if (l.inner >= 0 && tryLaneChange((int) k, i, l.inner)) continue;
+            if (l.outer >= 0) tryLaneChange((int) k, i, l.outer);
+        }
+    }
+}
+
+void stepTraffic(float dt) {
+    jobSystem.parallelFor((int) lanes.size(), 8, [dt](int begin, int end) {
+        for (int k = begin; k < end; ++k) stepLane(lanes[k], dt);
+    });
+    changeLanes();
+}
+
+// -------------------------- Crowd --------------------------
+// Pedestrians walk along z at their own pace and stay inside the x range of
+// their sidewalk. Every step they are counting-sorted into a spatial hash of
+// CROWD_CELL-sized cells, with positions copied out in slot order. Cells that
+// follow each other along z get consecutive slots, so the 3x3 neighbourhood
+// of a pedestrian is three contiguous runs, and the update walks the sorted
+// copies in slot order so that neighbouring queries share cache lines.
+// Anyone closer than CROWD_RADIUS pushes a pedestrian away, and someone
+// coming the other way just ahead makes it step to its right. New positions
+// go to scratch arrays first, so the parallel pass reads only the previous
+// step and matches the serial result. The humans array itself is rewritten
+// in slot order at the end of each step, which keeps the next step's
+// gathers close to sequential.
+const float CROWD_CELL = 1.5f;       // also the look-ahead distance
+const float CROWD_RADIUS = 0.7f;     // personal space
+const float CROWD_AVOID_SPEED = 1.2f;
+const float CROWD_MARGIN = 0.3f;     // kept clear at the sidewalk edges
+
+struct CrowdHash {
+    uint32_t mask = 0;
+    std::vector<uint32_t> cellOf;       // per human
+    std::vector<int> start;             // per slot, counting-sort offsets
+    std::vector<int> cursor;
+    std::vector<int> order;             // humans in slot order
+    std::vector<float> x, z, dir;       // copies in slot order
+    std::vector<float> newX, newZ, newDir;
+    std::vector<Human> next;            // humans rewritten in slot order
+
+    static int coord(float v) { return (int) floorf(v / CROWD_CELL); }
+    uint32_t slot(int ix, int iz) const {
+        return ((uint32_t) ix * 2654435761u + (uint32_t) iz) & mask;
+    }
+};
+CrowdHash crowdHash;
+
+// Give every pedestrian the sidewalk under them (or the nearest one).
+// Generated actors already carry theirs and skip the search.
+void initCrowd() {
+    for (Human &h : humans) {
+        if (h.walk >= 0 && h.walk < (int) sidewalks.size()) {
+            const GroundRect &sw = sidewalks[h.walk];
+            if (h.x >= sw.x0 && h.x <= sw.x1 && h.z >= sw.z0 && h.z <= sw.z1) continue;
+        }
+        h.walk = -1;
+        float best = 1e9f;
+        for (size_t k = 0; k < sidewalks.size(); ++k) {
+            const GroundRect &sw = sidewalks[k];
+            if (sw.z1 - sw.z0 < sw.x1 - sw.x0) continue;   // only the ones along z
+            float dx = fmaxf(0.0f, fmaxf(sw.x0 - h.x, h.x - sw.x1));
+            float dz = fmaxf(0.0f, fmaxf(sw.z0 - h.z, h.z - sw.z1));
+            float d = dx + dz;
+            if (d < best) { best = d; h.walk = (int) k; }
+        }
+    }
+}
+
+void buildCrowdHash() {
+    CrowdHash &hs = crowdHash;
+    int n = (int) humans.size();
+    uint32_t slots = 1024;
+    while (slots < 2u * (uint32_t) n) slots <<= 1;
+    hs.mask = slots - 1;
+
+    hs.cellOf.resize(n);
+    hs.start.assign(slots + 1, 0);
+    for (int i = 0; i < n; ++i) {
+        uint32_t c = hs.slot(CrowdHash::coord(humans[i].x), CrowdHash::coord(humans[i].z));
+        hs.cellOf[i] = c;
+        hs.start[c + 1]++;
+    }
+    for (uint32_t c = 0; c < slots; ++c) hs.start[c + 1] += hs.start[c];
+
+    hs.order.resize(n);
+    hs.x.resize(n);
+    hs.z.resize(n);
+    hs.dir.resize(n);
+    hs.cursor.assign(hs.start.begin(), hs.start.end() - 1);
+    for (int i = 0; i < n; ++i) {
+        int at = hs.cursor[hs.cellOf[i]]++;
+        hs.order[at] = i;
+        hs.x[at] = humans[i].x;
+        hs.z[at] = humans[i].z;
+        hs.dir[at] = humans[i].dir;
+    }
+}
+
+// Separation and sidestep for the pedestrian at slot-order index s, as a
+// velocity to add to its walk
+void crowdAvoidance(int s, float &ax, float &az) {
+    const CrowdHash &hs = crowdHash;
+    float x = hs.x[s], z = hs.z[s], dir = hs.dir[s];
+    int cx = CrowdHash::coord(x), cz = CrowdHash::coord(z);
+    ax = az = 0.0f;
+    for (int dx = -1; dx <= 1; ++dx) {
+        // Cells cz-1..cz+1 of this column, one run unless the slots wrap
+        uint32_t lo = hs.slot(cx + dx, cz - 1);
+        int runs[3][2];
+        int nruns = 0;
+        if (lo + 2 <= hs.mask) {
+            runs[nruns][0] = hs.start[lo];
+            runs[nruns++][1] = hs.start[lo + 3];
+        } else {
+            for (int dz = -1; dz <= 1; ++dz) {
+                uint32_t c = hs.slot(cx + dx, cz + dz);
+                runs[nruns][0] = hs.start[c];
+                runs[nruns++][1] = hs.start[c + 1];
+            }
+        }
+        for (int r = 0; r < nruns; ++r) {
+            for (int k = runs[r][0]; k < runs[r][1]; ++k) {
+                if (k == s) continue;
+                float ox = x - hs.x[k], oz = z - hs.z[k];
+                float d2 = ox*ox + oz*oz;
+                if (d2 >= CROWD_CELL * CROWD_CELL) continue;
+                float d = sqrtf(d2);
+                if (d < CROWD_RADIUS) {
+                    if (d < 1e-4f) { ox = (k < s) ? 1.0f : -1.0f; oz = 0.0f; d = 1.0f; }
+                    float push = (CROWD_RADIUS - d) / CROWD_RADIUS;
+                    ax += ox / d * push;
+                    az += oz / d * push;
+                }
+                // Oncoming and ahead of us: keep right (-x when walking +z)
+                if (hs.dir[k] != dir && -oz * dir > 0.0f && fabsf(ox) < CROWD_RADIUS) {
+                    ax -= dir * 0.5f * (1.0f - d / CROWD_CELL);
+                }
+            }
+        }
+    }
+}
+
+// Actors per parallelFor chunk in the simulation loops
+const int SIM_GRAIN = 4096;
+
+void stepCrowd(float dt) {
+    int n = (int) humans.size();
+    if (n == 0) return;
+    float ticks = dt / REFERENCE_TICK;
+    buildCrowdHash();
+
+    CrowdHash &hs = crowdHash;
+    hs.newX.resize(n);
+    hs.newZ.resize(n);
+    hs.newDir.resize(n);
+    hs.next.resize(n);
+    jobSystem.parallelFor(n, SIM_GRAIN, [dt, ticks](int begin, int end) {
+        CrowdHash &hs = crowdHash;
+        for (int s = begin; s < end; ++s) {
+            const Human &h = humans[hs.order[s]];
+            float ax, az;
+            crowdAvoidance(s, ax, az);
+            float x = hs.x[s] + ax * CROWD_AVOID_SPEED * dt;
+            float z = hs.z[s] + h.dir * h.speed * 6.0f * ticks + az * CROWD_AVOID_SPEED * dt;
+            float dir = h.dir;
+            if (z > walkEndZ) { z = walkEndZ; dir = -1.0f; }
+            if (z < -walkEndZ) { z = -walkEndZ; dir = 1.0f; }
+            if (h.walk >= 0) {
+                const GroundRect &sw = sidewalks[h.walk];
+                x = fmaxf(sw.x0 + CROWD_MARGIN, fminf(x, sw.x1 - CROWD_MARGIN));
+            }
+            hs.newX[s] = x;
+            hs.newZ[s] = z;
+            hs.newDir[s] = dir;
+        }
+    });
+    jobSystem.parallelFor(n, SIM_GRAIN, [ticks](int begin, int end) {
+        CrowdHash &hs = crowdHash;
+        for (int s = begin; s < end; ++s) {
+            Human &h = hs.next[s];
+            h = humans[hs.order[s]];
+            h.x = hs.newX[s];
+            h.z = hs.newZ[s];
+            h.dir = hs.newDir[s];
+            h.phase += (0.02f + 0.005f * h.speed) * ticks;
+            if (h.phase > 1000.0f) h.phase -= 1000.0f;
+        }
+    });
+    humans.swap(hs.next);
+}
+
+// -------------------------- Procedural city generator --------------------------
+// --city NxM replaces the hand-placed street with a grid of N x M blocks
+// separated by streets. Each block is ringed by sidewalk and split into lots;
+// a lot holds a building with probability `density`, otherwise it becomes a
+// small park with trees. Heights follow pow(u, heightSkew) between
+// minHeight and maxHeight, scaled up towards the city centre.
+struct CityConfig {
+    bool enabled = false;
+    int blocksX = 8, blocksZ = 8;
+    float blockSize = 36.0f;        // block edge, sidewalks included
+    float streetWidth = 10.0f;      // two lanes each way
+    float sidewalkWidth = 2.5f;
+    int lotsPerSide = 2;            // lots per block edge
+    float density = 0.85f;          // chance that a lot holds a building
+    float minHeight = 4.0f, maxHeight = 30.0f;
+    float heightSkew = 2.0f;        // > 1 favours low buildings
+    float downtownRadius = 0.35f;   // fraction of the city where towers cluster
+    uint32_t seed = 12345u;
+    int cars = 200;
+    int humans = 400;
+};
+CityConfig cityConfig;
+
+// One block with its corner at (bx0, bz0): the sidewalk ring and the lots
+// inside it. Writes only to the vectors it is given, so the world streamer
+// can run it on its own thread.
+void generateBlock(const CityConfig &cfg, Rng &rng, float bx0, float bz0, float halfDiag,
+                   std::vector<Building> &outBuildings, std::vector<Tree> &outTrees,
+                   std::vector<GroundRect> &outSidewalks) {
+    float bx1 = bx0 + cfg.blockSize, bz1 = bz0 + cfg.blockSize;
+    float sw = cfg.sidewalkWidth;
+    int lots = cfg.lotsPerSide;
+
+    outSidewalks.push_back({ bx0, bz0, bx0 + sw, bz1 });
+    outSidewalks.push_back({ bx1 - sw, bz0, bx1, bz1 });
+    outSidewalks.push_back({ bx0 + sw, bz0, bx1 - sw, bz0 + sw });
+    outSidewalks.push_back({ bx0 + sw, bz1 - sw, bx1 - sw, bz1 });
+
+    float inner = cfg.blockSize - 2.0f * sw;
+    float lot = inner / lots;
+    for (int lz = 0; lz < lots; ++lz) {
+        for (int lx = 0; lx < lots; ++lx) {
+            float cx = bx0 + sw + (lx + 0.5f) * lot;
+            float cz = bz0 + sw + (lz + 0.5f) * lot;
+            if (rng.uniform() < cfg.density) {
+                float w = lot * (0.6f + 0.3f * rng.uniform());
+                float d = lot * (0.6f + 0.3f * rng.uniform());
+                float r = sqrtf(cx*cx + cz*cz) / halfDiag;
+                float downtown = 1.0f / (1.0f + (r / cfg.downtownRadius) * (r / cfg.downtownRadius));
+                float u = powf(rng.uniform(), cfg.heightSkew);
+                float h = cfg.minHeight + (cfg.maxHeight - cfg.minHeight) * u * (0.3f + 0.7f * downtown);
+                outBuildings.push_back({ cx, cz, w, d, h });
+            } else {
+                int n = 1 + rng.range(4);
+                for (int k = 0; k < n; ++k) {
+                    outTrees.push_back({ cx + (rng.uniform() - 0.5f) * lot * 0.7f,
+                                         cz + (rng.uniform() - 0.5f) * lot * 0.7f,
+                                         0.8f + 0.5f * rng.uniform() });
+                }
+            }
+        }
+    }
+}
+
+void generateCity(const CityConfig &cfg) {
+    auto t0 = std::chrono::steady_clock::now();
+    Rng rng(cfg.seed);
+
+    float pitch = cfg.blockSize + cfg.streetWidth;
+    float spanX = cfg.blocksX * pitch + cfg.streetWidth;
+    float spanZ = cfg.blocksZ * pitch + cfg.streetWidth;
+    float originX = -spanX * 0.5f, originZ = -spanZ * 0.5f;
+    float halfDiag = 0.5f * sqrtf(spanX*spanX + spanZ*spanZ);
+
+    buildings.clear();
+    trees.clear();
+    roads.clear();
+    sidewalks.clear();
+
+    int lots = cfg.lotsPerSide;
+    buildings.reserve((size_t) cfg.blocksX * cfg.blocksZ * lots * lots);
+    sidewalks.reserve((size_t) cfg.blocksX * cfg.blocksZ * 4);
+
+    // Streets between and around the blocks
+    for (int i = 0; i <= cfg.blocksX; ++i) {
+        float x = originX + i * pitch;
+        roads.push_back({ x, originZ, x + cfg.streetWidth, originZ + spanZ, true });
+    }
+    for (int j = 0; j <= cfg.blocksZ; ++j) {
+        float z = originZ + j * pitch;
+        roads.push_back({ originX, z, originX + spanX, z + cfg.streetWidth, false });
+    }
+
+    for (int j = 0; j < cfg.blocksZ; ++j) {
+        for (int i = 0; i < cfg.blocksX; ++i) {
+            generateBlock(cfg, rng, originX + cfg.streetWidth + i * pitch, originZ + cfg.streetWidth + j * pitch,
+                          halfDiag, buildings, trees, sidewalks);
+        }
+    }
+
+    walkEndZ = spanZ * 0.5f - cfg.streetWidth;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "city: %dx%d blocks, %zu buildings, %zu trees, %zu roads in %.1f ms\n",
+            cfg.blocksX, cfg.blocksZ, buildings.size(), trees.size(), roads.size(), ms);
+}
+
+// Cars spread over every traffic lane, humans on the sidewalks running along
+// the north-south streets
+void generateActors(const CityConfig &cfg) {
+    Rng rng(cfg.seed ^ 0xA5A5A5A5u);
+    cars.clear();
+    humans.clear();
+
+    std::vector<int> walks;
+    for (size_t k = 0; k < sidewalks.size(); ++k) {
+        const GroundRect &s = sidewalks[k];
+        if (s.z1 - s.z0 > s.x1 - s.x0) walks.push_back((int) k);
+    }
+
+    // Evenly spaced with some jitter, never closer than a stopped queue
+    std::vector<int> perLane(lanes.size(), 0);
+    for (int i = 0; lanes.size() && i < cfg.cars; ++i) perLane[rng.range((int) lanes.size())]++;
+    float spacing = CAR_LENGTH + trafficParams.minGap + 1.0f;
+    cars.reserve(cfg.cars);
+    for (size_t k = 0; k < lanes.size(); ++k) {
+        const Lane &l = lanes[k];
+        int n = std::min(perLane[k], (int) (l.length() / spacing));
+        float step = l.length() / std::max(n, 1);
+        for (int j = 0; j < n; ++j) {
+            float cruise = 9.0f + 7.5f * rng.uniform();
+            Car c = {};
+            c.laneX = l.x;
+            c.z = l.zAt((j + 0.5f + 0.4f * (rng.uniform() - 0.5f) * (1.0f - spacing / step)) * step);
+            c.speed = l.dir * cruise / SPEED_SCALE;
+            c.cruise = cruise;
+            c.r = 0.1f + 0.85f * rng.uniform();
+            c.g = 0.1f + 0.85f * rng.uniform();
+            c.b = 0.1f + 0.85f * rng.uniform();
+            c.carType = rng.range(4);
+            cars.push_back(c);
+        }
+    }
+
+    humans.reserve(cfg.humans);
+    for (int i = 0; walks.size() && i < cfg.humans; ++i) {
+        int walk = walks[rng.range((int) walks.size())];
+        const GroundRect &s = sidewalks[walk];
+        Human h = {};
+        h.x = s.x0 + rng.uniform() * (s.x1 - s.x0);
+        h.z = s.z0 + rng.uniform() * (s.z1 - s.z0);
+        h.dir = rng.range(2) ? 1.0f : -1.0f;
+        h.speed = 0.005f + rng.range(3) / 300.0f;
+        h.phase = rng.uniform();
+        h.walk = walk;
+        humans.push_back(h);
+    }
+}
+
+// -------------------------- Simulation --------------------------
+void saveSimState() {
+    PROFILE_SCOPE("save state");
+    jobSystem.parallelFor((int) cars.size(), SIM_GRAIN, [](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            Car &c = cars[i];
+            c.prevZ = c.z;
+            c.prevWheelRotation = c.wheelRotation;
+            c.prevLaneX = c.laneX;
+        }
+    });
+    jobSystem.parallelFor((int) humans.size(), SIM_GRAIN, [](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            Human &h = humans[i];
+            h.prevX = h.x;
+            h.prevZ = h.z;
+            h.prevPhase = h.phase;
+        }
+    });
+}
+
+// Advance the world by one fixed step of dt seconds
+void stepSimulation(float dt) {
+    float ticks = dt / REFERENCE_TICK;
+
+    // Update weather system
+    {
+        PROFILE_SCOPE("weather");
+        updateWeather(dt);
+        updateRain(dt);
+    }
+
+    // Move cars
+    {
+        PROFILE_SCOPE("traffic");
+        stepTraffic(dt);
+    }
+
+    // Move humans
+    {
+        PROFILE_SCOPE("crowd");
+        stepCrowd(dt);
+    }
+
+    // Move sun
+    sunAngle += 0.02f * ticks;
+    if (sunAngle > 180.0f) sunAngle = 40.0f;
+}
+
+// Run as many fixed steps as simTime covers and update renderAlpha
+void advanceSimulation(float simTime) {
+    PROFILE_SCOPE("simulation");
+    simAccumulator += simTime;
+    int steps = 0;
+    int maxSteps = (int) (MAX_FRAME_TIME * 16.0f / SIM_DT);   // up to 16x time scale
+    while (simAccumulator >= SIM_DT) {
+        if (++steps > maxSteps) {
+            simAccumulator = 0.0;
+            break;
+        }
+        saveSimState();
+        stepSimulation(SIM_DT);
+        simAccumulator -= SIM_DT;
+    }
+    renderAlpha = (float) (simAccumulator / SIM_DT);
+}
+
+float lerpf(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+// Position between the previous and current step; jumps (lane wrap-around,
+// sidewalk clamps) are not smoothed
+float lerpTeleport(float prev, float cur, float t, float maxJump) {
+    return fabsf(cur - prev) > maxJump ? cur : lerpf(prev, cur, t);
+}
+
+float lerpAngle(float prev, float cur, float t) {
+    float d = cur - prev;
+    if (d > 180.0f) d -= 360.0f;
+    if (d < -180.0f) d += 360.0f;
+    return prev + d * t;
+}
+
+Car interpolatedCar(const Car &c) {
+    Car r = c;
+    r.z = lerpTeleport(c.prevZ, c.z, renderAlpha, 10.0f);
+    r.laneX = lerpf(c.prevLaneX, c.laneX, renderAlpha);
+    r.wheelRotation = lerpAngle(c.prevWheelRotation, c.wheelRotation, renderAlpha);
+    return r;
+}
+
+Human interpolatedHuman(const Human &h) {
+    Human r = h;
+    r.x = lerpTeleport(h.prevX, h.x, renderAlpha, 10.0f);
+    r.z = lerpTeleport(h.prevZ, h.z, renderAlpha, 10.0f);
+    r.phase = lerpTeleport(h.prevPhase, h.phase, renderAlpha, 10.0f);
+    return r;
+}
+
+// -------------------------- Level of detail --------------------------
+// Cars, humans and trees have three levels: 0 full detail, 1 reduced
+// tessellation with small parts dropped, 2 a single box or cone. A level
+// only changes once the distance is LOD_HYSTERESIS past its threshold, so
+// objects sitting on a boundary do not pop back and forth.
+struct LodThresholds {
+    float dist[2];   // switch 0->1 and 1->2
+};
+
+const LodThresholds CAR_LOD   = {{ 40.0f, 110.0f }};
+const LodThresholds HUMAN_LOD = {{ 30.0f, 80.0f }};
+const LodThresholds TREE_LOD  = {{ 70.0f, 160.0f }};
+const float LOD_HYSTERESIS = 0.1f;
+const int LOD_LEVELS = 3;
+
+float camEye[3] = { 0.0f, 0.0f, 0.0f };   // eye position of the current frame
+
+int selectLod(int current, float dist, const LodThresholds &t) {
+    int lod = current;
+    while (lod < LOD_LEVELS - 1 && dist > t.dist[lod] * (1.0f + LOD_HYSTERESIS)) lod++;
+    while (lod > 0 && dist < t.dist[lod - 1] * (1.0f - LOD_HYSTERESIS)) lod--;
+    return lod;
+}
+
+float distanceToEye(float x, float y, float z) {
+    float dx = x - camEye[0], dy = y - camEye[1], dz = z - camEye[2];
+    return sqrtf(dx*dx + dy*dy + dz*dz);
+}
+
+// -------------------------- Window batching --------------------------
+// Every window frame, glass pane and sill in the city is baked into one vertex
+// array per material, so all facades draw with three glDrawArrays calls
+// instead of three cubes and four material updates per window.
+struct VertexBatch {
+    std::vector<GLfloat> data;   // interleaved GL_N3F_V3F: nx,ny,nz, x,y,z
+
+    void clear() { data.clear(); }
+    GLsizei vertexCount() const { return (GLsizei) (data.size() / 6); }
+    void vertex(float nx, float ny, float nz, float x, float y, float z) {
+        data.push_back(nx); data.push_back(ny); data.push_back(nz);
+        data.push_back(x);  data.push_back(y);  data.push_back(z);
+    }
+};
+
+struct WindowBatch {
+    VertexBatch frames;
+    VertexBatch panes;
+    VertexBatch sills;
+};
+
+// Placement of a building face: origin plus rotation about +Y, the same
+// transform drawBuildingWithDetails used to apply with glTranslatef/glRotatef
+struct FaceFrame {
+    float ox, oy, oz;
+    float c, s;   // cos/sin of the yaw angle
+};
+
+FaceFrame makeFaceFrame(float ox, float oy, float oz, float yawDeg) {
+    float rad = yawDeg * M_PI / 180.0f;
+    return { ox, oy, oz, cosf(rad), sinf(rad) };
+}
+
+// Append an axis-aligned box (center + size in face space) as 6 quads
+void appendBox(VertexBatch &batch, const FaceFrame &f,
+               float cx, float cy, float cz, float sx, float sy, float sz) {
+    static const float faces[6][3] = {
+        { 1,0,0 }, { -1,0,0 }, { 0,1,0 }, { 0,-1,0 }, { 0,0,1 }, { 0,0,-1 }
+    };
+    // Corner signs per face, counter-clockwise seen from outside
+    static const float corners[6][4][3] = {
+        { { 1,-1, 1}, { 1,-1,-1}, { 1, 1,-1}, { 1, 1, 1} },
+        { {-1,-1,-1}, {-1,-1, 1}, {-1, 1, 1}, {-1, 1,-1} },
+        { {-1, 1, 1}, { 1, 1, 1}, { 1, 1,-1}, {-1, 1,-1} },
+        { {-1,-1,-1}, { 1,-1,-1}, { 1,-1, 1}, {-1,-1, 1} },
+        { {-1,-1, 1}, { 1,-1, 1}, { 1, 1, 1}, {-1, 1, 1} },
+        { { 1,-1,-1}, {-1,-1,-1}, {-1, 1,-1}, { 1, 1,-1} }
+    };
+    for (int i = 0; i < 6; ++i) {
+        float nx =  f.c * faces[i][0] + f.s * faces[i][2];
+        float nz = -f.s * faces[i][0] + f.c * faces[i][2];
+        for (int k = 0; k < 4; ++k) {
+            float lx = cx + corners[i][k][0] * sx * 0.5f;
+            float ly = cy + corners[i][k][1] * sy * 0.5f;
+            float lz = cz + corners[i][k][2] * sz * 0.5f;
+            batch.vertex(nx, faces[i][1], nz,
+                         f.ox + f.c * lx + f.s * lz,
+                         f.oy + ly,
+                         f.oz - f.s * lx + f.c * lz);
+        }
+    }
+}
+
+// Same layout the per-window cube path used: a rows x cols grid centred on the face
+void appendWindowPanel(WindowBatch &wb, const FaceFrame &f,
+                       int rows, int cols, float b_w, float b_h, float sill_y) {
+    float pad = 0.15f;
+    float winW = (b_w - (cols+1)*pad) / cols;
+    float winH = (b_h - (rows+1)*pad) / rows;
+
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            float cx = -b_w/2 + pad + (c * (winW + pad)) + winW/2;
+            float cy = sill_y + b_h/2 - pad - (r * (winW + pad)) - winH/2;
+
+            appendBox(wb.frames, f, cx, cy, -0.1f, winW, winH, 0.15f);
+            appendBox(wb.panes,  f, cx, cy, 0.02f, winW * 0.85f, winH * 0.85f, 0.01f);
+            appendBox(wb.sills,  f, cx, cy - winH/2 - 0.02f, 0.05f, winW * 1.1f, 0.04f, 0.1f);
+        }
+    }
+}
+
+// Touches nothing but `wb`, so the world streamer bakes windows off the GL thread
+void appendBuildingWindows(WindowBatch &wb, const Building &B) {
+    int rows = (int) (B.h/2.2f);
+    float faceH = B.h * 0.62f;
+
+    appendWindowPanel(wb, makeFaceFrame(B.x, B.h/2.0f, B.z - B.d/2.0f, 180.0f),
+                      rows, 3, B.w * 0.92f, faceH, 0.0f);
+    appendWindowPanel(wb, makeFaceFrame(B.x, B.h/2.0f, B.z + B.d/2.0f, 0.0f),
+                      rows, 3, B.w * 0.92f, faceH, 0.0f);
+    appendWindowPanel(wb, makeFaceFrame(B.x - B.w/2.0f, B.h/2.0f, B.z, -90.0f),
+                      rows, 2, B.d * 0.92f, faceH, 0.0f);
+    appendWindowPanel(wb, makeFaceFrame(B.x + B.w/2.0f, B.h/2.0f, B.z, 90.0f),
+                      rows, 2, B.d * 0.92f, faceH, 0.0f);
+}
+
+void buildWindowBatch(WindowBatch &wb, const std::vector<int> &buildingIds) {
+    wb.frames.clear();
+    wb.panes.clear();
+    wb.sills.clear();
+
+    for (int id : buildingIds) appendBuildingWindows(wb, buildings[id]);
+}
+
+void drawVertexBatch(const VertexBatch &batch) {
+    if (batch.data.empty()) return;
+    glInterleavedArrays(GL_N3F_V3F, 0, batch.data.data());
+    frameStats.drawCalls++;
+    glDrawArrays(GL_QUADS, 0, batch.vertexCount());
+}
+
+const GLfloat NO_EMISSION[4]    = { 0.0f, 0.0f, 0.0f, 1.0f };
+const GLfloat GLASS_EMISSION[4] = { 0.1f, 0.12f, 0.15f, 1.0f };
+
+void drawWindowBatch(const WindowBatch &wb) {
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+    // Window frames
+    applyMaterial(MAT_WINDOW_FRAME);
+    drawVertexBatch(wb.frames);
+
+    // Glass panes
+    applyMaterial(MAT_GLASS);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, GLASS_EMISSION);
+    drawVertexBatch(wb.panes);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, NO_EMISSION);
+
+    // Window sills
+    applyMaterial(MAT_SILL);
+    drawVertexBatch(wb.sills);
+
+    glPopClientAttrib();
+}
+
+// -------------------------- Drawing primitives --------------------------
+void drawBuildingWithDetails(const Building &B) {
+    float bx = B.x;
+    float bz = B.z;
+    float w = B.w;
+    float d = B.d;
+    float h = B.h;
+
+    applyMaterial(MAT_BUILDING);
+    drawBox(bx, h/2.0f, bz, w, h, d);
+
+    // Windows on all four sides come from the window batch
+
+    // Front face door
+    glPushMatrix();
+      glTranslatef(bx, h/2.0f, bz - d/2.0f);
+      glRotatef(180.0f, 0,1,0);
+      glPushMatrix();
+        glTranslatef(0.0f, -h/2.0f + 1.2f, 0.1f);
+        glScalef(0.9f, 1.8f, 0.15f);
+        applyMaterial(MAT_DOOR);
+        drawMesh(meshes.cube);
+        // door knob
+        applyMaterial(MAT_DOOR_KNOB);
+        glPushMatrix();
+          glTranslatef(0.35f, 0.0f, 0.5f);
+          drawSphere(meshes.doorKnob, 0.05f);
+        glPopMatrix();
+      glPopMatrix();
+    glPopMatrix();
+
+    // Roof detail
+    applyMaterial(MAT_ROOF);
+    drawBox(bx, h + 0.25f, bz, w*1.02f, 0.4f, d*1.02f);
+}
+
+void drawTree(float x, float z, float scale=1.0f, int lod=0) {
+    if (lod >= 2) {
+        // Single cone standing in for trunk and leaves
+        applyMaterial(MAT_LEAVES);
+        glPushMatrix();
+          glTranslatef(x, 0.8f, z);
+          glRotatef(-90, 1, 0, 0);
+          glScalef(0.9f*scale, 0.9f*scale, 0.8f + 2.4f*scale);
+          drawMesh(meshes.treeImpostor);
+        glPopMatrix();
+        return;
+    }
+
+    // trunk
+    applyMaterial(MAT_TRUNK);
+    glPushMatrix();
+      glTranslatef(x, 0.8f, z);
+      glRotatef(-90, 1, 0, 0);
+      glScalef(scale, scale, scale);
+      drawMesh(lod == 0 ? meshes.treeTrunk : meshes.treeTrunkLow);
+    glPopMatrix();
+
+    // leaves
+    applyMaterial(MAT_LEAVES);
+    if (lod == 1) {
+        // One cone covering all three tiers
+        glPushMatrix();
+          glTranslatef(x, 1.6f, z);
+          glRotatef(-90, 1, 0, 0);
+          glScalef(0.9f*scale, 0.9f*scale, 2.4f*scale);
+          drawMesh(meshes.treeConeLow);
+        glPopMatrix();
+        return;
+    }
+    for (int i=0;i<3;i++) {
+        glPushMatrix();
+          glTranslatef(x, 1.6f + i*0.7f*scale, z);
+          glRotatef(-90, 1, 0, 0);
+          float radius = 0.9f*scale - 0.2f*i*scale;
+          glScalef(radius, radius, 1.0f*scale);
+          drawMesh(meshes.treeCone);
+        glPopMatrix();
+    }
+}
+
+// -------------------------- Grass --------------------------
+// Blades are generated once per patch from a fixed seed and kept in a vertex
+// buffer; a frame only pays one draw call per patch. Colors are refilled when
+// the weather palette changes.
+int grassBladesPerPatch = 200; // density, set with --grass-blades
+
+struct GrassPatch {
+    float x, z;              // center
+    float w, d;              // width (x) and depth (z)
+    uint32_t seed;
+    int bladeCount = 0;
+    std::vector<GLfloat> verts = {};      // interleaved GL_C3F_V3F, 2 per blade
+    std::vector<unsigned char> shades = {}; // 0 dark, 1 medium, 2 light
+    GLuint vbo = 0;
+    bool colorsValid = false;
+    unsigned colorVersion = 0;           // weather palette the colors came from
+};
+std::vector<GrassPatch> grassPatches;
+
+void generateGrassBlades(GrassPatch &p) {
+    Rng rng(p.seed);
+    p.bladeCount = grassBladesPerPatch;
+    p.verts.assign((size_t) p.bladeCount * 12, 0.0f);
+    p.shades.resize(p.bladeCount);
+
+    for (int i = 0; i < p.bladeCount; i++) {
+        float rx = rng.uniform() * p.w - p.w/2;
+        float rz = rng.uniform() * p.d - p.d/2;
+        float height = 0.15f + rng.range(30)/200.0f;
+        float curve = rng.range(100)/500.0f - 0.1f;
+        float leanX = rng.range(100)/300.0f - 0.16f;
+        float leanZ = rng.range(100)/300.0f - 0.16f;
+        p.shades[i] = (unsigned char) rng.range(3);
+
+        GLfloat* v = &p.verts[(size_t) i * 12];
+        v[3] = p.x + rx;                 v[4]  = 0.0f;   v[5]  = p.z + rz;
+        v[9] = p.x + rx + leanX + curve; v[10] = height; v[11] = p.z + rz + leanZ;
+    }
+    p.colorsValid = false;
+}
+
+void updateGrassColors(GrassPatch &p) {
+    const float *shade[3] = {
+        paletteColor(MAT_BLADE_DARK), paletteColor(MAT_BLADE_MID), paletteColor(MAT_BLADE_LIGHT)
+    };
+
+    for (int i = 0; i < p.bladeCount; i++) {
+        const float* c = shade[p.shades[i]];
+        GLfloat* v = &p.verts[(size_t) i * 12];
+        v[0] = c[0]; v[1] = c[1]; v[2] = c[2];
+        v[6] = c[0]; v[7] = c[1]; v[8] = c[2];
+    }
+
+    if (hasVertexBufferObjects()) {
+        if (p.vbo == 0) glGenBuffers(1, &p.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, p.vbo);
+        glBufferData(GL_ARRAY_BUFFER, p.verts.size() * sizeof(GLfloat), p.verts.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    p.colorVersion = weatherPalette.version;
+    p.colorsValid = true;
+}
+
+void setupGrass() {
+    grassPatches.clear();
+    grassPatches.push_back({ -11.0f, 0.0f, 6.0f, 220.0f, 1001u });
+    grassPatches.push_back({  11.0f, 0.0f, 6.0f, 220.0f, 1002u });
+    for (GrassPatch &p : grassPatches) generateGrassBlades(p);
+}
+
+// Base grass surface, appended to the static ground layer
+void drawGrassBase(const GrassPatch &p) {
+    vertexStream.beginLit(GL_QUADS, MAT_GRASS, 1.0f);
+    vertexStream.vertex(p.x - p.w/2, 0.001f, p.z - p.d/2);
+    vertexStream.vertex(p.x + p.w/2, 0.001f, p.z - p.d/2);
+    vertexStream.vertex(p.x + p.w/2, 0.001f, p.z + p.d/2);
+    vertexStream.vertex(p.x - p.w/2, 0.001f, p.z + p.d/2);
+}
+
+void drawGrassBlades(GrassPatch &p) {
+    if (p.bladeCount == 0) return;
+    if (!p.colorsValid || p.colorVersion != weatherPalette.version) updateGrassColors(p);
+
+    glDisable(GL_LIGHTING);
+    glLineWidth(1.5f);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    if (p.vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, p.vbo);
+        glInterleavedArrays(GL_C3F_V3F, 0, nullptr);
+    } else {
+        glInterleavedArrays(GL_C3F_V3F, 0, p.verts.data());
+    }
+    frameStats.drawCalls++;
+    glDrawArrays(GL_LINES, 0, p.bladeCount * 2);
+    if (p.vbo) glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPopClientAttrib();
+    glEnable(GL_LIGHTING);
+}
+
+// Humans and cars are recorded into the render queue and drawn sorted by
+// material in drawScene()
+void drawHuman(const Human &h) {
+    renderQueue.push();
+      renderQueue.translate(h.x, 0.0f, h.z);
+
+      // body
+      renderQueue.material(MAT_SKIN);
+
+      if (h.lod >= 2) {
+        // Whole figure as one box
+        renderQueue.push();
+          renderQueue.translate(0.0f, 0.85f, 0.0f);
+          renderQueue.scale(0.4f, 1.7f, 0.25f);
+          renderQueue.mesh(meshes.cube);
+        renderQueue.pop();
+        renderQueue.pop();
+        return;
+      }
+
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.9f, 0.0f);
+        renderQueue.scale(0.35f, 0.7f, 0.25f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+
+      // head
+      renderQueue.material(MAT_FACE);
+
+      renderQueue.push();
+        renderQueue.translate(0.0f, 1.5f, 0.0f);
+        renderQueue.sphere(h.lod == 0 ? meshes.head : meshes.headLow, 0.18f);
+      renderQueue.pop();
+
+      // legs
+      renderQueue.material(MAT_TROUSERS);
+      if (h.lod == 1) {
+        // Both legs as one box, arms dropped
+        renderQueue.push();
+          renderQueue.translate(0.0f, 0.35f, 0.0f);
+          renderQueue.scale(0.3f, 0.7f, 0.12f);
+          renderQueue.mesh(meshes.cube);
+        renderQueue.pop();
+        renderQueue.pop();
+        return;
+      }
+      float swing = sinf(h.phase*6.28f) * 0.25f;
+      renderQueue.push();
+        renderQueue.translate(-0.09f + 0.02f*swing, 0.35f, 0.0f);
+        renderQueue.scale(0.12f, 0.7f, 0.12f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.push();
+        renderQueue.translate(0.09f - 0.02f*swing, 0.35f, 0.0f);
+        renderQueue.scale(0.12f, 0.7f, 0.12f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+
+      // arms
+      renderQueue.material(MAT_SLEEVES);
+      renderQueue.push();
+        renderQueue.translate(-0.28f, 1.05f, 0.0f);
+        renderQueue.rotate(swing*30.0f, 1,0,0);
+        renderQueue.scale(0.1f, 0.6f, 0.1f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.push();
+        renderQueue.translate(0.28f, 1.05f, 0.0f);
+        renderQueue.rotate(-swing*30.0f, 1,0,0);
+        renderQueue.scale(0.1f, 0.6f, 0.1f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+    renderQueue.pop();
+}
+
+void drawSedan(const Car &c) {
+    renderQueue.push();
+      renderQueue.translate(c.laneX, 0.3f, c.z);
+      renderQueue.material(c.r, c.g, c.b, 30.0f);
+      renderQueue.push();
+        renderQueue.scale(1.0f, 0.45f, 2.2f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.85f, 0.95f, 1.0f, 10.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.25f, -0.3f);
+        renderQueue.scale(0.7f, 0.4f, 1.0f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      if (c.lod == 0) {
+        renderQueue.material(0.9f, 0.9f, 0.7f, 50.0f);
+        renderQueue.push();
+          renderQueue.translate(0.4f, 0.1f, 0.9f);
+          renderQueue.sphere(meshes.headlight, 0.08f);
+        renderQueue.pop();
+        renderQueue.push();
+          renderQueue.translate(-0.4f, 0.1f, 0.9f);
+          renderQueue.sphere(meshes.headlight, 0.08f);
+        renderQueue.pop();
+      }
+      renderQueue.material(0.02f, 0.02f, 0.02f, 5.0f);
+      for (int i=-1;i<=1;i+=2) {
+        for (int j=-1;j<=1;j+=2) {
+          renderQueue.push();
+            renderQueue.translate(0.55f*j, -0.15f, 0.6f*i);
+            renderQueue.rotate(90, 0,1,0);
+            renderQueue.rotate(c.wheelRotation, 0,0,1);
+            renderQueue.mesh(c.lod == 0 ? meshes.wheelSedan : meshes.wheelSedanLow);
+          renderQueue.pop();
+        }
+      }
+    renderQueue.pop();
+}
+
+void drawSUV(const Car &c) {
+    renderQueue.push();
+      renderQueue.translate(c.laneX, 0.4f, c.z);
+      renderQueue.material(c.r, c.g, c.b, 30.0f);
+      renderQueue.push();
+        renderQueue.scale(1.2f, 0.6f, 2.4f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.85f, 0.95f, 1.0f, 10.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.35f, -0.2f);
+        renderQueue.scale(0.9f, 0.5f, 1.2f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.3f, 0.3f, 0.3f, 10.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.7f, 0.0f);
+        renderQueue.scale(0.8f, 0.05f, 1.8f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.02f, 0.02f, 0.02f, 5.0f);
+      for (int i=-1;i<=1;i+=2) {
+        for (int j=-1;j<=1;j+=2) {
+          renderQueue.push();
+            renderQueue.translate(0.65f*j, -0.2f, 0.7f*i);
+            renderQueue.rotate(90, 0,1,0);
+            renderQueue.rotate(c.wheelRotation, 0,0,1);
+            renderQueue.mesh(c.lod == 0 ? meshes.wheelSUV : meshes.wheelSUVLow);
+          renderQueue.pop();
+        }
+      }
+    renderQueue.pop();
+}
+
+void drawSportsCar(const Car &c) {
+    renderQueue.push();
+      renderQueue.translate(c.laneX, 0.25f, c.z);
+      renderQueue.material(c.r, c.g, c.b, 60.0f);
+      renderQueue.push();
+        renderQueue.scale(0.9f, 0.3f, 1.8f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.2f, 0.2f, 0.2f, 40.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.2f, -0.2f);
+        renderQueue.scale(0.7f, 0.25f, 0.9f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(c.r*0.7f, c.g*0.7f, c.b*0.7f, 30.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.4f, -0.8f);
+        renderQueue.scale(0.6f, 0.05f, 0.2f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.02f, 0.02f, 0.02f, 5.0f);
+      for (int i=-1;i<=1;i+=2) {
+        for (int j=-1;j<=1;j+=2) {
+          renderQueue.push();
+            renderQueue.translate(0.5f*j, -0.1f, 0.5f*i);
+            renderQueue.rotate(90, 0,1,0);
+            renderQueue.rotate(c.wheelRotation, 0,0,1);
+            renderQueue.mesh(c.lod == 0 ? meshes.wheelSports : meshes.wheelSportsLow);
+          renderQueue.pop();
+        }
+      }
+    renderQueue.pop();
+}
+
+void drawTruck(const Car &c) {
+    renderQueue.push();
+      renderQueue.translate(c.laneX, 0.5f, c.z);
+      renderQueue.material(c.r, c.g, c.b, 30.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.3f, -0.8f);
+        renderQueue.scale(1.0f, 0.8f, 1.0f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(c.r*0.8f, c.g*0.8f, c.b*0.8f, 30.0f);
+      renderQueue.push();
+        renderQueue.translate(0.0f, 0.4f, 0.8f);
+        renderQueue.scale(1.4f, 0.9f, 2.0f);
+        renderQueue.mesh(meshes.cube);
+      renderQueue.pop();
+      renderQueue.material(0.02f, 0.02f, 0.02f, 5.0f);
+      float wheelPositions[] = {-0.7f, 0.7f, -1.5f, 1.5f};
+      for (int i=0; i<4; i++) {
+        for (int j=-1;j<=1;j+=2) {
+          renderQueue.push();
+            renderQueue.translate(wheelPositions[i]*j, -0.3f, -0.5f);
+            renderQueue.rotate(90, 0,1,0);
+            renderQueue.rotate(c.wheelRotation, 0,0,1);
+            renderQueue.mesh(c.lod == 0 ? meshes.wheelTruck : meshes.wheelTruckLow);
+          renderQueue.pop();
+        }
+      }
+      for (int j=-1;j<=1;j+=2) {
+        renderQueue.push();
+          renderQueue.translate(wheelPositions[3]*j, -0.3f, 1.2f);
+          renderQueue.rotate(90, 0,1,0);
+          renderQueue.rotate(c.wheelRotation, 0,0,1);
+          renderQueue.mesh(c.lod == 0 ? meshes.wheelTruck : meshes.wheelTruckLow);
+        renderQueue.pop();
+      }
+    renderQueue.pop();
+}
+
+// Lowest level of detail: one box in the body color covering the whole car
+void drawCarBox(const Car &c) {
+    // center y, center z, size x/y/z per car type
+    static const float extents[4][5] = {
+        { 0.375f, 0.0f,  1.1f, 0.75f, 2.2f },   // sedan
+        { 0.55f,  0.0f,  1.3f, 1.1f,  2.4f },   // SUV
+        { 0.3f,   0.0f,  1.0f, 0.6f,  1.8f },   // sports car
+        { 0.675f, 0.25f, 1.4f, 1.35f, 3.1f }    // truck
+    };
+    const float *e = extents[(c.carType >= 0 && c.carType < 4) ? c.carType : 0];
+    renderQueue.push();
+      renderQueue.translate(c.laneX, e[0], c.z + e[1]);
+      renderQueue.material(c.r, c.g, c.b, 30.0f);
+      renderQueue.scale(e[2], e[3], e[4]);
+      renderQueue.mesh(meshes.cube);
+    renderQueue.pop();
+}
+
+void drawCarModel(const Car &c) {
+    if (c.lod >= 2) {
+        drawCarBox(c);
+        return;
+    }
+    switch(c.carType) {
+        case 0: drawSedan(c); break;
+        case 1: drawSUV(c); break;
+        case 2: drawSportsCar(c); break;
+        case 3: drawTruck(c); break;
+        default: drawSedan(c); break;
+    }
+}
+
+void drawSunAndRays(float& sunX_out, float& sunY_out, float& sunZ_out) {
+    float rad = sunAngle * M_PI / 180.0f;
+    float sx = SUN_RADIUS * cosf(rad);
+    float sy = SUN_RADIUS * sinf(rad) + 6.0f;
+    float sz = -10.0f;
+
+    sunX_out = sx;
+    sunY_out = sy;
+    sunZ_out = sz;
+
+    GLfloat sunPos[] = { sx, sy, sz, 1.0f };
+    glLightfv(GL_LIGHT0, GL_POSITION, sunPos);
+
+    // Draw sun (only visible during sunny weather)
+    if (rainIntensity < 0.5f) {
+        glPushMatrix();
+          glTranslatef(sx, sy, sz);
+          glDisable(GL_LIGHTING);
+          glColor3f(1.0f, 0.9f, 0.5f);
+          drawSphere(meshes.sunOuter, 1.3f);
+          glEnable(GL_LIGHTING);
+          GLfloat emis[4] = {0.6f,0.5f,0.3f,1.0f};
+          glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emis);
+          drawSphere(meshes.sunInner, 0.9f);
+          glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, NO_EMISSION);
+        glPopMatrix();
+    }
+}
+
+// Extent of everything on the ground, used to size the ground plane
+GroundRect groundExtent() {
+    GroundRect e = { -200.0f, -200.0f, 200.0f, 200.0f };
+    for (const Road &r : roads) {
+        e.x0 = fminf(e.x0, r.x0 - 80.0f); e.z0 = fminf(e.z0, r.z0 - 80.0f);
+        e.x1 = fmaxf(e.x1, r.x1 + 80.0f); e.z1 = fmaxf(e.z1, r.z1 + 80.0f);
+    }
+    return e;
+}
+
+// Dashed line along a road, `offset` from its centre line
+void emitRoadDashes(const Road &r, float offset, float step, float dash) {
+    if (r.alongZ) {
+        float x = 0.5f * (r.x0 + r.x1) + offset;
+        for (float z = r.z0; z < r.z1; z += step) {
+            vertexStream.vertex(x, 0.002f, z);
+            vertexStream.vertex(x, 0.002f, fminf(z + dash, r.z1));
+        }
+    } else {
+        float z = 0.5f * (r.z0 + r.z1) + offset;
+        for (float x = r.x0; x < r.x1; x += step) {
+            vertexStream.vertex(x, 0.002f, z);
+            vertexStream.vertex(fminf(x + dash, r.x1), 0.002f, z);
+        }
+    }
+}
+
+// Ground plane, roads, road markings and sidewalks of one area
+void emitStreetLayer(const GroundRect &g, const std::vector<Road> &streets,
+                     const std::vector<GroundRect> &walks) {
+    // The layers are only millimetres apart, so push each one back in depth
+    // by its stacking order instead of relying on the tiny y offsets
+    VertexStream &vs = vertexStream;
+
+    // Ground
+    vs.beginLit(GL_QUADS, MAT_GROUND, 2.0f);
+    vs.vertex(g.x0, 0.0f, g.z0);
+    vs.vertex(g.x1, 0.0f, g.z0);
+    vs.vertex(g.x1, 0.0f, g.z1);
+    vs.vertex(g.x0, 0.0f, g.z1);
+
+    // Roads
+    vs.beginLit(GL_QUADS, MAT_ROAD, 1.0f);
+    for (const Road &r : streets) {
+        vs.vertex(r.x0, 0.001f, r.z0);
+        vs.vertex(r.x1, 0.001f, r.z0);
+        vs.vertex(r.x1, 0.001f, r.z1);
+        vs.vertex(r.x0, 0.001f, r.z1);
+    }
+
+    // Road markings
+    vs.begin(GL_LINES, 1.0f, 0.9f, 0.0f, 1.0f, false, 3.0f);
+    for (const Road &r : streets) emitRoadDashes(r, 0.0f, 8.0f, 4.0f);
+    vs.begin(GL_LINES, 1.0f, 1.0f, 1.0f, 1.0f, false, 3.0f);
+    for (const Road &r : streets) {
+        emitRoadDashes(r, -0.6f, 15.0f, 7.0f);
+        emitRoadDashes(r,  0.6f, 15.0f, 7.0f);
+        // Dividers between lanes of the same direction
+        for (int k = 1; k < lanesPerDirection(r); ++k) {
+            emitRoadDashes(r, -k * LANE_WIDTH, 6.0f, 3.0f);
+            emitRoadDashes(r,  k * LANE_WIDTH, 6.0f, 3.0f);
+        }
+    }
+
+    // Sidewalks
+    vs.beginLit(GL_QUADS, MAT_SIDEWALK, 1.0f);
+    for (const GroundRect &sw : walks) {
+        vs.vertex(sw.x0, 0.002f, sw.z0);
+        vs.vertex(sw.x1, 0.002f, sw.z0);
+        vs.vertex(sw.x1, 0.002f, sw.z1);
+        vs.vertex(sw.x0, 0.002f, sw.z1);
+    }
+}
+
+void drawGroundLayer() {
+    emitStreetLayer(groundExtent(), roads, sidewalks);
+
+    // Grass strips
+    for (const GrassPatch &p : grassPatches) drawGrassBase(p);
+
+    vertexStream.flush();
+}
+
+// -------------------------- Car instancing --------------------------
+// Every car type is baked, per level of detail, into one mesh by recording
+// its draw function through the render queue: each part is moved into car
+// space, parts painted in the car color keep the factor they scale it by,
+// and wheel vertices keep the centre of their hub. A frame then gathers the
+// visible cars' position, color and wheel rotation into one instance buffer
+// and draws each (type, LOD) with a single glDrawElementsInstanced, so the
+// GL cost stays the same from a handful of cars to tens of thousands. A
+// GLSL 1.20 program places each instance, spins its wheels and repeats the
+// fixed-function lighting of GL_LIGHT0 with setMaterialRGB's materials.
+// Without GL 3.3, or with --instancing off, cars go through the render queue.
+const int CAR_TYPES = 4;
+
+enum CarAttribute {
+    CAR_ATTR_POSITION, CAR_ATTR_NORMAL, CAR_ATTR_COLOR, CAR_ATTR_SHININESS, CAR_ATTR_HUB,
+    CAR_ATTR_PLACE, CAR_ATTR_PAINT      // per instance
+};
+
+struct CarTemplateVertex {
+    float x, y, z;
+    float nx, ny, nz;
+    float r, g, b, tinted;      // tinted: r, g, b scale the car color
+    float shininess;
+    float hx, hy, hz, wheel;    // wheel: spins about +X through the hub
+};
+
+// The hub is the part's own origin (the translation of its transform): the
+// car draw functions spin a wheel by the innermost rotate(wheelRotation,
+// 0,0,1) after turning its Z onto car +X, so it turns about the line
+// through that origin along +X whether or not the mesh is centred on it.
+// buildCarTemplate() checks this against a recording with spun wheels.
+
+struct CarInstance {
+    float x, z, wheelRotation;
+    float r, g, b;
+};
+
+struct CarTemplate {
+    GLuint vbo = 0, ibo = 0;
+    GLsizei indexCount = 0;
+    GLenum indexType = GL_UNSIGNED_SHORT;   // GL_UNSIGNED_INT past 65536 vertices
+};
+
+struct CarInstancing {
+    bool enabled = true;            // --instancing off
+    bool ready = false;             // program and templates built
+    GLuint program = 0;
+    GLuint instanceVbo = 0;
+    size_t capacity = 0;            // instances the buffer holds
+    CarTemplate templates[CAR_TYPES][LOD_LEVELS];
+    std::vector<CarInstance> groups[CAR_TYPES][LOD_LEVELS];    // this frame's cars
+};
+CarInstancing carInstancing;
+
+const char *CAR_VERTEX_SHADER =
+    "#version 120\n"
+    "attribute vec3 position, normal;\n"
+    "attribute vec4 color;\n"
+    "attribute float shininess;\n"
+    "attribute vec4 hub;\n"
+    "attribute vec3 place;\n"       // x, z, wheel rotation in degrees
+    "attribute vec3 paint;\n"
+    "void main() {\n"
+    "    vec3 p = position, n = normal;\n"
+    "    if (hub.w > 0.5) {\n"         // rotate about +X through the hub
+    "        float a = radians(place.z), c = cos(a), s = sin(a);\n"
+    "        vec3 d = p - hub.xyz;\n"
+    "        p = hub.xyz + vec3(d.x, c * d.y - s * d.z, s * d.y + c * d.z);\n"
+    "        n = vec3(n.x, c * n.y - s * n.z, s * n.y + c * n.z);\n"
+    "    }\n"
+    "    p.xz += place.xy;\n"
+    "    vec4 eye = gl_ModelViewMatrix * vec4(p, 1.0);\n"
+    "    vec3 N = normalize(gl_NormalMatrix * n);\n"
+    "    vec4 lp = gl_LightSource[0].position;\n"
+    "    vec3 L = normalize(lp.w == 0.0 ? lp.xyz : lp.xyz - eye.xyz);\n"
+    "    float diffuse = max(dot(N, L), 0.0);\n"
+    "    float specular = diffuse > 0.0 ? pow(max(dot(N, normalize(L + vec3(0.0, 0.0, 1.0))), 0.0), shininess) : 0.0;\n"
+    "    vec3 base = color.w > 0.5 ? color.rgb * paint : color.rgb;\n"
+    "    vec3 lit = 0.2 * base * (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb)\n"
+    "             + diffuse * base * gl_LightSource[0].diffuse.rgb\n"
+    "             + specular * 0.8 * gl_LightSource[0].specular.rgb;\n"
+    "    gl_FrontColor = vec4(clamp(lit, 0.0, 1.0), 1.0);\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "}\n";
+
+const char *CAR_FRAGMENT_SHADER =
+    "#version 120\n"
+    "void main() { gl_FragColor = gl_Color; }\n";
+
+GLuint compileShader(GLenum type, const char *src) {
+    GLuint s = glCreateShader(type);
+    glShaderSource(s, 1, &src, nullptr);
+    glCompileShader(s);
+    GLint ok = 0;
+    glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024] = "";
+        glGetShaderInfoLog(s, sizeof(log), nullptr, log);
+        fprintf(stderr, "cars: shader does not compile: %s\n", log);
+        glDeleteShader(s);
+        return 0;
+    }
+    return s;
+}
+
+GLuint linkCarProgram() {
+    GLuint vs = compileShader(GL_VERTEX_SHADER, CAR_VERTEX_SHADER);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, CAR_FRAGMENT_SHADER);
+    if (!vs || !fs) {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return 0;
+    }
+    GLuint p = glCreateProgram();
+    glAttachShader(p, vs);
+    glAttachShader(p, fs);
+    static const char *names[] = { "position", "normal", "color", "shininess", "hub", "place", "paint" };
+    for (int i = 0; i <= CAR_ATTR_PAINT; ++i) glBindAttribLocation(p, i, names[i]);
+    glLinkProgram(p);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    GLint ok = 0;
+    glGetProgramiv(p, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024] = "";
+        glGetProgramInfoLog(p, sizeof(log), nullptr, log);
+        fprintf(stderr, "cars: shader program does not link: %s\n", log);
+        glDeleteProgram(p);
+        return 0;
+    }
+    return p;
+}
+
+// The parts one car draws, as the render queue records them
+void recordCarParts(int type, int lod, float shade, float wheelRotation,
+                    std::vector<DrawItem> &items, std::vector<MaterialKey> &materials) {
+    Car c = {};
+    c.carType = type;
+    c.lod = (unsigned char) lod;
+    c.r = c.g = c.b = shade;
+    c.wheelRotation = wheelRotation;
+    renderQueue.begin();
+    drawCarModel(c);
+    items = renderQueue.items;
+    materials = renderQueue.materials;
+    renderQueue.begin();
+}
+
+// Whether spinning the wheel turns this part about +X through its origin:
+// the origin and the spin axis (the part's Z column) stay put under the 90
+// degree spin, and that axis points along car +X
+bool spinsAboutHub(const float *m, const float *spun) {
+    const float eps = 1e-4f;
+    for (int k = 8; k < 15; ++k)
+        if (k != 11 && fabsf(m[k] - spun[k]) > eps) return false;
+    return m[8] > 0.0f && fabsf(m[9]) <= eps && fabsf(m[10]) <= eps;
+}
+
+// Record the car three times, differing in color and in wheel rotation, to
+// tell painted parts and wheels from the rest. False if a wheel does not spin
+// the way the shader spins it.
+bool buildCarTemplate(int type, int lod, CarTemplate &t) {
+    std::vector<DrawItem> base, shaded, spun;
+    std::vector<MaterialKey> baseMaterials, shadedMaterials, spunMaterials;
+    recordCarParts(type, lod, 1.0f, 0.0f, base, baseMaterials);
+    recordCarParts(type, lod, 0.5f, 0.0f, shaded, shadedMaterials);
+    recordCarParts(type, lod, 1.0f, 90.0f, spun, spunMaterials);
+
+    std::vector<CarTemplateVertex> verts;
+    std::vector<GLuint> indices;
+    for (size_t i = 0; i < base.size(); ++i) {
+        const float *m = base[i].model.m;
+        const MaterialKey &mat = baseMaterials[base[i].material];
+        bool tinted = !(mat == shadedMaterials[shaded[i].material]);
+        bool wheel = memcmp(m, spun[i].model.m, sizeof(base[i].model.m)) != 0;
+        if (wheel && !spinsAboutHub(m, spun[i].model.m)) {
+            fprintf(stderr, "cars: type %d part %zu does not spin about +X through its origin\n", type, i);
+            return false;
+        }
+        // Normals go through the cofactor matrix, which GL_NORMALIZE makes
+        // equivalent to the inverse transpose
+        float cof[9] = {
+            m[5]*m[10] - m[6]*m[9],  m[6]*m[8] - m[4]*m[10],  m[4]*m[9] - m[5]*m[8],
+            m[9]*m[2] - m[10]*m[1],  m[10]*m[0] - m[8]*m[2],  m[8]*m[1] - m[9]*m[0],
+            m[1]*m[6] - m[2]*m[5],   m[2]*m[4] - m[0]*m[6],   m[0]*m[5] - m[1]*m[4]
+        };
+        const Mesh &mesh = meshPool[base[i].mesh];
+        GLuint first = (GLuint) verts.size();
+        for (size_t k = 0; k + 6 <= mesh.verts.size(); k += 6) {
+            const GLfloat *v = &mesh.verts[k];     // nx, ny, nz, x, y, z
+            CarTemplateVertex tv;
+            tv.x = m[0]*v[3] + m[4]*v[4] + m[8]*v[5] + m[12];
+            tv.y = m[1]*v[3] + m[5]*v[4] + m[9]*v[5] + m[13];
+            tv.z = m[2]*v[3] + m[6]*v[4] + m[10]*v[5] + m[14];
+            float nx = cof[0]*v[0] + cof[3]*v[1] + cof[6]*v[2];
+            float ny = cof[1]*v[0] + cof[4]*v[1] + cof[7]*v[2];
+            float nz = cof[2]*v[0] + cof[5]*v[1] + cof[8]*v[2];
+            float len = sqrtf(nx*nx + ny*ny + nz*nz);
+            if (len > 0.0f) { nx /= len; ny /= len; nz /= len; }
+            tv.nx = nx; tv.ny = ny; tv.nz = nz;
+            tv.r = mat.r; tv.g = mat.g; tv.b = mat.b;
+            tv.tinted = tinted ? 1.0f : 0.0f;
+            tv.shininess = mat.shininess;
+            tv.hx = m[12]; tv.hy = m[13]; tv.hz = m[14];
+            tv.wheel = wheel ? 1.0f : 0.0f;
+            verts.push_back(tv);
+        }
+        for (GLushort idx : mesh.indices) indices.push_back(first + idx);
+    }
+    t.indexCount = (GLsizei) indices.size();
+
+    glGenBuffers(1, &t.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, t.vbo);
+    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(CarTemplateVertex), verts.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &t.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t.ibo);
+    if (verts.size() <= 65536) {
+        std::vector<GLushort> narrow(indices.begin(), indices.end());
+        t.indexType = GL_UNSIGNED_SHORT;
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, narrow.size() * sizeof(GLushort), narrow.data(), GL_STATIC_DRAW);
+    } else {
+        t.indexType = GL_UNSIGNED_INT;
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    return true;
+}
+
+// After initMeshLibrary(): the car meshes are baked from the mesh pool
+void initCarInstancing() {
+    CarInstancing &ci = carInstancing;
+    if (!ci.enabled || ci.ready) return;
+    if (!hasInstancing() || !hasVertexBufferObjects()) {
+        fprintf(stderr, "cars: instancing needs GL 3.3, drawing through the render queue\n");
+        return;
+    }
+    ci.program = linkCarProgram();
+    if (!ci.program) return;
+    for (int type = 0; type < CAR_TYPES; ++type) {
+        for (int lod = 0; lod < LOD_LEVELS; ++lod) {
+            if (buildCarTemplate(type, lod, ci.templates[type][lod])) continue;
+            fprintf(stderr, "cars: drawing through the render queue\n");
+            for (auto &byLod : ci.templates)
+                for (CarTemplate &t : byLod) {
+                    if (t.vbo) glDeleteBuffers(1, &t.vbo);
+                    if (t.ibo) glDeleteBuffers(1, &t.ibo);
+                    t = CarTemplate();
+                }
+            glDeleteProgram(ci.program);
+            ci.program = 0;
+            return;
+        }
+    }
+    glGenBuffers(1, &ci.instanceVbo);
+    ci.ready = true;
+}
+
+// Called instead of drawCarModel() when instancing is ready
+void addCarInstance(const Car &c) {
+    int type = (c.carType >= 0 && c.carType < CAR_TYPES) ? c.carType : 0;
+    int lod = std::min((int) c.lod, LOD_LEVELS - 1);
+    carInstancing.groups[type][lod].push_back({ c.laneX, c.z, c.wheelRotation, c.r, c.g, c.b });
+}
+
+void drawCarInstances() {
+    CarInstancing &ci = carInstancing;
+    size_t total = 0;
+    for (auto &byLod : ci.groups)
+        for (const std::vector<CarInstance> &g : byLod) total += g.size();
+    if (total == 0) return;
+
+    // Orphan the buffer each frame, grow it geometrically
+    glBindBuffer(GL_ARRAY_BUFFER, ci.instanceVbo);
+    if (total > ci.capacity) ci.capacity = std::max(total, ci.capacity * 2);
+    glBufferData(GL_ARRAY_BUFFER, ci.capacity * sizeof(CarInstance), nullptr, GL_STREAM_DRAW);
+    size_t offset = 0;
+    for (auto &byLod : ci.groups) {
+        for (const std::vector<CarInstance> &g : byLod) {
+            if (g.empty()) continue;
+            glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(CarInstance), g.size() * sizeof(CarInstance), g.data());
+            offset += g.size();
+        }
+    }
+
+    glUseProgram(ci.program);
+    for (int a = 0; a <= CAR_ATTR_PAINT; ++a) glEnableVertexAttribArray(a);
+    glVertexAttribDivisor(CAR_ATTR_PLACE, 1);
+    glVertexAttribDivisor(CAR_ATTR_PAINT, 1);
+    const GLsizei stride = sizeof(CarTemplateVertex);
+    offset = 0;
+    for (int type = 0; type < CAR_TYPES; ++type) {
+        for (int lod = 0; lod < LOD_LEVELS; ++lod) {
+            std::vector<CarInstance> &g = ci.groups[type][lod];
+            if (g.empty()) continue;
+            const CarTemplate &t = ci.templates[type][lod];
+            glBindBuffer(GL_ARRAY_BUFFER, t.vbo);
+            glVertexAttribPointer(CAR_ATTR_POSITION, 3, GL_FLOAT, GL_FALSE, stride, (void *) offsetof(CarTemplateVertex, x));
+            glVertexAttribPointer(CAR_ATTR_NORMAL, 3, GL_FLOAT, GL_FALSE, stride, (void *) offsetof(CarTemplateVertex, nx));
+            glVertexAttribPointer(CAR_ATTR_COLOR, 4, GL_FLOAT, GL_FALSE, stride, (void *) offsetof(CarTemplateVertex, r));
+            glVertexAttribPointer(CAR_ATTR_SHININESS, 1, GL_FLOAT, GL_FALSE, stride, (void *) offsetof(CarTemplateVertex, shininess));
+            glVertexAttribPointer(CAR_ATTR_HUB, 4, GL_FLOAT, GL_FALSE, stride, (void *) offsetof(CarTemplateVertex, hx));
+            glBindBuffer(GL_ARRAY_BUFFER, ci.instanceVbo);
+            size_t at = offset * sizeof(CarInstance);
+            glVertexAttribPointer(CAR_ATTR_PLACE, 3, GL_FLOAT, GL_FALSE, sizeof(CarInstance),
+                                  (void *) (at + offsetof(CarInstance, x)));
+            glVertexAttribPointer(CAR_ATTR_PAINT, 3, GL_FLOAT, GL_FALSE, sizeof(CarInstance),
+                                  (void *) (at + offsetof(CarInstance, r)));
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t.ibo);
+            glDrawElementsInstanced(GL_TRIANGLES, t.indexCount, t.indexType, nullptr, (GLsizei) g.size());
+            frameStats.drawCalls++;
+            offset += g.size();
+            g.clear();
+        }
+    }
+    glVertexAttribDivisor(CAR_ATTR_PLACE, 0);
+    glVertexAttribDivisor(CAR_ATTR_PAINT, 0);
+    for (int a = 0; a <= CAR_ATTR_PAINT; ++a) glDisableVertexAttribArray(a);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// -------------------------- Scene file --------------------------
+// --export-scene FILE writes the world as built at startup (buildings, trees,
+// streets, grass patches, cars, humans and the tessellated mesh library) to
+// a binary file; --scene FILE starts from one instead of building a world.
+// The file is a header, a section table and 64-byte aligned sections of
+// fixed-size records made only of 4-byte fields (plus the 2-byte mesh
+// indices), so no record has padding and the same world always gives the
+// same bytes. Buildings, trees, sidewalks and meshes are stored as their
+// runtime structs, which have that layout (asserted below), so loading maps
+// the file and bulk-copies those sections without parsing a field; roads,
+// cars and humans, whose runtime structs carry padding and simulation
+// state, go through SceneRoad, SceneCar and SceneHuman. The file is
+// native-endian and versioned by SCENE_VERSION plus the record size of
+// every section, so a file from a build with different records is refused.
+const char SCENE_MAGIC[8] = { 'C', 'I', 'T', 'Y', 'S', 'C', 'N', 0 };
+const uint32_t SCENE_VERSION = 2;
+const size_t SCENE_ALIGN = 64;
+
+enum SceneSectionId {
+    SCENE_BUILDINGS, SCENE_TREES, SCENE_ROADS, SCENE_SIDEWALKS, SCENE_GRASS,
+    SCENE_CARS, SCENE_HUMANS, SCENE_MESHES, SCENE_MESH_VERTS, SCENE_MESH_INDICES,
+    SCENE_SECTION_COUNT
+};
+
+struct SceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    float walkEndZ;
+    uint32_t reserved[3];
+};
+
+struct SceneSection {
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t offset;        // from the start of the file
+    uint64_t count;         // records
+};
+
+// Grass patch as stored; blades are regenerated from the seed
+struct SceneGrass {
+    float x, z, w, d;
+    uint32_t seed;
+};
+
+// Mesh library entry: key plus its ranges in the vertex and index sections
+struct SceneMesh {
+    MeshKey key;
+    uint32_t firstVert, vertCount;      // GLfloats
+    uint32_t firstIndex, indexCount;
+};
+
+struct SceneRoad {
+    float x0, z0, x1, z1;
+    uint32_t alongZ;
+};
+
+// Car as placed; lane, level of detail and previous-step state are rebuilt
+struct SceneCar {
+    float laneX, z, speed;
+    float r, g, b;
+    float wheelRotation, cruise;
+    int32_t carType;
+};
+
+struct SceneHuman {
+    float x, z, dir, speed, phase;
+    int32_t walk;
+};
+
+// Sections are reinterpreted in place, so every record must be plain bytes
+// without padding
+template <typename T, size_t Fields>
+constexpr bool sceneRecordOk() {
+    return std::is_trivially_copyable<T>::value && sizeof(T) == Fields * 4;
+}
+static_assert(sceneRecordOk<SceneHeader, 8>(), "SceneHeader layout");
+static_assert(sceneRecordOk<SceneSection, 6>(), "SceneSection layout");
+static_assert(sceneRecordOk<Building, 5>(), "Building is stored as is");
+static_assert(sceneRecordOk<Tree, 3>(), "Tree is stored as is");
+static_assert(sceneRecordOk<GroundRect, 4>(), "GroundRect is stored as is");
+static_assert(sceneRecordOk<SceneRoad, 5>(), "SceneRoad layout");
+static_assert(sceneRecordOk<SceneGrass, 5>(), "SceneGrass layout");
+static_assert(sceneRecordOk<SceneCar, 9>(), "SceneCar layout");
+static_assert(sceneRecordOk<SceneHuman, 6>(), "SceneHuman layout");
+static_assert(sceneRecordOk<SceneMesh, 10>(), "SceneMesh layout");
+static_assert(sceneRecordOk<GLfloat, 1>() && std::is_trivially_copyable<GLushort>::value, "mesh data");
+
+const char *sceneLoadPath = nullptr;    // --scene
+const char *sceneExportPath = nullptr;  // --export-scene
+
+bool exportScene(const char *path) {
+    std::vector<SceneGrass> grass;
+    for (const GrassPatch &p : grassPatches) grass.push_back({ p.x, p.z, p.w, p.d, p.seed });
+    std::vector<SceneRoad> roadRecords;
+    for (const Road &r : roads) roadRecords.push_back({ r.x0, r.z0, r.x1, r.z1, r.alongZ ? 1u : 0u });
+    std::vector<SceneCar> carRecords;
+    for (const Car &c : cars)
+        carRecords.push_back({ c.laneX, c.z, c.speed, c.r, c.g, c.b, c.wheelRotation, c.cruise, c.carType });
+    std::vector<SceneHuman> humanRecords;
+    for (const Human &h : humans) humanRecords.push_back({ h.x, h.z, h.dir, h.speed, h.phase, h.walk });
+
+    std::vector<SceneMesh> meshRecords(meshPool.size());
+    std::vector<GLfloat> verts;
+    std::vector<GLushort> indices;
+    for (const auto &entry : meshIndex) {
+        const Mesh &m = meshPool[entry.second];
+        meshRecords[entry.second] = { entry.first, (uint32_t) verts.size(), (uint32_t) m.verts.size(),
+                                      (uint32_t) indices.size(), (uint32_t) m.indices.size() };
+        verts.insert(verts.end(), m.verts.begin(), m.verts.end());
+        indices.insert(indices.end(), m.indices.begin(), m.indices.end());
+    }
+
+    struct Source { const void *data; size_t recordSize, count; };
+    const Source sources[SCENE_SECTION_COUNT] = {
+        { buildings.data(), sizeof(Building), buildings.size() },
+        { trees.data(), sizeof(Tree), trees.size() },
+        { roadRecords.data(), sizeof(SceneRoad), roadRecords.size() },
+        { sidewalks.data(), sizeof(GroundRect), sidewalks.size() },
+        { grass.data(), sizeof(SceneGrass), grass.size() },
+        { carRecords.data(), sizeof(SceneCar), carRecords.size() },
+        { humanRecords.data(), sizeof(SceneHuman), humanRecords.size() },
+        { meshRecords.data(), sizeof(SceneMesh), meshRecords.size() },
+        { verts.data(), sizeof(GLfloat), verts.size() },
+        { indices.data(), sizeof(GLushort), indices.size() },
+    };
+
+    SceneHeader header = {};
+    memcpy(header.magic, SCENE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_VERSION;
+    header.sectionCount = SCENE_SECTION_COUNT;
+    header.walkEndZ = walkEndZ;
+
+    SceneSection table[SCENE_SECTION_COUNT] = {};
+    uint64_t offset = sizeof(header) + sizeof(table);
+    for (int i = 0; i < SCENE_SECTION_COUNT; ++i) {
+        offset = (offset + SCENE_ALIGN - 1) & ~(uint64_t) (SCENE_ALIGN - 1);
+        table[i] = { (uint32_t) sources[i].recordSize, 0, offset, sources[i].count };
+        offset += sources[i].recordSize * sources[i].count;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "scene: cannot write %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(table, sizeof(table), 1, f) == 1;
+    static const char padding[SCENE_ALIGN] = {};
+    for (int i = 0; ok && i < SCENE_SECTION_COUNT; ++i) {
+        long pad = (long) table[i].offset - ftell(f);
+        size_t bytes = sources[i].recordSize * sources[i].count;
+        ok = fwrite(padding, 1, pad, f) == (size_t) pad && (bytes == 0 || fwrite(sources[i].data, bytes, 1, f) == 1);
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) fprintf(stderr, "scene: error writing %s\n", path);
+    else fprintf(stderr, "scene: wrote %s (%zu buildings, %zu trees, %zu cars, %zu humans, %llu bytes)\n",
+                 path, buildings.size(), trees.size(), cars.size(), humans.size(), (unsigned long long) offset);
+    return ok;
+}
+
+// Map (or, without mmap, read) a whole file; release with unmapFile()
+const unsigned char *mapFile(const char *path, size_t &size) {
+#ifdef CITY_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = (size_t) st.st_size;
+        p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return p == MAP_FAILED ? nullptr : (const unsigned char *) p;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    size = (size_t) ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *p = (unsigned char *) malloc(size ? size : 1);
+    if (p && fread(p, 1, size, f) != size) {
+        free(p);
+        p = nullptr;
+    }
+    fclose(f);
+    return p;
+#endif
+}
+
+void unmapFile(const unsigned char *p, size_t size) {
+#ifdef CITY_MMAP
+    munmap((void *) p, size);
+#else
+    (void) size;
+    free((void *) p);
+#endif
+}
+
+// Fill the world from a scene file; false (and nothing changed) if the file
+// is missing, truncated, corrupt or from another build
+bool loadScene(const char *path) {
+    auto t0 = std::chrono::steady_clock::now();
+    size_t size = 0;
+    const unsigned char *base = mapFile(path, size);
+    if (!base) {
+        fprintf(stderr, "scene: cannot read %s\n", path);
+        return false;
+    }
+
+    const SceneHeader *header = (const SceneHeader *) base;
+    const SceneSection *table = (const SceneSection *) (base + sizeof(SceneHeader));
+    static const size_t recordSizes[SCENE_SECTION_COUNT] = {
+        sizeof(Building), sizeof(Tree), sizeof(SceneRoad), sizeof(GroundRect), sizeof(SceneGrass),
+        sizeof(SceneCar), sizeof(SceneHuman), sizeof(SceneMesh), sizeof(GLfloat), sizeof(GLushort)
+    };
+    const char *problem = nullptr;
+    if (size < sizeof(SceneHeader) + SCENE_SECTION_COUNT * sizeof(SceneSection)
+        || memcmp(header->magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)))
+        problem = "not a scene file";
+    else if (header->version != SCENE_VERSION || header->sectionCount != SCENE_SECTION_COUNT)
+        problem = "unsupported version";
+    for (int i = 0; !problem && i < SCENE_SECTION_COUNT; ++i) {
+        if (table[i].recordSize != recordSizes[i]) problem = "written by a build with different record layouts";
+        else if (table[i].offset > size || table[i].count > (size - table[i].offset) / recordSizes[i])
+            problem = "truncated";
+    }
+
+    // Each mesh must lie inside the vertex and index sections, hold whole
+    // GL_N3F_V3F vertices and index only its own vertices
+    auto section = [&](SceneSectionId id) { return base + table[id].offset; };
+    const SceneMesh *meshRecords = nullptr;
+    const GLfloat *verts = nullptr;
+    const GLushort *indices = nullptr;
+    if (!problem) {
+        meshRecords = (const SceneMesh *) section(SCENE_MESHES);
+        verts = (const GLfloat *) section(SCENE_MESH_VERTS);
+        indices = (const GLushort *) section(SCENE_MESH_INDICES);
+    }
+    for (uint64_t i = 0; !problem && i < table[SCENE_MESHES].count; ++i) {
+        const SceneMesh &r = meshRecords[i];
+        if ((uint64_t) r.firstVert + r.vertCount > table[SCENE_MESH_VERTS].count
+            || (uint64_t) r.firstIndex + r.indexCount > table[SCENE_MESH_INDICES].count
+            || r.vertCount % 6 != 0) {
+            problem = "corrupt mesh";
+            break;
+        }
+        for (uint32_t k = 0; k < r.indexCount; ++k) {
+            if (indices[r.firstIndex + k] >= r.vertCount / 6) {
+                problem = "corrupt mesh";
+                break;
+            }
+        }
+    }
+    if (problem) {
+        fprintf(stderr, "scene: %s: %s\n", path, problem);
+        unmapFile(base, size);
+        return false;
+    }
+
+    auto load = [&](SceneSectionId id, auto &array) {
+        using T = typename std::remove_reference<decltype(array)>::type::value_type;
+        const T *first = (const T *) section(id);
+        array.assign(first, first + table[id].count);
+    };
+    load(SCENE_BUILDINGS, buildings);
+    load(SCENE_TREES, trees);
+    load(SCENE_SIDEWALKS, sidewalks);
+    walkEndZ = header->walkEndZ;
+
+    const SceneRoad *roadRecords = (const SceneRoad *) section(SCENE_ROADS);
+    roads.clear();
+    for (uint64_t i = 0; i < table[SCENE_ROADS].count; ++i) {
+        const SceneRoad &r = roadRecords[i];
+        roads.push_back({ r.x0, r.z0, r.x1, r.z1, r.alongZ != 0 });
+    }
+    const SceneCar *carRecords = (const SceneCar *) section(SCENE_CARS);
+    cars.assign(table[SCENE_CARS].count, Car());
+    for (size_t i = 0; i < cars.size(); ++i) {
+        const SceneCar &r = carRecords[i];
+        Car &c = cars[i];
+        c.laneX = r.laneX; c.z = r.z; c.speed = r.speed;
+        c.r = r.r; c.g = r.g; c.b = r.b;
+        c.wheelRotation = r.wheelRotation;
+        c.cruise = r.cruise;
+        c.carType = r.carType;
+    }
+    const SceneHuman *humanRecords = (const SceneHuman *) section(SCENE_HUMANS);
+    humans.assign(table[SCENE_HUMANS].count, Human());
+    for (size_t i = 0; i < humans.size(); ++i) {
+        const SceneHuman &r = humanRecords[i];
+        Human &h = humans[i];
+        h.x = r.x; h.z = r.z; h.dir = r.dir; h.speed = r.speed; h.phase = r.phase;
+        h.walk = r.walk;
+    }
+
+    grassPatches.clear();
+    const SceneGrass *grass = (const SceneGrass *) section(SCENE_GRASS);
+    for (uint64_t i = 0; i < table[SCENE_GRASS].count; ++i) {
+        GrassPatch p;
+        p.x = grass[i].x; p.z = grass[i].z; p.w = grass[i].w; p.d = grass[i].d;
+        p.seed = grass[i].seed;
+        grassPatches.push_back(p);
+        generateGrassBlades(grassPatches.back());
+    }
+
+    // Baked meshes go into the pool first, so initMeshLibrary finds them
+    // instead of tessellating
+    for (uint64_t i = 0; i < table[SCENE_MESHES].count; ++i) {
+        const SceneMesh &r = meshRecords[i];
+        if (meshIndex.count(r.key)) continue;
+        Mesh m;
+        m.verts.assign(verts + r.firstVert, verts + r.firstVert + r.vertCount);
+        m.indices.assign(indices + r.firstIndex, indices + r.firstIndex + r.indexCount);
+        addMesh(r.key, m);
+    }
+    unmapFile(base, size);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "scene: %s: %zu buildings, %zu trees, %zu cars, %zu humans in %.1f ms\n",
+            path, buildings.size(), trees.size(), cars.size(), humans.size(), ms);
+    return true;
+}
+
+// -------------------------- Static geometry cache --------------------------
+// Nothing in the ground layer or the structures ever moves, so they are
+// compiled into display lists once and replayed every frame. The lists take
+// their materials from the weather palette's lists, so weather changes
+// recolour them without recompiling.
+//
+// Buildings and trees are bucketed into a uniform XZ grid with one display
+// list per cell, which doubles as the spatial index for frustum culling.
+// A cell's lists are compiled once it comes into view, so startup does not
+// grow with the size of the city. The first frame compiles everything it
+// sees; after that cells are compiled nearest first until --cell-budget
+// milliseconds have gone into it that frame (at least one cell per frame),
+// so a camera turn over a large city is spread over several frames. Cells
+// still waiting are not drawn. Cars and humans are re-bucketed into the same
+// grid every frame.
+const float GRID_CELL_SIZE = 32.0f;
+const float SHADOW_MARGIN = 4.0f;   // room for the offset ground shadows
+double cellBudgetMs = 2.0;          // --cell-budget
+
+struct GridCell {
+    AABB staticBounds = EMPTY_AABB;     // buildings, trees and their shadows
+    AABB bounds = EMPTY_AABB;           // staticBounds plus this frame's actors
+    AABB treeBounds = EMPTY_AABB;
+    std::vector<int> buildingIds;
+    std::vector<int> treeIds;
+    GLuint list = 0;                    // buildings
+    GLuint treeLists = 0;               // LOD_LEVELS consecutive lists of trees
+    int treeLod = 0;
+    bool compiled = false;              // lists match the cell's contents
+    bool treesOccluded = false;         // cell in view but its trees hidden
+    CullResult cull = CULL_OUTSIDE;
+};
+
+struct SceneGrid {
+    float originX = 0.0f, originZ = 0.0f;
+    int nx = 0, nz = 0;
+    std::vector<GridCell> cells;
+
+    // Per-frame actor buckets (counting sort into cell order)
+    std::vector<int> carStart, carItems;
+    std::vector<int> humanStart, humanItems;
+
+    int cellIndex(float x, float z) const {
+        int ix = (int) floorf((x - originX) / GRID_CELL_SIZE);
+        int iz = (int) floorf((z - originZ) / GRID_CELL_SIZE);
+        ix = std::max(0, std::min(nx - 1, ix));
+        iz = std::max(0, std::min(nz - 1, iz));
+        return iz * nx + ix;
+    }
+};
+SceneGrid sceneGrid;
+
+GLuint groundList = 0;
+bool staticSceneValid = false;      // grid and lists match buildings/trees
+bool staticListsValid = false;      // lists match buildings, trees and LOD meshes
+bool cellBudgetWaived = false;      // first frame after the lists were reset
+
+AABB buildingBounds(const Building &b) {
+    // Roof overhang, window frames and the door stick out slightly
+    return { b.x - b.w*0.51f - 0.3f, 0.0f, b.z - b.d*0.51f - 0.3f,
+             b.x + b.w*0.51f + 0.3f, b.h + 0.45f, b.z + b.d*0.51f + 0.3f };
+}
+
+AABB treeBounds(const Tree &t) {
+    return { t.x - 0.9f*t.scale, 0.0f, t.z - 0.9f*t.scale,
+             t.x + 0.9f*t.scale, 1.6f + 2.4f*t.scale, t.z + 0.9f*t.scale };
+}
+
+AABB carBounds(const Car &c) {
+    return { c.laneX - 1.0f, 0.0f, c.z - 1.7f, c.laneX + 1.0f, 1.6f, c.z + 2.0f };
+}
+
+AABB humanBounds(const Human &h) {
+    return { h.x - 0.4f, 0.0f, h.z - 0.4f, h.x + 0.4f, 1.75f, h.z + 0.4f };
+}
+
+void buildSceneGrid() {
+    SceneGrid &g = sceneGrid;
+    AABB world = EMPTY_AABB;
+    for (const Road &r : roads) world.expand({ r.x0, 0.0f, r.z0, r.x1, 0.0f, r.z1 });
+    for (const Building &b : buildings) world.expand(buildingBounds(b));
+    for (const Tree &t : trees) world.expand(treeBounds(t));
+
+    for (GridCell &c : g.cells) {
+        if (c.list) glDeleteLists(c.list, 1);
+        if (c.treeLists) glDeleteLists(c.treeLists, LOD_LEVELS);
+    }
+    g.originX = world.minX;
+    g.originZ = world.minZ;
+    g.nx = std::max(1, (int) ceilf((world.maxX - world.minX) / GRID_CELL_SIZE));
+    g.nz = std::max(1, (int) ceilf((world.maxZ - world.minZ) / GRID_CELL_SIZE));
+    g.cells.assign((size_t) g.nx * g.nz, GridCell());
+
+    for (int i = 0; i < (int) buildings.size(); ++i) {
+        GridCell &c = g.cells[g.cellIndex(buildings[i].x, buildings[i].z)];
+        AABB box = buildingBounds(buildings[i]);
+        c.buildingIds.push_back(i);
+        c.staticBounds.expand(box);
+        box.minX -= SHADOW_MARGIN; box.minZ -= SHADOW_MARGIN;
+        box.maxX += SHADOW_MARGIN; box.maxZ += SHADOW_MARGIN;
+        c.staticBounds.expand(box);
+    }
+    for (int i = 0; i < (int) trees.size(); ++i) {
+        GridCell &c = g.cells[g.cellIndex(trees[i].x, trees[i].z)];
+        c.treeIds.push_back(i);
+        c.staticBounds.expand(treeBounds(trees[i]));
+        c.treeBounds.expand(treeBounds(trees[i]));
+    }
+    g.carStart.assign(g.cells.size() + 1, 0);
+    g.humanStart.assign(g.cells.size() + 1, 0);
+}
+
+// Buildings (with windows and doors) of one cell
+void drawCellBuildings(const GridCell &cell) {
+    WindowBatch wb;
+    buildWindowBatch(wb, cell.buildingIds);
+
+    for (int id : cell.buildingIds) {
+        drawBuildingWithDetails(buildings[id]);
+    }
+    drawWindowBatch(wb);
+}
+
+void drawCellTrees(const GridCell &cell, int lod) {
+    for (int id : cell.treeIds) {
+        const Tree &t = trees[id];
+        drawTree(t.x, t.z, t.scale, lod);
+    }
+}
+
+void buildStaticScene() {
+    if (!staticSceneValid) {
+        buildSceneGrid();
+        staticSceneValid = true;
+    }
+    if (groundList == 0) groundList = glGenLists(1);
+
+    glNewList(groundList, GL_COMPILE);
+      drawGroundLayer();
+    glEndList();
+
+    for (GridCell &cell : sceneGrid.cells) cell.compiled = false;
+    cellBudgetWaived = true;
+    staticListsValid = true;
+}
+
+void compileCell(GridCell &cell) {
+    if (!cell.buildingIds.empty()) {
+        if (cell.list == 0) cell.list = glGenLists(1);
+        glNewList(cell.list, GL_COMPILE);
+          drawCellBuildings(cell);
+        glEndList();
+    }
+    if (!cell.treeIds.empty()) {
+        if (cell.treeLists == 0) cell.treeLists = glGenLists(LOD_LEVELS);
+        for (int lod = 0; lod < LOD_LEVELS; ++lod) {
+            glNewList(cell.treeLists + lod, GL_COMPILE);
+              drawCellTrees(cell, lod);
+            glEndList();
+        }
+    }
+    cell.compiled = true;
+    frameStats.cellsCompiled++;
+}
+
+// After cullScene(): compile the cells in view within the frame's budget
+void compileVisibleCells() {
+    SceneGrid &g = sceneGrid;
+    bool waived = cellBudgetWaived;
+    cellBudgetWaived = false;
+    std::vector<int> pending;
+    for (int i = 0; i < (int) g.cells.size(); ++i)
+        if (g.cells[i].cull != CULL_OUTSIDE && !g.cells[i].compiled) pending.push_back(i);
+    if (pending.empty()) return;
+
+    auto distance2 = [&](int i) {
+        float dx = g.originX + (i % g.nx + 0.5f) * GRID_CELL_SIZE - camEye[0];
+        float dz = g.originZ + (i / g.nx + 0.5f) * GRID_CELL_SIZE - camEye[2];
+        return dx*dx + dz*dz;
+    };
+    std::sort(pending.begin(), pending.end(), [&](int a, int b) { return distance2(a) < distance2(b); });
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < pending.size(); ++n) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (n > 0 && ms >= cellBudgetMs && !waived) break;
+        compileCell(g.cells[pending[n]]);
+    }
+}
+
+// Call after editing buildings or trees so the grid and lists pick up the change
+void invalidateStaticScene() {
+    staticSceneValid = false;
+    staticListsValid = false;
+}
+
+// Bucket a set of actors into grid cells with a counting sort
+template <typename T, typename BoundsFn>
+void bucketActors(const std::vector<T> &actors, std::vector<int> &start,
+                  std::vector<int> &items, BoundsFn bounds) {
+    SceneGrid &g = sceneGrid;
+    std::vector<int> cellOf(actors.size());
+    std::fill(start.begin(), start.end(), 0);
+    for (size_t i = 0; i < actors.size(); ++i) {
+        AABB box = bounds(actors[i]);
+        int c = g.cellIndex((box.minX + box.maxX) * 0.5f, (box.minZ + box.maxZ) * 0.5f);
+        cellOf[i] = c;
+        start[c + 1]++;
+        g.cells[c].bounds.expand(box);
+    }
+    for (size_t c = 0; c < g.cells.size(); ++c) start[c + 1] += start[c];
+    items.resize(actors.size());
+    std::vector<int> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < actors.size(); ++i) items[fill[cellOf[i]]++] = (int) i;
+}
+
+// Re-bucket the actors and classify every cell against the view frustum
+void cullScene() {
+    SceneGrid &g = sceneGrid;
+    for (GridCell &c : g.cells) c.bounds = c.staticBounds;
+    bucketActors(cars, g.carStart, g.carItems, carBounds);
+    bucketActors(humans, g.humanStart, g.humanItems, humanBounds);
+
+    for (GridCell &c : g.cells) {
+        c.cull = (c.bounds.minX > c.bounds.maxX) ? CULL_OUTSIDE : viewFrustum.classify(c.bounds);
+        int statics = (int) (c.buildingIds.size() + c.treeIds.size());
+        if (statics == 0 && c.bounds.minX > c.bounds.maxX) continue;
+        if (c.cull == CULL_OUTSIDE) {
+            frameStats.cellsCulled++;
+            frameStats.buildingsCulled += (int) c.buildingIds.size();
+            frameStats.treesCulled += (int) c.treeIds.size();
+        } else {
+            frameStats.cellsVisible++;
+            frameStats.buildingsDrawn += (int) c.buildingIds.size();
+            frameStats.treesDrawn += (int) c.treeIds.size();
+        }
+    }
+}
+
+// -------------------------- Occlusion culling --------------------------
+// After frustum culling, the buildings nearest the eye in visible cells are
+// rasterized as solid boxes into a small CPU depth buffer, four pixels at a
+// time with SSE2, and that buffer is reduced into a max-depth pyramid. Cells,
+// their trees and each car and human are then tested against the pyramid:
+// anything whose nearest depth lies behind every texel its screen rectangle
+// touches is skipped. Occluders are just the building bodies, without roof
+// overhang, windows or door, so they never cover more than the drawn building.
+const int OCCLUSION_W = 256, OCCLUSION_H = 144;     // width a multiple of 4
+const int OCCLUSION_LEVELS = 6;                     // down to 8x5 texels
+const int OCCLUSION_MAX_OCCLUDERS = 512;            // nearest buildings drawn
+const float OCCLUSION_MIN_W = 0.1f;                 // the near plane, in clip w
+
+struct OcclusionBuffer {
+    bool enabled = true;            // 'o', --occlusion off
+    bool valid = false;             // built this frame
+    Mat4 clip;                      // projection * view
+    std::vector<float> levels[OCCLUSION_LEVELS];   // NDC depth: level 0 nearest, others max
+    int w[OCCLUSION_LEVELS], h[OCCLUSION_LEVELS];
+    std::vector<std::pair<float, int>> candidates;  // squared distance, building
+};
+OcclusionBuffer occlusion;
+
+struct OccluderVertex {
+    float x, y, z;      // occlusion-buffer pixels, NDC depth
+};
+
+// False if the point is behind the near plane
+bool projectOccluder(const Mat4 &clip, float x, float y, float z, OccluderVertex &v) {
+    const float *m = clip.m;
+    float cx = m[0]*x + m[4]*y + m[8]*z + m[12];
+    float cy = m[1]*x + m[5]*y + m[9]*z + m[13];
+    float cz = m[2]*x + m[6]*y + m[10]*z + m[14];
+    float cw = m[3]*x + m[7]*y + m[11]*z + m[15];
+    if (cw < OCCLUSION_MIN_W) return false;
+    float inv = 1.0f / cw;
+    v.x = (cx * inv * 0.5f + 0.5f) * OCCLUSION_W;
+    v.y = (cy * inv * 0.5f + 0.5f) * OCCLUSION_H;
+    v.z = cz * inv;
+    return true;
+}
+
+// Rasterize one building body. A pixel is written only if the box's outline
+// (the convex hull of its projected corners) covers all of it, and then with
+// the farthest depth the body has inside the pixel: where a ray enters a
+// convex solid is the farthest of its front-facing planes, and each plane is
+// pushed back by its slope over half a pixel. So the buffer never claims
+// more coverage, or nearer depth, than the building has. Skipped if a corner
+// is behind the near plane.
+void rasterizeBuilding(float *depth, const Building &b) {
+    // Corner i has x max if bit 0, y max if bit 1, z max if bit 2; faces wind
+    // counter-clockwise seen from outside
+    static const int faces[6][3] = {
+        { 5, 1, 3 }, { 0, 4, 6 }, { 2, 6, 7 }, { 0, 1, 5 }, { 4, 5, 7 }, { 1, 0, 2 }
+    };
+    OccluderVertex c[8];
+    for (int i = 0; i < 8; ++i) {
+        float x = b.x + ((i & 1) ? 0.5f : -0.5f) * b.w;
+        float y = (i & 2) ? b.h : 0.0f;
+        float z = b.z + ((i & 4) ? 0.5f : -0.5f) * b.d;
+        if (!projectOccluder(occlusion.clip, x, y, z, c[i])) return;
+    }
+
+    // Outline: convex hull of the corners, counter-clockwise (monotone chain)
+    OccluderVertex sorted[8], hull[16];
+    std::copy(c, c + 8, sorted);
+    std::sort(sorted, sorted + 8, [](const OccluderVertex &p, const OccluderVertex &q) {
+        return p.x < q.x || (p.x == q.x && p.y < q.y);
+    });
+    auto cross = [](const OccluderVertex &o, const OccluderVertex &p, const OccluderVertex &q) {
+        return (p.x - o.x) * (q.y - o.y) - (p.y - o.y) * (q.x - o.x);
+    };
+    int n = 0;
+    for (int i = 0; i < 8; ++i) {
+        while (n >= 2 && cross(hull[n - 2], hull[n - 1], sorted[i]) <= 0.0f) n--;
+        hull[n++] = sorted[i];
+    }
+    for (int i = 6, lower = n + 1; i >= 0; --i) {
+        while (n >= lower && cross(hull[n - 2], hull[n - 1], sorted[i]) <= 0.0f) n--;
+        hull[n++] = sorted[i];
+    }
+    int edges = n - 1;
+    if (edges < 3) return;
+
+    // Edge functions e = a*px + b*py + c, shrunk so that e >= 0 holds for
+    // the whole pixel around the sample
+    float ea[8], eb[8], ec[8];
+    for (int i = 0; i < edges; ++i) {
+        const OccluderVertex &p = hull[i], &q = hull[i + 1];
+        ea[i] = -(q.y - p.y);
+        eb[i] = q.x - p.x;
+        ec[i] = -(ea[i] * p.x + eb[i] * p.y) - 0.5f * (fabsf(ea[i]) + fabsf(eb[i]));
+    }
+    // Depth planes z = a*px + b*py + c of the front faces, at their farthest in the pixel
+    float za[3], zb[3], zc[3];
+    int planes = 0;
+    for (const int *f : faces) {
+        const OccluderVertex &v0 = c[f[0]], &v1 = c[f[1]], &v2 = c[f[2]];
+        float area = cross(v0, v1, v2);
+        if (area <= 1e-3f || planes == 3) continue;
+        za[planes] = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+        zb[planes] = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+        zc[planes] = v0.z - za[planes] * v0.x - zb[planes] * v0.y
+                     + 0.5f * (fabsf(za[planes]) + fabsf(zb[planes]));
+        planes++;
+    }
+    if (planes == 0) return;
+
+    float minX = hull[0].x, maxX = hull[0].x, minY = hull[0].y, maxY = hull[0].y;
+    for (int i = 1; i < edges; ++i) {
+        minX = std::min(minX, hull[i].x); maxX = std::max(maxX, hull[i].x);
+        minY = std::min(minY, hull[i].y); maxY = std::max(maxY, hull[i].y);
+    }
+    int x0 = std::max(0, (int) floorf(minX)) & ~3, x1 = std::min(OCCLUSION_W - 1, (int) floorf(maxX));
+    int y0 = std::max(0, (int) floorf(minY)), y1 = std::min(OCCLUSION_H - 1, (int) floorf(maxY));
+
+    for (int y = y0; y <= y1; ++y) {
+        float py = y + 0.5f;
+        float *row = depth + y * OCCLUSION_W;
+        int x = x0;
+#ifdef CITY_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        __m128 va[8], vr[8], vza[3], vzr[3];
+        for (int i = 0; i < edges; ++i) {
+            va[i] = _mm_set1_ps(ea[i]);
+            vr[i] = _mm_set1_ps(eb[i] * py + ec[i]);
+        }
+        for (int i = 0; i < planes; ++i) {
+            vza[i] = _mm_set1_ps(za[i]);
+            vzr[i] = _mm_set1_ps(zb[i] * py + zc[i]);
+        }
+        for (; x <= x1; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float) x), step);
+            __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(va[0], px), vr[0]), zero);
+            for (int i = 1; i < edges; ++i)
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(va[i], px), vr[i]), zero));
+            if (!_mm_movemask_ps(inside)) continue;
+            __m128 z = _mm_add_ps(_mm_mul_ps(vza[0], px), vzr[0]);
+            for (int i = 1; i < planes; ++i) z = _mm_max_ps(z, _mm_add_ps(_mm_mul_ps(vza[i], px), vzr[i]));
+            __m128 old = _mm_load_ps(row + x);
+            _mm_store_ps(row + x, select4(inside, _mm_min_ps(old, z), old));
+        }
+#endif
+        for (; x <= x1; ++x) {
+            float px = x + 0.5f;
+            bool inside = true;
+            for (int i = 0; i < edges && inside; ++i) inside = ea[i]*px + eb[i]*py + ec[i] >= 0.0f;
+            if (!inside) continue;
+            float z = za[0]*px + zb[0]*py + zc[0];
+            for (int i = 1; i < planes; ++i) z = std::max(z, za[i]*px + zb[i]*py + zc[i]);
+            row[x] = std::min(row[x], z);
+        }
+    }
+}
+
+void buildOcclusionBuffer() {
+    OcclusionBuffer &o = occlusion;
+    o.valid = false;
+    if (!o.enabled) return;
+    o.clip = mat4Mul(projMatrix, viewMatrix);
+
+    o.candidates.clear();
+    for (const GridCell &cell : sceneGrid.cells) {
+        if (cell.cull == CULL_OUTSIDE) continue;
+        for (int id : cell.buildingIds) {
+            float dx = buildings[id].x - camEye[0], dz = buildings[id].z - camEye[2];
+            o.candidates.push_back({ dx*dx + dz*dz, id });
+        }
+    }
+    if (o.candidates.size() > (size_t) OCCLUSION_MAX_OCCLUDERS) {
+        std::nth_element(o.candidates.begin(), o.candidates.begin() + OCCLUSION_MAX_OCCLUDERS,
+                         o.candidates.end());
+        o.candidates.resize(OCCLUSION_MAX_OCCLUDERS);
+    }
+
+    for (int l = 0; l < OCCLUSION_LEVELS; ++l) {
+        o.w[l] = l ? (o.w[l - 1] + 1) / 2 : OCCLUSION_W;
+        o.h[l] = l ? (o.h[l - 1] + 1) / 2 : OCCLUSION_H;
+        o.levels[l].resize((size_t) o.w[l] * o.h[l]);
+    }
+    std::vector<float> &depth = o.levels[0];
+    std::fill(depth.begin(), depth.end(), 1.0f);
+    for (const auto &c : o.candidates) rasterizeBuilding(depth.data(), buildings[c.second]);
+
+    // Each texel above level 0 holds the farthest depth of the ones below it
+    for (int l = 1; l < OCCLUSION_LEVELS; ++l) {
+        const std::vector<float> &src = o.levels[l - 1];
+        int sw = o.w[l - 1], sh = o.h[l - 1];
+        for (int y = 0; y < o.h[l]; ++y) {
+            int y0 = 2 * y, y1 = std::min(2 * y + 1, sh - 1);
+            for (int x = 0; x < o.w[l]; ++x) {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, sw - 1);
+                o.levels[l][y * o.w[l] + x] = std::max(std::max(src[y0 * sw + x0], src[y0 * sw + x1]),
+                                                       std::max(src[y1 * sw + x0], src[y1 * sw + x1]));
+            }
+        }
+    }
+    o.valid = true;
+}
+
+// True if the box is certainly hidden behind this frame's occluders
+bool occluded(const AABB &box) {
+    const OcclusionBuffer &o = occlusion;
+    if (!o.valid) return false;
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearZ = 1e30f;
+    for (int i = 0; i < 8; ++i) {
+        OccluderVertex v;
+        if (!projectOccluder(o.clip, (i & 1) ? box.maxX : box.minX, (i & 2) ? box.maxY : box.minY,
+                             (i & 4) ? box.maxZ : box.minZ, v)) return false;
+        minX = std::min(minX, v.x); maxX = std::max(maxX, v.x);
+        minY = std::min(minY, v.y); maxY = std::max(maxY, v.y);
+        nearZ = std::min(nearZ, v.z);
+    }
+    int x0 = std::max(0, (int) floorf(minX)), x1 = std::min(OCCLUSION_W - 1, (int) floorf(maxX));
+    int y0 = std::max(0, (int) floorf(minY)), y1 = std::min(OCCLUSION_H - 1, (int) floorf(maxY));
+    if (x0 > x1 || y0 > y1) return false;
+
+    // Coarsest level where the rectangle spans at most 4x4 texels
+    int l = 0;
+    while (l + 1 < OCCLUSION_LEVELS && ((x1 >> l) - (x0 >> l) > 3 || (y1 >> l) - (y0 >> l) > 3)) l++;
+    const std::vector<float> &level = o.levels[l];
+    for (int y = y0 >> l; y <= y1 >> l; ++y)
+        for (int x = x0 >> l; x <= x1 >> l; ++x)
+            if (level[y * o.w[l] + x] >= nearZ) return false;
+    return true;
+}
+
+// Drop the visible cells (or just their trees) that the occluders hide
+void occlusionCullScene() {
+    for (GridCell &c : sceneGrid.cells) c.treesOccluded = false;
+    buildOcclusionBuffer();
+    if (!occlusion.valid) return;
+    for (GridCell &c : sceneGrid.cells) {
+        if (c.cull == CULL_OUTSIDE) continue;
+        if (occluded(c.bounds)) {
+            c.cull = CULL_OUTSIDE;
+            frameStats.cellsOccluded++;
+            frameStats.cellsVisible--;                  frameStats.cellsCulled++;
+            frameStats.buildingsDrawn -= (int) c.buildingIds.size();
+            frameStats.buildingsCulled += (int) c.buildingIds.size();
+            frameStats.treesDrawn -= (int) c.treeIds.size();
+            frameStats.treesCulled += (int) c.treeIds.size();
+        } else if (!c.treeIds.empty() && occluded(c.treeBounds)) {
+            c.treesOccluded = true;
+            frameStats.treesDrawn -= (int) c.treeIds.size();
+            frameStats.treesCulled += (int) c.treeIds.size();
+        }
+    }
+}
+
+bool actorVisible(const GridCell &cell, const AABB &box) {
+    if (cell.cull == CULL_OUTSIDE) return false;
+    if (cell.cull != CULL_INSIDE && !viewFrustum.visible(box)) return false;
+    return !occluded(box);
+}
+
+// -------------------------- World streaming --------------------------
+// --stream R surrounds the world built at startup with an endless grid of
+// city blocks. The plane is cut into tiles one block pitch across (a block
+// plus the streets along its west and south edges), lined up with the --city
+// street grid so the streamed blocks carry it on; tiles whose block would
+// overlap the startup world stay empty. A worker thread generates the tiles
+// within R tiles of the camera target, nearest first, and bakes their window
+// geometry; the render thread compiles finished tiles into display lists
+// until --stream-budget milliseconds have gone into it that frame. Tiles the
+// target has moved away from stay resident until their estimated size passes
+// --stream-cap megabytes, and are then evicted least recently wanted first.
+// Streamed tiles have no cars or humans and are not occluders, but they are
+// culled against the frustum and the occlusion pyramid and cast shadows.
+const float STREAM_VERTEX_BYTES = 24.0f;    // GL_N3F_V3F, for the display list size estimate
+
+enum TileState { TILE_QUEUED, TILE_READY, TILE_RESIDENT };
+
+struct StreamTile {
+    int tx = 0, tz = 0;
+    TileState state = TILE_QUEUED;
+    std::vector<Building> buildings;
+    std::vector<Tree> trees;
+    std::vector<Road> roads;
+    std::vector<GroundRect> sidewalks;
+    WindowBatch windows;                // baked by the worker, dropped once compiled
+    GroundRect area = {};               // footprint
+    AABB bounds = EMPTY_AABB;           // ground, buildings and trees
+    AABB treeBounds = EMPTY_AABB;
+    GLuint groundList = 0, list = 0;
+    GLuint treeLists = 0;               // LOD_LEVELS consecutive lists, like a grid cell
+    int treeLod = 0;
+    size_t bytes = 0;                   // estimated, once resident
+    long lastWanted = 0;                // last stream frame it was within the radius
+    CullResult cull = CULL_OUTSIDE;
+    bool treesOccluded = false;
+};
+
+typedef std::pair<int, int> TileKey;
+
+struct WorldStream {
+    bool enabled = false;
+    int radius = 8;                     // --stream, in tiles
+    double capMB = 256.0;               // --stream-cap
+    double budgetMs = 2.0;              // --stream-budget
+
+    // Set before the worker starts; it reads nothing else
+    CityConfig cfg;
+    float pitch = 0.0f, originX = 0.0f, originZ = 0.0f, halfDiag = 0.0f;
+    AABB reserved = EMPTY_AABB;         // the startup world
+
+    // Render thread only
+    std::map<TileKey, std::unique_ptr<StreamTile>> tiles;
+    std::vector<TileKey> ready;         // generated, waiting to be compiled
+    int centerX = 0, centerZ = 0;
+    bool centered = false;
+    long frame = 0;
+    size_t residentBytes = 0, peakBytes = 0;
+    int generated = 0, compiled = 0, evicted = 0;
+    bool overCapReported = false;
+    AABB dirty = EMPTY_AABB;            // tiles compiled or evicted since the last shadow update
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<TileKey> requests;       // nearest first
+    std::deque<std::unique_ptr<StreamTile>> finished;
+    bool stopping = false;
+};
+WorldStream worldStream;
+
+uint32_t tileSeed(uint32_t seed, int tx, int tz) {
+    uint32_t h = seed ^ 0x9E3779B9u;
+    h = (h ^ (uint32_t) tx) * 0x85EBCA6Bu;
+    h = (h ^ (uint32_t) tz) * 0xC2B2AE35u;
+    return h ^ (h >> 16);
+}
+
+// A tile stays empty when its block would overlap the startup world
+bool tileReserved(int tx, int tz) {
+    const WorldStream &ws = worldStream;
+    float bx0 = ws.originX + tx * ws.pitch + ws.cfg.streetWidth, bx1 = ws.originX + (tx + 1) * ws.pitch;
+    float bz0 = ws.originZ + tz * ws.pitch + ws.cfg.streetWidth, bz1 = ws.originZ + (tz + 1) * ws.pitch;
+    const AABB &r = ws.reserved;
+    return bx0 < r.maxX && bx1 > r.minX && bz0 < r.maxZ && bz1 > r.minZ;
+}
+
+// Worker side: the streets and block of one tile, and their windows
+void generateTile(StreamTile &t) {
+    const WorldStream &ws = worldStream;
+    const CityConfig &cfg = ws.cfg;
+    float x0 = ws.originX + t.tx * ws.pitch, z0 = ws.originZ + t.tz * ws.pitch;
+    float x1 = x0 + ws.pitch, z1 = z0 + ws.pitch;
+    t.area = { x0, z0, x1, z1 };
+    t.roads.push_back({ x0, z0, x0 + cfg.streetWidth, z1, true });
+    t.roads.push_back({ x0, z0, x1, z0 + cfg.streetWidth, false });
+    Rng rng(tileSeed(cfg.seed, t.tx, t.tz));
+    generateBlock(cfg, rng, x0 + cfg.streetWidth, z0 + cfg.streetWidth, ws.halfDiag,
+                  t.buildings, t.trees, t.sidewalks);
+
+    t.bounds = { x0, 0.0f, z0, x1, 0.0f, z1 };
+    for (const Building &b : t.buildings) {
+        t.bounds.expand(buildingBounds(b));
+        appendBuildingWindows(t.windows, b);
+    }
+    for (const Tree &tree : t.trees) {
+        t.bounds.expand(treeBounds(tree));
+        t.treeBounds.expand(treeBounds(tree));
+    }
+}
+
+void streamWorkerLoop() {
+    WorldStream &ws = worldStream;
+    for (;;) {
+        TileKey key;
+        {
+            std::unique_lock<std::mutex> lock(ws.mutex);
+            ws.wake.wait(lock, [&] { return ws.stopping || !ws.requests.empty(); });
+            if (ws.stopping) return;
+            key = ws.requests.front();
+            ws.requests.pop_front();
+        }
+        std::unique_ptr<StreamTile> t(new StreamTile());
+        t->tx = key.first;
+        t->tz = key.second;
+        generateTile(*t);
+        std::lock_guard<std::mutex> lock(ws.mutex);
+        ws.finished.push_back(std::move(t));
+    }
+}
+
+void streamStop() {
+    WorldStream &ws = worldStream;
+    if (!ws.worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(ws.mutex);
+        ws.stopping = true;
+    }
+    ws.wake.notify_one();
+    ws.worker.join();
+    fprintf(stderr, "stream: %d tiles generated, %d compiled, %d evicted, peak %.1f MB resident\n",
+            ws.generated, ws.compiled, ws.evicted, ws.peakBytes / (1024.0 * 1024.0));
+}
+
+// Once the startup world exists: line the tile grid up with its streets
+void streamStart() {
+    WorldStream &ws = worldStream;
+    if (!ws.enabled) return;
+    ws.cfg = cityConfig;
+    const CityConfig &cfg = ws.cfg;
+    ws.pitch = cfg.blockSize + cfg.streetWidth;
+    float spanX = cfg.blocksX * ws.pitch + cfg.streetWidth;
+    float spanZ = cfg.blocksZ * ws.pitch + cfg.streetWidth;
+    ws.halfDiag = 0.5f * sqrtf(spanX*spanX + spanZ*spanZ);
+    if (cfg.enabled) {
+        ws.originX = -spanX * 0.5f;
+        ws.originZ = -spanZ * 0.5f;
+    } else {
+        // A north-south street centred on the hand-placed one
+        ws.originX = ws.originZ = -cfg.streetWidth * 0.5f;
+    }
+
+    AABB &r = ws.reserved;
+    r = EMPTY_AABB;
+    for (const Road &road : roads) r.expand({ road.x0, 0.0f, road.z0, road.x1, 0.0f, road.z1 });
+    for (const GroundRect &s : sidewalks) r.expand({ s.x0, 0.0f, s.z0, s.x1, 0.0f, s.z1 });
+    for (const GrassPatch &p : grassPatches)
+        r.expand({ p.x - p.w/2, 0.0f, p.z - p.d/2, p.x + p.w/2, 0.0f, p.z + p.d/2 });
+    for (const Building &b : buildings) r.expand(buildingBounds(b));
+    for (const Tree &t : trees) r.expand(treeBounds(t));
+
+    static bool registered = false;
+    if (!registered) atexit(streamStop);    // Esc exits from inside the GLUT loop
+    registered = true;
+    ws.stopping = false;
+    ws.worker = std::thread(streamWorkerLoop);
+}
+
+void releaseTile(StreamTile &t) {
+    WorldStream &ws = worldStream;
+    if (t.groundList) glDeleteLists(t.groundList, 1);
+    if (t.list) glDeleteLists(t.list, 1);
+    if (t.treeLists) glDeleteLists(t.treeLists, LOD_LEVELS);
+    ws.residentBytes -= t.bytes;
+    ws.dirty.expand(t.bounds);
+}
+
+size_t listBytes(GLuint list) {
+    const std::vector<GlCallCounts> &costs = glAccounting.listCosts;
+    return list < costs.size() ? (size_t) (costs[list].vertices * STREAM_VERTEX_BYTES) : 0;
+}
+
+void compileTile(StreamTile &t) {
+    WorldStream &ws = worldStream;
+    t.groundList = glGenLists(1);
+    glNewList(t.groundList, GL_COMPILE);
+      emitStreetLayer(t.area, t.roads, t.sidewalks);
+      vertexStream.flush();
+    glEndList();
+    if (!t.buildings.empty()) {
+        t.list = glGenLists(1);
+        glNewList(t.list, GL_COMPILE);
+          for (const Building &b : t.buildings) drawBuildingWithDetails(b);
+          drawWindowBatch(t.windows);
+        glEndList();
+    }
+    size_t bytes = listBytes(t.groundList) + listBytes(t.list);
+    if (!t.trees.empty()) {
+        t.treeLists = glGenLists(LOD_LEVELS);
+        for (int lod = 0; lod < LOD_LEVELS; ++lod) {
+            glNewList(t.treeLists + lod, GL_COMPILE);
+              for (const Tree &tree : t.trees) drawTree(tree.x, tree.z, tree.scale, lod);
+            glEndList();
+            bytes += listBytes(t.treeLists + lod);
+        }
+    }
+    t.windows = WindowBatch();      // the list keeps its own copy
+    t.bytes = bytes + sizeof(StreamTile) + t.buildings.capacity() * sizeof(Building)
+            + t.trees.capacity() * sizeof(Tree) + t.roads.capacity() * sizeof(Road)
+            + t.sidewalks.capacity() * sizeof(GroundRect);
+    t.state = TILE_RESIDENT;
+    ws.residentBytes += t.bytes;
+    ws.peakBytes = std::max(ws.peakBytes, ws.residentBytes);
+    ws.dirty.expand(t.bounds);
+    ws.compiled++;
+    frameStats.tilesCompiled++;
+}
+
+// Once per frame: queue the tiles around the target, compile what the worker
+// finished within the time budget and evict down to the memory cap
+void updateStreaming() {
+    WorldStream &ws = worldStream;
+    if (!ws.enabled) return;
+    ws.frame++;
+    int cx = (int) floorf((targetX - ws.originX) / ws.pitch);
+    int cz = (int) floorf((targetZ - ws.originZ) / ws.pitch);
+    auto distance2 = [&](const TileKey &k) {
+        return (k.first - cx) * (k.first - cx) + (k.second - cz) * (k.second - cz);
+    };
+
+    std::vector<TileKey> missing;
+    int r = ws.radius;
+    for (int dz = -r; dz <= r; ++dz) {
+        for (int dx = -r; dx <= r; ++dx) {
+            if (dx*dx + dz*dz > r*r || tileReserved(cx + dx, cz + dz)) continue;
+            TileKey key(cx + dx, cz + dz);
+            auto it = ws.tiles.find(key);
+            if (it != ws.tiles.end()) it->second->lastWanted = ws.frame;
+            else missing.push_back(key);
+        }
+    }
+
+    bool moved = !ws.centered || cx != ws.centerX || cz != ws.centerZ;
+    ws.centerX = cx;
+    ws.centerZ = cz;
+    ws.centered = true;
+    if (moved || !missing.empty()) {
+        // Requests the target has moved away from are dropped before the
+        // worker starts on them; the rest are re-sorted around the new centre
+        std::vector<TileKey> queue;
+        std::lock_guard<std::mutex> lock(ws.mutex);
+        for (const TileKey &k : ws.requests) {
+            if (ws.tiles[k]->lastWanted == ws.frame) queue.push_back(k);
+            else ws.tiles.erase(k);
+        }
+        for (const TileKey &k : missing) {
+            StreamTile *t = new StreamTile();
+            t->tx = k.first;
+            t->tz = k.second;
+            t->lastWanted = ws.frame;
+            ws.tiles[k].reset(t);
+            queue.push_back(k);
+        }
+        std::sort(queue.begin(), queue.end(),
+                  [&](const TileKey &a, const TileKey &b) { return distance2(a) < distance2(b); });
+        ws.requests.assign(queue.begin(), queue.end());
+        ws.wake.notify_one();
+    }
+
+    std::deque<std::unique_ptr<StreamTile>> done;
+    {
+        std::lock_guard<std::mutex> lock(ws.mutex);
+        done.swap(ws.finished);
+    }
+    for (std::unique_ptr<StreamTile> &t : done) {
+        TileKey key(t->tx, t->tz);
+        std::unique_ptr<StreamTile> &slot = ws.tiles[key];
+        t->lastWanted = slot ? slot->lastWanted : 0;
+        t->state = TILE_READY;
+        slot = std::move(t);
+        ws.ready.push_back(key);
+        ws.generated++;
+    }
+
+    // Nearest first; at least one per frame so streaming always progresses
+    std::sort(ws.ready.begin(), ws.ready.end(),
+              [&](const TileKey &a, const TileKey &b) { return distance2(a) < distance2(b); });
+    auto start = std::chrono::steady_clock::now();
+    size_t n = 0;
+    for (; n < ws.ready.size(); ++n) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (n > 0 && ms >= ws.budgetMs) break;
+        auto it = ws.tiles.find(ws.ready[n]);
+        if (it->second->lastWanted != ws.frame) ws.tiles.erase(it);     // left behind before it got here
+        else compileTile(*it->second);
+    }
+    ws.ready.erase(ws.ready.begin(), ws.ready.begin() + n);
+
+    // Least recently wanted first; tiles inside the radius are never evicted
+    size_t cap = (size_t) (ws.capMB * 1024.0 * 1024.0);
+    while (ws.residentBytes > cap) {
+        auto oldest = ws.tiles.end();
+        for (auto it = ws.tiles.begin(); it != ws.tiles.end(); ++it) {
+            const StreamTile &t = *it->second;
+            if (t.state != TILE_RESIDENT || t.lastWanted == ws.frame) continue;
+            if (oldest == ws.tiles.end() || t.lastWanted < oldest->second->lastWanted) oldest = it;
+        }
+        if (oldest == ws.tiles.end()) {
+            if (!ws.overCapReported)
+                fprintf(stderr, "stream: tiles within the radius need %.1f MB, more than --stream-cap %.1f\n",
+                        ws.residentBytes / (1024.0 * 1024.0), ws.capMB);
+            ws.overCapReported = true;
+            break;
+        }
+        releaseTile(*oldest->second);
+        ws.tiles.erase(oldest);
+        ws.evicted++;
+    }
+}
+
+// Frustum and occlusion test for every resident tile
+void cullStreamedTiles() {
+    for (auto &e : worldStream.tiles) {
+        StreamTile &t = *e.second;
+        t.cull = CULL_OUTSIDE;
+        t.treesOccluded = false;
+        if (t.state != TILE_RESIDENT) continue;
+        CullResult cull = viewFrustum.classify(t.bounds);
+        if (cull == CULL_OUTSIDE) continue;
+        if (occluded(t.bounds)) {
+            frameStats.tilesOccluded++;
+            continue;
+        }
+        t.cull = cull;
+        t.treesOccluded = !t.trees.empty() && occluded(t.treeBounds);
+        frameStats.tilesVisible++;
+    }
+}
+
+void drawStreamedGround() {
+    for (const auto &e : worldStream.tiles) {
+        const StreamTile &t = *e.second;
+        if (t.cull == CULL_OUTSIDE) continue;
+        glCallList(t.groundList);
+        frameStats.listCalls++;
+    }
+}
+
+void drawStreamedBuildings() {
+    for (const auto &e : worldStream.tiles) {
+        const StreamTile &t = *e.second;
+        if (t.cull == CULL_OUTSIDE || !t.list) continue;
+        glCallList(t.list);
+        frameStats.listCalls++;
+    }
+}
+
+void drawStreamedTrees() {
+    for (auto &e : worldStream.tiles) {
+        StreamTile &t = *e.second;
+        if (t.cull == CULL_OUTSIDE || t.treesOccluded || !t.treeLists) continue;
+        const AABB &tb = t.treeBounds;
+        float cx = fmaxf(tb.minX, fminf(camEye[0], tb.maxX));
+        float cz = fmaxf(tb.minZ, fminf(camEye[2], tb.maxZ));
+        t.treeLod = selectLod(t.treeLod, distanceToEye(cx, camEye[1], cz), TREE_LOD);
+        glCallList(t.treeLists + t.treeLod);
+        frameStats.listCalls++;
+        frameStats.lodCounts[t.treeLod] += (int) t.trees.size();
+    }
+}
+
+// -------------------------- Shadow map --------------------------
+// Ground shadows live in a top-down texture covering SHADOW_EXTENT metres
+// around the camera target. Buildings and trees are projected onto the ground
+// along the sun direction and rendered into `staticTex`, which is only redone
+// when the sun has moved SHADOW_SUN_STEP degrees, the target has left the
+// middle of the covered area, or the city changed. `tex` is the static
+// texture plus the cars and humans near the target; it is split into
+// SHADOW_BLOCKS x SHADOW_BLOCKS blocks, and each frame only the blocks that
+// held actor shadows last frame or hold them now are restored from the static
+// texture and redrawn. One textured quad then darkens the ground under all of
+// them, fading out over SHADOW_FADE metres towards the edge of the covered
+// area. Nothing is drawn or updated while heavy rain hides the sun.
+//
+// Without framebuffer objects the same projected polygons are blended
+// straight onto the ground every frame instead.
+const int SHADOW_MAP_SIZE = 2048;
+const float SHADOW_EXTENT = 256.0f;     // metres covered by the texture
+const float SHADOW_SUN_STEP = 1.5f;     // degrees of sun travel per re-render
+const float SHADOW_MAX_SLOPE = 3.0f;    // longest shadow per metre of height
+const float SHADOW_Y = 0.005f;          // just above the sidewalks
+const int SHADOW_BLOCKS = 16;           // actor refresh blocks per side
+const float SHADOW_FADE = 24.0f;        // metres over which the edge fades out
+
+struct ShadowMap {
+    GLuint staticTex = 0, tex = 0;
+    GLuint staticFbo = 0, fbo = 0;
+    bool supported = false;
+    bool staticValid = false;
+    bool dynamicValid = false;          // `tex` holds this frame's actors
+    bool texStale = true;               // `tex` predates the static texture
+    std::vector<unsigned char> actorBlocks; // blocks of `tex` holding actor shadows
+    std::vector<AABB> actorBoxes;       // this frame's actors near the covered area
+    float sunAngle = 0.0f;              // sun the static texture was made for
+    float slopeX = 0.0f, slopeZ = 0.0f; // ground offset per metre of height
+    float x0 = 0.0f, z0 = 0.0f;         // covered area, SHADOW_EXTENT square
+    bool ground = false;                // emit on the ground rather than in map space
+};
+ShadowMap shadowMap;
+
+bool shadowsVisible() {
+    return rainIntensity <= 0.7f;
+}
+
+// Shadows fade out as the rain comes in
+float shadowStrength() {
+    return 0.3f * (1.0f - rainIntensity);
+}
+
+void shadowVertex(float x, float z) {
+    if (shadowMap.ground) vertexStream.vertex(x, SHADOW_Y, z);
+    else vertexStream.vertex(x, z, 0.0f);
+}
+
+// Shadow of an upright box: its footprint, its roof moved along the sun
+// direction, and the four quads sweeping each footprint edge to the roof
+void emitBoxShadow(float x0, float z0, float x1, float z1, float h) {
+    float ox = shadowMap.slopeX * h, oz = shadowMap.slopeZ * h;
+    float xs[4] = { x0, x1, x1, x0 };
+    float zs[4] = { z0, z0, z1, z1 };
+    for (int k = 0; k < 4; ++k) shadowVertex(xs[k], zs[k]);
+    for (int k = 0; k < 4; ++k) shadowVertex(xs[k] + ox, zs[k] + oz);
+    for (int k = 0; k < 4; ++k) {
+        int n = (k + 1) & 3;
+        shadowVertex(xs[k], zs[k]);
+        shadowVertex(xs[n], zs[n]);
+        shadowVertex(xs[n] + ox, zs[n] + oz);
+        shadowVertex(xs[k] + ox, zs[k] + oz);
+    }
+}
+
+// Trunk as a thin box and the canopy as an octagon where its centre lands
+void emitTreeShadow(const Tree &t) {
+    emitBoxShadow(t.x - 0.12f, t.z - 0.12f, t.x + 0.12f, t.z + 0.12f, 1.2f);
+    float h = 1.0f + 1.4f * t.scale, r = 0.9f * t.scale;
+    float cx = t.x + shadowMap.slopeX * h, cz = t.z + shadowMap.slopeZ * h;
+    float px[8], pz[8];
+    for (int k = 0; k < 8; ++k) {
+        float a = k * (float) M_PI / 4.0f;
+        px[k] = cx + r * cosf(a);
+        pz[k] = cz + r * sinf(a);
+    }
+    static const int quads[3][4] = { { 0, 1, 2, 3 }, { 0, 3, 4, 7 }, { 4, 5, 6, 7 } };
+    for (const auto &q : quads) {
+        for (int k : q) shadowVertex(px[k], pz[k]);
+    }
+}
+
+// Ground area the contents of `b` can darken with the current sun
+AABB shadowBounds(AABB b) {
+    float ox = shadowMap.slopeX * b.maxY, oz = shadowMap.slopeZ * b.maxY;
+    b.minX += fminf(ox, 0.0f); b.maxX += fmaxf(ox, 0.0f);
+    b.minZ += fminf(oz, 0.0f); b.maxZ += fmaxf(oz, 0.0f);
+    return b;
+}
+
+bool overlapsShadowArea(const AABB &b) {
+    const ShadowMap &sm = shadowMap;
+    return b.maxX >= sm.x0 && b.minX <= sm.x0 + SHADOW_EXTENT
+        && b.maxZ >= sm.z0 && b.minZ <= sm.z0 + SHADOW_EXTENT;
+}
+
+void emitStaticShadows(const GridCell &cell) {
+    for (int id : cell.buildingIds) {
+        const Building &b = buildings[id];
+        emitBoxShadow(b.x - b.w*0.5f, b.z - b.d*0.5f, b.x + b.w*0.5f, b.z + b.d*0.5f, b.h);
+    }
+    for (int id : cell.treeIds) emitTreeShadow(trees[id]);
+}
+
+void emitTileShadows(const StreamTile &t) {
+    for (const Building &b : t.buildings)
+        emitBoxShadow(b.x - b.w*0.5f, b.z - b.d*0.5f, b.x + b.w*0.5f, b.z + b.d*0.5f, b.h);
+    for (const Tree &tree : t.trees) emitTreeShadow(tree);
+}
+
+// Boxes standing in for the cars and humans bucketed into `c` by cullScene()
+void collectActorBoxes(size_t c, std::vector<AABB> &out) {
+    const SceneGrid &g = sceneGrid;
+    for (int k = g.carStart[c]; k < g.carStart[c + 1]; ++k) {
+        Car car = interpolatedCar(cars[g.carItems[k]]);
+        out.push_back({ car.laneX - 0.85f, 0.0f, car.z - 1.6f, car.laneX + 0.85f, 1.3f, car.z + 1.9f });
+    }
+    for (int k = g.humanStart[c]; k < g.humanStart[c + 1]; ++k) {
+        Human h = interpolatedHuman(humans[g.humanItems[k]]);
+        out.push_back({ h.x - 0.22f, 0.0f, h.z - 0.15f, h.x + 0.22f, 1.75f, h.z + 0.15f });
+    }
+}
+
+void emitActorShadows(const std::vector<AABB> &boxes) {
+    for (const AABB &b : boxes) emitBoxShadow(b.minX, b.minZ, b.maxX, b.maxZ, b.maxY);
+}
+
+// Mark the blocks of the covered area that `b` reaches
+void markShadowBlocks(const AABB &b, std::vector<unsigned char> &blocks) {
+    const ShadowMap &sm = shadowMap;
+    if (!overlapsShadowArea(b)) return;
+    float size = SHADOW_EXTENT / SHADOW_BLOCKS;
+    int bx0 = std::max(0, (int) floorf((b.minX - sm.x0) / size));
+    int bz0 = std::max(0, (int) floorf((b.minZ - sm.z0) / size));
+    int bx1 = std::min(SHADOW_BLOCKS - 1, (int) floorf((b.maxX - sm.x0) / size));
+    int bz1 = std::min(SHADOW_BLOCKS - 1, (int) floorf((b.maxZ - sm.z0) / size));
+    for (int bz = bz0; bz <= bz1; ++bz)
+        for (int bx = bx0; bx <= bx1; ++bx) blocks[bz * SHADOW_BLOCKS + bx] = 1;
+}
+
+void createShadowTarget(GLuint &tex, GLuint &fbo) {
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+}
+
+void initShadowMap() {
+    ShadowMap &sm = shadowMap;
+    if (sm.tex || !hasFramebufferObjects()) return;
+    GLint prevFbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    createShadowTarget(sm.staticTex, sm.staticFbo);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    createShadowTarget(sm.tex, sm.fbo);
+    complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+    sm.supported = complete;
+    if (!complete) fprintf(stderr, "shadows: shadow map framebuffer incomplete, drawing them directly\n");
+}
+
+// Projection for the sun at (sunX, sunY, sunZ), treated as a directional light
+void setShadowSlope(float sunX, float sunY, float sunZ) {
+    ShadowMap &sm = shadowMap;
+    float y = fmaxf(sunY, 1.0f);
+    sm.slopeX = -sunX / y;
+    sm.slopeZ = -sunZ / y;
+    float len = sqrtf(sm.slopeX*sm.slopeX + sm.slopeZ*sm.slopeZ);
+    if (len > SHADOW_MAX_SLOPE) {
+        sm.slopeX *= SHADOW_MAX_SLOPE / len;
+        sm.slopeZ *= SHADOW_MAX_SLOPE / len;
+    }
+}
+
+// Render target and transform for drawing shadow polygons in map space
+void beginShadowPass(GLuint fbo) {
+    const ShadowMap &sm = shadowMap;
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glPushAttrib(GL_VIEWPORT_BIT | GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glDisable(GL_DEPTH_TEST);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(sm.x0, sm.x0 + SHADOW_EXTENT, sm.z0, sm.z0 + SHADOW_EXTENT, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+}
+
+void endShadowPass() {
+    vertexStream.flush();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glPopAttrib();
+}
+
+// Refresh the cached static layer if needed and composite this frame's actors
+void updateShadowMap(float sunX, float sunY, float sunZ) {
+    ShadowMap &sm = shadowMap;
+    sm.dynamicValid = false;
+    // Streamed tiles that came or went under the covered area, at the longest shadow
+    AABB &dirty = worldStream.dirty;
+    if (dirty.minX <= dirty.maxX) {
+        float shadow = SHADOW_MAX_SLOPE * dirty.maxY;
+        dirty.minX -= shadow; dirty.minZ -= shadow;
+        dirty.maxX += shadow; dirty.maxZ += shadow;
+        if (overlapsShadowArea(dirty)) sm.staticValid = false;
+        dirty = EMPTY_AABB;
+    }
+    if (!shadowsVisible()) return;
+    initShadowMap();
+    if (!sm.supported) {
+        setShadowSlope(sunX, sunY, sunZ);
+        return;
+    }
+    const SceneGrid &g = sceneGrid;
+    sm.ground = false;
+
+    GLint prevFbo = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+
+    float cx = sm.x0 + SHADOW_EXTENT * 0.5f, cz = sm.z0 + SHADOW_EXTENT * 0.5f;
+    bool moved = fabsf(targetX - cx) > SHADOW_EXTENT * 0.25f
+              || fabsf(targetZ - cz) > SHADOW_EXTENT * 0.25f;
+    if (!sm.staticValid || moved || fabsf(sunAngle - sm.sunAngle) >= SHADOW_SUN_STEP) {
+        // Snap to whole texels so static shadows don't crawl when re-centred
+        float texel = SHADOW_EXTENT / SHADOW_MAP_SIZE;
+        sm.x0 = floorf((targetX - SHADOW_EXTENT * 0.5f) / texel) * texel;
+        sm.z0 = floorf((targetZ - SHADOW_EXTENT * 0.5f) / texel) * texel;
+        sm.sunAngle = sunAngle;
+        setShadowSlope(sunX, sunY, sunZ);
+
+        beginShadowPass(sm.staticFbo);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        vertexStream.begin(GL_QUADS, 1.0f, 1.0f, 1.0f);
+        for (const GridCell &cell : g.cells) {
+            if (cell.buildingIds.empty() && cell.treeIds.empty()) continue;
+            if (overlapsShadowArea(shadowBounds(cell.staticBounds))) emitStaticShadows(cell);
+        }
+        for (const auto &e : worldStream.tiles) {
+            const StreamTile &t = *e.second;
+            if (t.state == TILE_RESIDENT && overlapsShadowArea(shadowBounds(t.bounds))) emitTileShadows(t);
+        }
+        endShadowPass();
+        sm.staticValid = true;
+        sm.texStale = true;
+        frameStats.shadowRenders++;
+    }
+
+    // Actors close enough to throw a shadow into the covered area
+    float reach = 2.0f * SHADOW_MAX_SLOPE + 4.0f;
+    AABB area = { sm.x0 - reach, 0.0f, sm.z0 - reach,
+                  sm.x0 + SHADOW_EXTENT + reach, 0.0f, sm.z0 + SHADOW_EXTENT + reach };
+    int ix0 = std::max(0, (int) floorf((area.minX - g.originX) / GRID_CELL_SIZE));
+    int iz0 = std::max(0, (int) floorf((area.minZ - g.originZ) / GRID_CELL_SIZE));
+    int ix1 = std::min(g.nx - 1, (int) floorf((area.maxX - g.originX) / GRID_CELL_SIZE));
+    int iz1 = std::min(g.nz - 1, (int) floorf((area.maxZ - g.originZ) / GRID_CELL_SIZE));
+    std::vector<AABB> &boxes = sm.actorBoxes;
+    boxes.clear();
+    for (int iz = iz0; iz <= iz1; ++iz) {
+        for (int ix = ix0; ix <= ix1; ++ix) collectActorBoxes((size_t) iz * g.nx + ix, boxes);
+    }
+    std::vector<unsigned char> touched(SHADOW_BLOCKS * SHADOW_BLOCKS, 0);
+    bool anyActors = false;
+    for (const AABB &b : boxes) {
+        AABB shadow = shadowBounds(b);
+        if (!overlapsShadowArea(shadow)) continue;
+        markShadowBlocks(shadow, touched);
+        anyActors = true;
+    }
+
+    // Without actors the static texture is drawn directly and `tex` is left
+    // alone; the blocks it still has actors in are restored next time
+    if (anyActors) {
+        if (sm.texStale) sm.actorBlocks.assign(touched.size(), 1);
+        int block = SHADOW_MAP_SIZE / SHADOW_BLOCKS;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, sm.staticFbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, sm.fbo);
+        auto refresh = [&](int bx, int bz) {
+            int i = bz * SHADOW_BLOCKS + bx;
+            return touched[i] || sm.actorBlocks[i];
+        };
+        for (int bz = 0; bz < SHADOW_BLOCKS; ++bz) {
+            // One blit per run of blocks to refresh in this row
+            for (int bx = 0; bx < SHADOW_BLOCKS; ) {
+                if (!refresh(bx, bz)) { ++bx; continue; }
+                int start = bx;
+                while (bx < SHADOW_BLOCKS && refresh(bx, bz)) ++bx;
+                glBlitFramebuffer(start * block, bz * block, bx * block, (bz + 1) * block,
+                                  start * block, bz * block, bx * block, (bz + 1) * block,
+                                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+                frameStats.shadowBlocks += bx - start;
+            }
+        }
+        beginShadowPass(sm.fbo);
+        vertexStream.begin(GL_QUADS, 1.0f, 1.0f, 1.0f);
+        emitActorShadows(boxes);
+        endShadowPass();
+        sm.actorBlocks.swap(touched);
+        sm.texStale = false;
+        sm.dynamicValid = true;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+}
+
+// Darken the ground under everything updateShadowMap() rendered
+void drawShadows() {
+    ShadowMap &sm = shadowMap;
+    if (!shadowsVisible()) return;
+    VertexStream &vs = vertexStream;
+    float alpha = shadowStrength();
+
+    if (!sm.supported) {
+        // Blend the projected polygons of the visible cells straight onto the ground
+        sm.ground = true;
+        vs.begin(GL_QUADS, 0.0f, 0.0f, 0.0f, alpha, true);
+        for (size_t c = 0; c < sceneGrid.cells.size(); ++c) {
+            const GridCell &cell = sceneGrid.cells[c];
+            if (cell.cull == CULL_OUTSIDE) continue;
+            emitStaticShadows(cell);
+            sm.actorBoxes.clear();
+            collectActorBoxes(c, sm.actorBoxes);
+            emitActorShadows(sm.actorBoxes);
+        }
+        for (const auto &e : worldStream.tiles)
+            if (e.second->cull != CULL_OUTSIDE) emitTileShadows(*e.second);
+        glDepthMask(GL_FALSE);
+        vs.flush();
+        glDepthMask(GL_TRUE);
+        return;
+    }
+
+    // The covered area as a 3x3 patch whose outer ring fades to nothing, so the
+    // shadows don't stop at a hard line; texture coordinates from object-linear texgen
+    GLfloat planeS[4] = { 1.0f / SHADOW_EXTENT, 0.0f, 0.0f, -sm.x0 / SHADOW_EXTENT };
+    GLfloat planeT[4] = { 0.0f, 0.0f, 1.0f / SHADOW_EXTENT, -sm.z0 / SHADOW_EXTENT };
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_TEXTURE_BIT | GL_DEPTH_BUFFER_BIT);
+    glBindTexture(GL_TEXTURE_2D, sm.dynamicValid ? sm.tex : sm.staticTex);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+    glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+    glTexGenfv(GL_S, GL_OBJECT_PLANE, planeS);
+    glTexGenfv(GL_T, GL_OBJECT_PLANE, planeT);
+    glEnable(GL_TEXTURE_GEN_S);
+    glEnable(GL_TEXTURE_GEN_T);
+    glDepthMask(GL_FALSE);
+    glDisable(GL_LIGHTING);
+    glEnable(GL_BLEND);
+
+    const float edge[4] = { 0.0f, SHADOW_FADE, SHADOW_EXTENT - SHADOW_FADE, SHADOW_EXTENT };
+    GLfloat verts[9 * 4 * 3], colors[9 * 4 * 4];
+    int n = 0;
+    for (int j = 0; j < 3; ++j) {
+        for (int i = 0; i < 3; ++i) {
+            const int corner[4][2] = { { i, j }, { i, j + 1 }, { i + 1, j + 1 }, { i + 1, j } };
+            for (const auto &c : corner) {
+                bool rim = c[0] == 0 || c[0] == 3 || c[1] == 0 || c[1] == 3;
+                GLfloat *v = verts + n * 3, *col = colors + n * 4;
+                v[0] = sm.x0 + edge[c[0]]; v[1] = SHADOW_Y; v[2] = sm.z0 + edge[c[1]];
+                col[0] = col[1] = col[2] = 0.0f;
+                col[3] = rim ? 0.0f : alpha;
+                n++;
+            }
+        }
+    }
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, verts);
+    glColorPointer(4, GL_FLOAT, 0, colors);
+    frameStats.drawCalls++;
+    glDrawArrays(GL_QUADS, 0, n);
+    glPopClientAttrib();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPopAttrib();
+}
+
+void drawScene(float currentSunX, float currentSunY, float currentSunZ) {
+    if (!staticSceneValid) shadowMap.staticValid = false;
+    if (!staticSceneValid || !staticListsValid) {
+        PROFILE_GPU_SCOPE("static rebuild");
+        buildStaticScene();
+    }
+    {
+        PROFILE_GPU_SCOPE("streaming");
+        updateStreaming();
+    }
+    {
+        PROFILE_SCOPE("cull");
+        cullScene();
+    }
+    {
+        PROFILE_SCOPE("occlusion");
+        occlusionCullScene();
+        cullStreamedTiles();
+    }
+    {
+        PROFILE_GPU_SCOPE("compile cells");
+        compileVisibleCells();
+    }
+    const SceneGrid &g = sceneGrid;
+    {
+        PROFILE_GPU_SCOPE("shadow map");
+        updateShadowMap(currentSunX, currentSunY, currentSunZ);
+    }
+
+    // Ground, road, markings and sidewalks
+    {
+        PROFILE_GPU_SCOPE("ground");
+        glCallList(groundList);
+        frameStats.listCalls++;
+        drawStreamedGround();
+    }
+
+    // Grass blades
+    {
+        PROFILE_GPU_SCOPE("grass");
+        for (GrassPatch &p : grassPatches) {
+            AABB box = { p.x - p.w/2, 0.0f, p.z - p.d/2, p.x + p.w/2, 0.5f, p.z + p.d/2 };
+            if (viewFrustum.visible(box)) drawGrassBlades(p);
+        }
+    }
+
+    // Shadows of buildings, trees, cars and humans
+    {
+        PROFILE_GPU_SCOPE("shadows");
+        drawShadows();
+    }
+
+    // Buildings
+    {
+        PROFILE_GPU_SCOPE("buildings");
+        for (const GridCell &cell : g.cells) {
+            if (cell.cull == CULL_OUTSIDE || !cell.list) continue;
+            glCallList(cell.list);
+            frameStats.listCalls++;
+        }
+        drawStreamedBuildings();
+    }
+
+    // Trees at the level of detail of their cell
+    {
+        PROFILE_GPU_SCOPE("trees");
+        for (GridCell &cell : sceneGrid.cells) {
+            if (cell.cull == CULL_OUTSIDE || cell.treesOccluded || !cell.treeLists) continue;
+            const AABB &tb = cell.treeBounds;
+            float cx = fmaxf(tb.minX, fminf(camEye[0], tb.maxX));
+            float cz = fmaxf(tb.minZ, fminf(camEye[2], tb.maxZ));
+            cell.treeLod = selectLod(cell.treeLod, distanceToEye(cx, camEye[1], cz), TREE_LOD);
+            glCallList(cell.treeLists + cell.treeLod);
+            frameStats.listCalls++;
+            frameStats.lodCounts[cell.treeLod] += (int) cell.treeIds.size();
+        }
+        drawStreamedTrees();
+    }
+
+    // Cars and humans go through the material-sorted render queue, one flush
+    // each so that they can be timed apart
+    {
+        PROFILE_GPU_SCOPE("cars");
+        bool instanced = carInstancing.ready;
+        if (!instanced) renderQueue.begin();
+        for (size_t c = 0; c < g.cells.size(); ++c) {
+            const GridCell &cell = g.cells[c];
+            for (int k = g.carStart[c]; k < g.carStart[c + 1]; ++k) {
+                Car &car = cars[g.carItems[k]];
+                if (actorVisible(cell, carBounds(car))) {
+                    car.lod = selectLod(car.lod, distanceToEye(car.laneX, 0.5f, car.z), CAR_LOD);
+                    if (instanced) addCarInstance(interpolatedCar(car));
+                    else drawCarModel(interpolatedCar(car));
+                    frameStats.carsDrawn++;
+                    frameStats.lodCounts[car.lod]++;
+                } else {
+                    frameStats.carsCulled++;
+                }
+            }
+        }
+        if (instanced) drawCarInstances();
+        else renderQueue.flush();
+    }
+    {
+        PROFILE_GPU_SCOPE("humans");
+        renderQueue.begin();
+        for (size_t c = 0; c < g.cells.size(); ++c) {
+            const GridCell &cell = g.cells[c];
+            for (int k = g.humanStart[c]; k < g.humanStart[c + 1]; ++k) {
+                Human &h = humans[g.humanItems[k]];
+                if (actorVisible(cell, humanBounds(h))) {
+                    h.lod = selectLod(h.lod, distanceToEye(h.x, 0.9f, h.z), HUMAN_LOD);
+                    drawHuman(interpolatedHuman(h));
+                    frameStats.humansDrawn++;
+                    frameStats.lodCounts[h.lod]++;
+                } else {
+                    frameStats.humansCulled++;
+                }
+            }
+        }
+        renderQueue.flush();
+    }
+
+    // Draw rain
+    {
+        PROFILE_GPU_SCOPE("rain");
+        drawRain();
     }
 }
 
-void drawSunAndRays(float& sunX_out, float& sunY_out, float& sunZ_out) {
-    float rad = sunAngle * M_PI / 180.0f;
-    float sx = SUN_RADIUS * cosf(rad);
-    float sy = SUN_RADIUS * sinf(rad) + 6.0f;
-    float sz = -10.0f;
+// -------------------------- Frame capture --------------------------
+// --capture PATTERN (or 'c') writes every displayed frame to a numbered PPM
+// or PNG file, e.g. clips/city_%05d.png. glReadPixels goes into a ring of
+// pixel buffer objects and each one is mapped a frame later, once the
+// driver has finished the copy, so the render thread never waits for it.
+// The mapped pixels go straight to a writer thread, which flips, encodes
+// and writes them; a slot is unmapped and reused once the writer is done
+// with it, which throttles rendering only if the disk can't keep up.
+// captureStop() flushes the ring and needs the GL context, so it runs from
+// quit() and at the end of a benchmark rather than from atexit().
+const int CAPTURE_RING = 4;
+
+enum CaptureSlotState { SLOT_FREE, SLOT_READING, SLOT_WRITING, SLOT_WRITTEN };
+
+struct CaptureSlot {
+    GLuint pbo = 0;
+    std::vector<unsigned char> pixels;  // without PBOs: read into here directly
+    const unsigned char *data = nullptr; // mapped PBO or pixels, while writing
+    int frame = 0;
+    CaptureSlotState state = SLOT_FREE;
+};
 
-    sunX_out = sx;
-    sunY_out = sy;
-    sunZ_out = sz;
+struct FrameCapture {
+    char pattern[1024] = "city_%05d.ppm";   // printf pattern with one integer conversion
+    bool enabled = false;               // --capture or 'c'
+    bool active = false;                // ring and writer thread set up
+    bool png = false;
+    int width = 0, height = 0;
+    int frame = 0;                      // next frame number
+    int written = 0;
+    std::atomic<bool> failed{false};    // stop trying after a write error
+    int reading = -1;                   // slot with a readback in flight
+    int next = 0;                       // slot the next readback goes to
+
+    CaptureSlot slots[CAPTURE_RING];
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::deque<int> queue;              // slots for the writer, in frame order
+    bool stopping = false;
+};
+FrameCapture capture;
+
+// PNG needs CRC-32 per chunk and Adler-32 over the zlib stream; the image
+// data goes into stored (uncompressed) deflate blocks, so no zlib is needed
+uint32_t crc32Update(uint32_t crc, const unsigned char *p, size_t n) {
+    static uint32_t table[256];
+    static bool init = false;
+    if (!init) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        init = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
 
-    GLfloat sunPos[] = { sx, sy, sz, 1.0f };
-    glLightfv(GL_LIGHT0, GL_POSITION, sunPos);
+void putBigEndian(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
 
-    // Set weather-based lighting
-    setWeatherLighting(sx, sy, sz);
+void writePngChunk(FILE *f, const char *type, const unsigned char *data, size_t n) {
+    unsigned char head[8];
+    putBigEndian(head, (uint32_t) n);
+    memcpy(head + 4, type, 4);
+    uint32_t crc = crc32Update(crc32Update(0, head + 4, 4), data, n);
+    unsigned char tail[4];
+    putBigEndian(tail, crc);
+    fwrite(head, 1, 8, f);
+    if (n) fwrite(data, 1, n, f);
+    fwrite(tail, 1, 4, f);
+}
 
-    // Draw sun (only visible during sunny weather)
-    if (currentWeather == SUNNY || rainIntensity < 0.5f) {
-        glPushMatrix();
-          glTranslatef(sx, sy, sz);
-          glDisable(GL_LIGHTING);
-          glColor3f(1.0f, 0.9f, 0.5f);
-          glutSolidSphere(1.3f, 24, 20);
-          glEnable(GL_LIGHTING);
-          GLfloat old_em[4];
-          glGetMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, old_em);
-          GLfloat emis[4] = {0.6f,0.5f,0.3f,1.0f};
-          glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emis);
-          glutSolidSphere(0.9f, 20, 16);
-          glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, old_em);
-        glPopMatrix();
+// rgb: top-down rows of 3 bytes per pixel
+bool writePng(FILE *f, const unsigned char *rgb, int w, int h) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    fwrite(signature, 1, 8, f);
+    unsigned char ihdr[13] = {};
+    putBigEndian(ihdr, w);
+    putBigEndian(ihdr + 4, h);
+    ihdr[8] = 8;        // bit depth
+    ihdr[9] = 2;        // truecolour
+    writePngChunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+    // Rows with a leading filter byte (none), cut into stored blocks
+    size_t row = (size_t) w * 3, rawSize = (row + 1) * h;
+    std::vector<unsigned char> raw(rawSize);
+    for (int y = 0; y < h; ++y) {
+        raw[y * (row + 1)] = 0;
+        memcpy(&raw[y * (row + 1) + 1], rgb + y * row, row);
+    }
+    uint32_t a = 1, b = 0;
+    for (size_t pos = 0; pos < rawSize; ) {
+        size_t n = std::min<size_t>(5552, rawSize - pos);     // keeps b below 2^32
+        for (size_t end = pos + n; pos < end; ++pos) {
+            a += raw[pos];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    std::vector<unsigned char> z;
+    z.reserve(rawSize + rawSize / 65535 * 5 + 16);
+    z.push_back(0x78); z.push_back(0x01);
+    for (size_t pos = 0; pos < rawSize; ) {
+        size_t n = std::min<size_t>(65535, rawSize - pos);
+        unsigned char block[5] = { (unsigned char) (pos + n == rawSize), (unsigned char) (n & 0xFF),
+                                   (unsigned char) (n >> 8), (unsigned char) (~n & 0xFF),
+                                   (unsigned char) ((~n >> 8) & 0xFF) };
+        z.insert(z.end(), block, block + 5);
+        z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + n);
+        pos += n;
     }
+    unsigned char adler[4];
+    putBigEndian(adler, (b << 16) | a);
+    z.insert(z.end(), adler, adler + 4);
+    writePngChunk(f, "IDAT", z.data(), z.size());
+    writePngChunk(f, "IEND", nullptr, 0);
+    return !ferror(f);
 }
 
-void drawScene(float currentSunX, float currentSunY, float currentSunZ) {
-    // Ground
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.16f, 0.55f, 0.2f, 2.0f);
-    } else {
-        setMaterialRGB(0.12f, 0.45f, 0.16f, 1.0f);
+// Writer thread: bottom-up RGBA from GL to a top-down RGB file
+void captureWriterLoop() {
+    FrameCapture &c = capture;
+    std::vector<unsigned char> rgb;
+    char path[1024];
+    for (;;) {
+        int s;
+        {
+            std::unique_lock<std::mutex> lock(c.mutex);
+            c.wake.wait(lock, [&] { return c.stopping || !c.queue.empty(); });
+            if (c.queue.empty()) return;
+            s = c.queue.front();
+            c.queue.pop_front();
+        }
+        CaptureSlot &slot = c.slots[s];
+        int w = c.width, h = c.height;
+        rgb.resize((size_t) w * h * 3);
+        for (int y = 0; y < h; ++y) {
+            const unsigned char *src = slot.data + (size_t) (h - 1 - y) * w * 4;
+            unsigned char *dst = &rgb[(size_t) y * w * 3];
+            for (int x = 0; x < w; ++x, src += 4, dst += 3) {
+                dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+            }
+        }
+        snprintf(path, sizeof(path), c.pattern, slot.frame);
+        bool ok = false;
+        if (!c.failed) {
+            FILE *f = fopen(path, "wb");
+            if (f) {
+                if (c.png) {
+                    ok = writePng(f, rgb.data(), w, h);
+                } else {
+                    fprintf(f, "P6\n%d %d\n255\n", w, h);
+                    ok = fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+                }
+                ok = fclose(f) == 0 && ok;
+            }
+            if (!ok) fprintf(stderr, "capture: cannot write %s, capture stopped\n", path);
+        }
+        {
+            std::lock_guard<std::mutex> lock(c.mutex);
+            if (ok) c.written++;
+            else c.failed = true;
+            slot.state = SLOT_WRITTEN;
+        }
+        c.done.notify_all();
     }
+}
 
-    glBegin(GL_QUADS);
-      glNormal3f(0,1,0);
-      glVertex3f(-200.0f, 0.0f, -200.0f);
-      glVertex3f( 200.0f, 0.0f, -200.0f);
-      glVertex3f( 200.0f, 0.0f,  200.0f);
-      glVertex3f(-200.0f, 0.0f,  200.0f);
-    glEnd();
-
-    // Road - darker when wet
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.08f, 0.08f, 0.08f, 5.0f);
+// Give the slot whose readback was issued last frame to the writer
+void captureHandOff(int s) {
+    FrameCapture &c = capture;
+    CaptureSlot &slot = c.slots[s];
+    if (slot.pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        slot.data = (const unsigned char *) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     } else {
-        setMaterialRGB(0.05f, 0.05f, 0.06f, 3.0f);
+        slot.data = slot.pixels.data();
     }
-
-    glBegin(GL_QUADS);
-      glNormal3f(0,1,0);
-      glVertex3f(-3.5f, 0.001f, -120.0f);
-      glVertex3f( 3.5f, 0.001f, -120.0f);
-      glVertex3f( 3.5f, 0.001f,  120.0f);
-      glVertex3f(-3.5f, 0.001f,  120.0f);
-    glEnd();
-
-    // Road markings
-    glDisable(GL_LIGHTING);
-    glLineWidth(3.0f);
-    glColor3f(1.0f, 0.9f, 0.0f);
-    glBegin(GL_LINES);
-      for (float z=-120.0f; z<120.0f; z+=8.0f) {
-        glVertex3f(0.0f, 0.002f, z);
-        glVertex3f(0.0f, 0.002f, z+4.0f);
-      }
-    glEnd();
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glBegin(GL_LINES);
-      for (float z=-120.0f; z<120.0f; z+=15.0f) {
-        glVertex3f(-0.6f, 0.002f, z);
-        glVertex3f(-0.6f, 0.002f, z+7.0f);
-      }
-      for (float z=-120.0f; z<120.0f; z+=15.0f) {
-        glVertex3f(0.6f, 0.002f, z);
-        glVertex3f(0.6f, 0.002f, z+7.0f);
-      }
-    glEnd();
-    glEnable(GL_LIGHTING);
-
-    // Sidewalks
-    if (currentWeather == SUNNY) {
-        setMaterialRGB(0.5f,0.5f,0.5f, 2.0f);
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (slot.data) {
+        slot.state = SLOT_WRITING;
+        c.queue.push_back(s);
     } else {
-        setMaterialRGB(0.4f,0.4f,0.45f, 1.0f);
+        slot.state = SLOT_WRITTEN;
     }
+    c.wake.notify_one();
+}
 
-    glBegin(GL_QUADS);
-      glNormal3f(0,1,0);
-      glVertex3f(-7.5f, 0.002f, -120.0f);
-      glVertex3f(-3.5f, 0.002f, -120.0f);
-      glVertex3f(-3.5f, 0.002f, 120.0f);
-      glVertex3f(-7.5f, 0.002f, 120.0f);
-      glVertex3f(3.5f, 0.002f, -120.0f);
-      glVertex3f(7.5f, 0.002f, -120.0f);
-      glVertex3f(7.5f, 0.002f, 120.0f);
-      glVertex3f(3.5f, 0.002f, 120.0f);
-    glEnd();
-
-    // Grass strips
-    drawGrassPatch(-11.0f, 0.0f, 6.0f, 220.0f);
-    drawGrassPatch(11.0f, 0.0f, 6.0f, 220.0f);
+// Wait until the writer is done with the slot, then release its mapping
+void captureReclaim(int s) {
+    FrameCapture &c = capture;
+    CaptureSlot &slot = c.slots[s];
+    {
+        std::unique_lock<std::mutex> lock(c.mutex);
+        c.done.wait(lock, [&] { return slot.state != SLOT_WRITING; });
+    }
+    if (slot.state == SLOT_WRITTEN && slot.pbo && slot.data) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    slot.data = nullptr;
+    slot.state = SLOT_FREE;
+}
 
-    // Draw building shadows
-    for (const Building &b : buildings) {
-        drawBuildingShadow(b, currentSunX, currentSunY, currentSunZ);
+// Flush everything in flight and release the ring
+void captureStop() {
+    FrameCapture &c = capture;
+    if (!c.active) return;
+    if (c.reading >= 0) captureHandOff(c.reading);
+    c.reading = -1;
+    for (int s = 0; s < CAPTURE_RING; ++s) captureReclaim(s);
+    {
+        std::lock_guard<std::mutex> lock(c.mutex);
+        c.stopping = true;
     }
+    c.wake.notify_one();
+    c.writer.join();
+    for (CaptureSlot &slot : c.slots) {
+        if (slot.pbo) glDeleteBuffers(1, &slot.pbo);
+        slot = CaptureSlot();
+    }
+    c.active = false;
+    fprintf(stderr, "capture: wrote %d frames\n", c.written);
+}
 
-    // Draw buildings
-    for (const Building &b : buildings) {
-        drawBuildingWithDetails(b);
+void captureStart(int w, int h) {
+    FrameCapture &c = capture;
+    size_t len = strlen(c.pattern);
+    c.png = len > 4 && !strcmp(c.pattern + len - 4, ".png");
+    c.width = w;
+    c.height = h;
+    c.reading = -1;
+    c.next = 0;
+    c.stopping = false;
+    c.failed = false;
+    size_t bytes = (size_t) w * h * 4;
+    for (CaptureSlot &slot : c.slots) {
+        if (hasPixelBufferObjects()) {
+            glGenBuffers(1, &slot.pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        } else {
+            slot.pixels.resize(bytes);
+        }
     }
+    c.writer = std::thread(captureWriterLoop);
+    c.active = true;
+}
 
-    // Draw trees
-    float leftTreePositions[] = {-16.5f, -15.0f, -17.0f, -14.5f, -16.0f, -15.5f, -17.5f, -14.0f, -16.8f, -15.2f};
-    float leftTreeZPositions[] = {-85.0f, -65.0f, -45.0f, -25.0f, -5.0f, 15.0f, 35.0f, 55.0f, 75.0f, 95.0f};
-    for (int i = 0; i < 10; ++i) {
-        drawTree(leftTreePositions[i], leftTreeZPositions[i], 0.9f + (i % 3) * 0.1f);
+// Called once per displayed frame, after everything is drawn
+void captureFrame(int w, int h) {
+    FrameCapture &c = capture;
+    if (!c.enabled || c.failed) return;
+    PROFILE_SCOPE("capture");
+    if (c.active && (w != c.width || h != c.height)) captureStop();
+    if (!c.active) captureStart(w, h);
+
+    // Last frame's copy is done by now; this frame's starts below
+    if (c.reading >= 0) captureHandOff(c.reading);
+
+    int s = c.next;
+    c.next = (c.next + 1) % CAPTURE_RING;
+    captureReclaim(s);
+    CaptureSlot &slot = c.slots[s];
+    slot.frame = c.frame++;
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (slot.pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    } else {
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, slot.pixels.data());
     }
-    float rightTreePositions[] = {16.5f, 15.0f, 17.0f, 14.5f, 16.0f, 15.5f, 17.5f, 14.0f, 16.8f, 15.2f};
-    float rightTreeZPositions[] = {-80.0f, -60.0f, -40.0f, -20.0f, 0.0f, 20.0f, 40.0f, 60.0f, 80.0f, 100.0f};
-    for (int i = 0; i < 10; ++i) {
-        drawTree(rightTreePositions[i], rightTreeZPositions[i], 0.95f + (i % 3) * 0.1f);
+    slot.state = SLOT_READING;
+    c.reading = s;
+}
+
+void toggleCapture() {
+    capture.enabled = !capture.enabled;
+    if (!capture.enabled) captureStop();
+    capture.failed = false;
+    printf("capture %s\n", capture.enabled ? "on" : "off");
+}
+
+// --capture argument: a file pattern with one %d (e.g. clips/city_%05d.png)
+// or a directory to put city_NNNNN.ppm files in
+bool setCapturePattern(const char *arg) {
+    FrameCapture &c = capture;
+    const char *pct = strchr(arg, '%');
+    if (!pct) {
+        size_t len = strlen(arg);
+        snprintf(c.pattern, sizeof(c.pattern), "%s%scity_%%05d.ppm", arg, len && arg[len - 1] != '/' ? "/" : "");
+    } else {
+        const char *spec = pct + 1 + strspn(pct + 1, "0123456789");
+        if (*spec != 'd' || strchr(spec, '%')) {
+            fprintf(stderr, "capture: \"%s\" needs exactly one %%d\n", arg);
+            return false;
+        }
+        snprintf(c.pattern, sizeof(c.pattern), "%s", arg);
     }
-    for (int i = 0; i < 6; ++i) {
-        drawTree(-28.0f + (i % 3) * 2.0f, -90.0f + i * 35.0f, 1.2f);
-        drawTree(28.0f - (i % 3) * 2.0f, -85.0f + i * 33.0f, 1.2f);
+    c.enabled = true;
+    return true;
+}
+
+// -------------------------- OpenGL callbacks --------------------------
+void reportFrameStats() {
+    static int frames = 0;
+    static FrameStats total;
+    static auto last = std::chrono::steady_clock::now();
+
+    frames++;
+    total.add(frameStats);
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last >= std::chrono::seconds(1)) {
+        if (printFrameStats) {
+            printf("items %d | materials %d applied, %d avoided | state %d applied, %d avoided | mesh binds %d  (per frame avg over %d)\n",
+                   total.drawItems / frames, total.materialChanges / frames,
+                   total.materialChangesAvoided() / frames, total.stateChanges / frames,
+                   total.stateChangesAvoided / frames, total.meshBinds / frames, frames);
+            printf("cells %d/%d (%d occluded) | buildings %d drawn, %d culled | trees %d/%d | cars %d/%d | humans %d/%d\n",
+                   total.cellsVisible / frames, (total.cellsVisible + total.cellsCulled) / frames,
+                   total.cellsOccluded / frames,
+                   total.buildingsDrawn / frames, total.buildingsCulled / frames,
+                   total.treesDrawn / frames, total.treesCulled / frames,
+                   total.carsDrawn / frames, total.carsCulled / frames,
+                   total.humansDrawn / frames, total.humansCulled / frames);
+            printf("lod 0/1/2: %d %d %d | shadow map renders %d, actor blocks %d | cells compiled %d\n",
+                   total.lodCounts[0] / frames, total.lodCounts[1] / frames, total.lodCounts[2] / frames,
+                   total.shadowRenders, total.shadowBlocks / frames, total.cellsCompiled);
+            if (worldStream.enabled)
+                printf("tiles %d visible, %d occluded | %zu resident (%.1f MB) | %d compiled\n",
+                       total.tilesVisible / frames, total.tilesOccluded / frames, worldStream.tiles.size(),
+                       worldStream.residentBytes / (1024.0 * 1024.0), total.tilesCompiled);
+        }
+        frames = 0;
+        total = FrameStats();
+        last = now;
     }
+}
 
-    // Draw cars
-    for (const Car &c : cars) drawCarModel(c);
+// Profiler overlay: stacked CPU and GPU graphs of the zones one level below
+// the top ("simulation", "render"), with the 60 fps budget marked, and the
+// average of every zone over the history underneath
+void drawProfilerHud() {
+    const Profiler &p = profiler;
+    static const float colors[8][3] = {
+        { 0.9f, 0.3f, 0.3f }, { 0.3f, 0.8f, 0.3f }, { 0.3f, 0.5f, 1.0f }, { 0.9f, 0.8f, 0.2f },
+        { 0.8f, 0.4f, 0.9f }, { 0.2f, 0.8f, 0.8f }, { 1.0f, 0.6f, 0.2f }, { 0.7f, 0.7f, 0.7f }
+    };
+    const float barW = 2.0f, graphH = 120.0f, msScale = graphH / 33.3f;
+    const float graphW = PROFILE_HISTORY * barW, lineH = 12.0f;
+    int zoneCount = (int) p.zones.size();
+    int graphs = p.gpu == 1 ? 2 : 1;
+    float left = 10.0f, top = windowHeight - 10.0f;
+    float graphBottom = top - graphH;
+    float panelBottom = graphBottom - 10.0f - lineH * (zoneCount + 1);
+
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0.0, windowWidth, 0.0, windowHeight, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+
+    VertexStream &vs = vertexStream;
+    vs.begin(GL_QUADS, 0.0f, 0.0f, 0.0f, 0.6f, true);
+    float panelRight = left + graphs * (graphW + 20.0f);
+    vs.vertex(left - 5.0f, panelBottom - 5.0f, 0.0f);
+    vs.vertex(panelRight, panelBottom - 5.0f, 0.0f);
+    vs.vertex(panelRight, top + 5.0f, 0.0f);
+    vs.vertex(left - 5.0f, top + 5.0f, 0.0f);
+
+    for (int graph = 0; graph < graphs; ++graph) {
+        const float (*ms)[PROFILE_MAX_ZONES] = graph == 0 ? p.cpuMs : p.gpuMs;
+        float x0 = left + graph * (graphW + 20.0f);
+        for (int i = 0; i < p.historyCount; ++i) {
+            const float *row = ms[(p.historyHead - p.historyCount + i + PROFILE_HISTORY) % PROFILE_HISTORY];
+            float x = x0 + (PROFILE_HISTORY - p.historyCount + i) * barW;
+            float y = graphBottom;
+            for (int z = 0; z < zoneCount; ++z) {
+                if (p.zoneDepth[z] != 1 || row[z] <= 0.0f) continue;
+                float h = fminf(row[z] * msScale, top - y);
+                const float *c = colors[z % 8];
+                vs.begin(GL_QUADS, c[0], c[1], c[2]);
+                vs.vertex(x, y, 0.0f);
+                vs.vertex(x + barW, y, 0.0f);
+                vs.vertex(x + barW, y + h, 0.0f);
+                vs.vertex(x, y + h, 0.0f);
+                y += h;
+            }
+        }
+        float budget = graphBottom + 16.7f * msScale;
+        vs.begin(GL_LINES, 1.0f, 1.0f, 1.0f, 0.6f, true);
+        vs.vertex(x0, budget, 0.0f);
+        vs.vertex(x0 + graphW, budget, 0.0f);
+        vs.vertex(x0, graphBottom, 0.0f);
+        vs.vertex(x0 + graphW, graphBottom, 0.0f);
+    }
+    vs.flush();
+    glDisable(GL_LIGHTING);
 
-    // Draw humans
-    for (const Human &h : humans) drawHuman(h);
+    char line[128];
+    auto text = [](float x, float y, const char *str) {
+        glRasterPos2f(x, y);
+        for (const char *c = str; *c; ++c) glutBitmapCharacter(GLUT_BITMAP_HELVETICA_10, *c);
+    };
+    glColor3f(1.0f, 1.0f, 1.0f);
+    snprintf(line, sizeof(line), "CPU%s  (ms, avg of %d frames, line = 16.7 ms)",
+             graphs > 1 ? " | GPU" : "", p.historyCount);
+    text(left, graphBottom - 10.0f - lineH, line);
+    for (int z = 0; z < zoneCount; ++z) {
+        float cpu = 0.0f, gpu = 0.0f;
+        for (int i = 0; i < p.historyCount; ++i) {
+            int row = (p.historyHead - 1 - i + PROFILE_HISTORY) % PROFILE_HISTORY;
+            cpu += p.cpuMs[row][z];
+            gpu += p.gpuMs[row][z];
+        }
+        int n = std::max(p.historyCount, 1);
+        const float *c = p.zoneDepth[z] == 1 ? colors[z % 8] : colors[7];
+        glColor3f(c[0], c[1], c[2]);
+        snprintf(line, sizeof(line), "%*s%s", 3 * p.zoneDepth[z], "", p.zones[z]);
+        float y = graphBottom - 10.0f - lineH * (z + 2);
+        text(left, y, line);
+        snprintf(line, sizeof(line), "%7.2f", cpu / n);
+        text(left + 130.0f, y, line);
+        if (graphs > 1) {
+            snprintf(line, sizeof(line), "%7.2f", gpu / n);
+            text(left + 180.0f, y, line);
+        }
+    }
 
-    // Draw rain
-    drawRain();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glPopAttrib();
 }
 
-// -------------------------- OpenGL callbacks --------------------------
-void display() {
+// Everything display() draws, without presenting; also used by the benchmark
+void renderFrame() {
+    PROFILE_GPU_SCOPE("render");
+    frameStats = FrameStats();
+    updateWeatherPalette();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode(GL_MODELVIEW);
@@ -876,13 +5964,35 @@ void display() {
     float eyeX = targetX + relX;
     float eyeY = targetY + relY;
     float eyeZ = targetZ + relZ;
-    gluLookAt(eyeX, eyeY, eyeZ,  targetX, targetY, targetZ,  0.0f, 1.0f, 0.0f);
+    camEye[0] = eyeX; camEye[1] = eyeY; camEye[2] = eyeZ;
+    viewMatrix = mat4LookAt(eyeX, eyeY, eyeZ,  targetX, targetY, targetZ,  0.0f, 1.0f, 0.0f);
+    glLoadMatrixf(viewMatrix.m);
+    viewFrustum.extract(mat4Mul(projMatrix, viewMatrix));
 
     float sunX, sunY, sunZ;
-    drawSunAndRays(sunX, sunY, sunZ);
+    {
+        PROFILE_GPU_SCOPE("sun");
+        drawSunAndRays(sunX, sunY, sunZ);
+    }
     drawScene(sunX, sunY, sunZ);
+    reportFrameStats();
+}
 
+void display() {
+    renderFrame();
+    if (profiler.hud) drawProfilerHud();
+    captureFrame(windowWidth, windowHeight);
     glutSwapBuffers();
+    profilerEndFrame();
+    glAccountingEndFrame();
+}
+
+// Esc and the end of a script: finish whatever still needs the GL context
+// while GLUT has it current, then leave
+void quit() {
+    captureStop();
+    profilerCloseTrace();
+    exit(0);
 }
 
 void reshape(int w, int h) {
@@ -891,50 +6001,13 @@ void reshape(int w, int h) {
     windowHeight = h;
     glViewport(0,0,w,h);
     glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(60.0f, (double)w/(double)h, 0.1f, 500.0f);
+    projMatrix = mat4Perspective(60.0f, (float)w/(float)h, 0.1f, 500.0f);
+    glLoadMatrixf(projMatrix.m);
     glMatrixMode(GL_MODELVIEW);
 }
 
-void update(int value) {
-    float deltaTime = TIMER_MS / 1000.0f;
-
-    // Update weather system
-    updateWeather(deltaTime);
-    if (currentWeather == RAINY) {
-        updateRain(deltaTime);
-    }
-
-    // Move cars
-    for (auto &c : cars) {
-        c.z += c.speed * 12.0f;
-        c.wheelRotation += c.speed * 300.0f;
-        if (c.speed > 0) {
-            if (c.z > 120.0f) c.z = -120.0f;
-        } else {
-            if (c.z < -120.0f) c.z = 120.0f;
-        }
-        if (c.wheelRotation > 360.0f) c.wheelRotation -= 360.0f;
-        if (c.wheelRotation < -360.0f) c.wheelRotation += 360.0f;
-    }
-
-    // Move humans
-    for (auto &h : humans) {
-        h.z += h.dir * h.speed * 6.0f;
-        if (h.z > 110.0f) { h.z = 110.0f; h.dir *= -1.0f; }
-        if (h.z < -110.0f) { h.z = -110.0f; h.dir *= -1.0f; }
-        h.phase += 0.02f + 0.005f * h.speed;
-        if (h.phase > 1000.0f) h.phase -= 1000.0f;
-    }
-
-    // Move sun
-    sunAngle += 0.02f;
-    if (sunAngle > 180.0f) sunAngle = 40.0f;
-
-    glutPostRedisplay();
-    glutTimerFunc(TIMER_MS, update, 0);
-}
-
+// Input callbacks change camera state only; update() redraws every tick
+// (and they run headless when a replay drives the benchmark)
 void mouse(int button, int state, int x, int y) {
     if (button == GLUT_LEFT_BUTTON) {
         if (state == GLUT_DOWN) {
@@ -952,7 +6025,6 @@ void mouse(int button, int state, int x, int y) {
         camDist += 1.0f;
         if (camDist > 120.0f) camDist = 120.0f;
     }
-    glutPostRedisplay();
 }
 
 void motion(int x, int y) {
@@ -965,7 +6037,6 @@ void motion(int x, int y) {
     if (camAngleX < -80.0f) camAngleX = -80.0f;
     lastMouseX = x;
     lastMouseY = y;
-    glutPostRedisplay();
 }
 
 void specialKeyboard(int key, int x, int y) {
@@ -993,37 +6064,280 @@ void specialKeyboard(int key, int x, int y) {
             targetZ += strafeZ;
             break;
     }
-    glutPostRedisplay();
 }
 
 void keyboard(unsigned char key, int x, int y) {
     switch (key) {
-        case 27: exit(0); break;
+        case 27: quit(); break;
         case 'w': camDist -= 1.0f; if (camDist < 5.0f) camDist = 5.0f; break;
         case 's': camDist += 1.0f; if (camDist > 150.0f) camDist = 150.0f; break;
         case 'a': camAngleY -= 5.0f; break;
         case 'd': camAngleY += 5.0f; break;
+        case 'i': printFrameStats = !printFrameStats; break;
+        case 'c': toggleCapture(); break;
+        case 'o':
+            occlusion.enabled = !occlusion.enabled;
+            printf("occlusion culling %s\n", occlusion.enabled ? "on" : "off");
+            break;
+        case 'p':
+            profiler.hud = !profiler.hud;
+            profilerUpdateActive();
+            break;
+        case '+': case '=':
+            timeScale = fminf(timeScale * 2.0f, 16.0f);
+            printf("time scale %gx\n", timeScale);
+            break;
+        case '-':
+            timeScale = fmaxf(timeScale * 0.5f, 1.0f / 16.0f);
+            printf("time scale %gx\n", timeScale);
+            break;
         case 'r':
             camAngleX = -18.0f; camAngleY = 0.0f; camDist=28.0f;
             targetX = 0.0f; targetY = 2.5f; targetZ = 0.0f;
             break;
         case ' ': // Space bar to manually toggle weather
-            if (currentWeather == SUNNY) {
-                currentWeather = RAINY;
-                rainIntensity = 0.0f;
-                initRain();
-            } else {
-                currentWeather = SUNNY;
-                rainIntensity = 0.0f;
-            }
+            currentWeather = (currentWeather == SUNNY) ? RAINY : SUNNY;
             weatherTimer = 0.0f;
             break;
     }
+}
+
+// -------------------------- Input recording --------------------------
+// --record FILE logs the seed, the command line and every input event, each
+// tagged with the update tick it arrived before and the simulated time, plus
+// the frame time every tick advanced the world by. --replay FILE feeds the
+// same ticks and events back, so the world and camera evolve identically
+// however fast the build renders, and exits when the recording ends.
+// --camera-path FILE flies the camera along Catmull-Rom interpolated
+// keyframes instead, one "time yaw pitch dist targetX targetY targetZ" per
+// line; the benchmark follows it in place of its built-in orbit.
+enum InputEventType { INPUT_TICK, INPUT_MOUSE, INPUT_MOTION, INPUT_KEY, INPUT_SPECIAL, INPUT_RESHAPE };
+const char *INPUT_EVENT_NAMES[] = { "tick", "mouse", "motion", "key", "special", "reshape" };
+
+struct InputEvent {
+    InputEventType type;
+    int v[4];               // button state x y | x y | key x y | w h
+    float dt;               // tick only
+};
+
+struct CameraKey {
+    float time, yaw, pitch, dist, x, y, z;
+};
+
+struct InputScript {
+    FILE *record = nullptr;
+    std::vector<InputEvent> events;     // replay, in file order
+    size_t next = 0;
+    bool replaying = false;
+    std::vector<CameraKey> path;
+    char args[1024] = "";               // options that shape the world, for checking replays
+
+    int frame = 0;                      // ticks advanced so far
+    double time = 0.0;                  // simulated seconds so far
+    std::chrono::steady_clock::time_point start;
+};
+InputScript inputScript;
+
+void recordEvent(InputEventType type, int a, int b = 0, int c = 0, int d = 0) {
+    InputScript &s = inputScript;
+    if (!s.record) return;
+    static const int argCount[] = { 0, 4, 2, 3, 3, 2 };
+    int v[4] = { a, b, c, d };
+    fprintf(s.record, "%d %.4f %s", s.frame, s.time, INPUT_EVENT_NAMES[type]);
+    for (int i = 0; i < argCount[type]; ++i) fprintf(s.record, " %d", v[i]);
+    fputc('\n', s.record);
+}
+
+bool openRecording(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "record: cannot write %s\n", path);
+        return false;
+    }
+    fprintf(f, "# city input recording: frame time event args\n");
+    fprintf(f, "seed %u\n", worldSeed);
+    fprintf(f, "args%s\n", inputScript.args);
+    inputScript.record = f;
+    return true;
+}
+
+// Reads a recording; its seed replaces worldSeed
+bool loadReplay(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "replay: cannot read %s\n", path);
+        return false;
+    }
+    InputScript &s = inputScript;
+    char line[1200], name[16];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == '#' || line[0] == 0) continue;
+        if (!strncmp(line, "seed ", 5)) {
+            worldSeed = (unsigned int) strtoul(line + 5, nullptr, 10);
+        } else if (!strncmp(line, "args", 4)) {
+            if (strcmp(line + 4, s.args))
+                fprintf(stderr, "replay: recorded with different options:%s\n", line + 4);
+        } else {
+            InputEvent e = { INPUT_TICK, { 0, 0, 0, 0 }, 0.0f };
+            int frame, used = 0;
+            float time;
+            if (sscanf(line, "%d %f %15s %n", &frame, &time, name, &used) < 3) continue;
+            int type = 0;
+            while (type <= INPUT_RESHAPE && strcmp(name, INPUT_EVENT_NAMES[type])) type++;
+            if (type > INPUT_RESHAPE) continue;
+            e.type = (InputEventType) type;
+            if (e.type == INPUT_TICK) sscanf(line + used, "%f", &e.dt);
+            else sscanf(line + used, "%d %d %d %d", &e.v[0], &e.v[1], &e.v[2], &e.v[3]);
+            s.events.push_back(e);
+        }
+    }
+    fclose(f);
+    s.replaying = true;
+    return true;
+}
+
+bool loadCameraPath(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "camera path: cannot read %s\n", path);
+        return false;
+    }
+    char line[256];
+    CameraKey k;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%f %f %f %f %f %f %f", &k.time, &k.yaw, &k.pitch, &k.dist, &k.x, &k.y, &k.z) == 7)
+            inputScript.path.push_back(k);
+    }
+    fclose(f);
+    std::sort(inputScript.path.begin(), inputScript.path.end(),
+              [](const CameraKey &a, const CameraKey &b) { return a.time < b.time; });
+    if (inputScript.path.empty()) fprintf(stderr, "camera path: no keyframes in %s\n", path);
+    return !inputScript.path.empty();
+}
+
+float catmullRom(float p0, float p1, float p2, float p3, float t) {
+    return 0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t * t
+                   + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t * t * t);
+}
+
+// Camera on the path at time t, held at the ends
+void applyCameraPath(float t) {
+    const std::vector<CameraKey> &p = inputScript.path;
+    if (p.empty()) return;
+    size_t i = 0;
+    while (i + 2 < p.size() && p[i + 1].time <= t) i++;
+    size_t i1 = std::min(i + 1, p.size() - 1);
+    const CameraKey &k0 = p[i > 0 ? i - 1 : 0], &k1 = p[i], &k2 = p[i1], &k3 = p[std::min(i1 + 1, p.size() - 1)];
+    float span = k2.time - k1.time;
+    float u = span > 0.0f ? std::min(std::max((t - k1.time) / span, 0.0f), 1.0f) : 1.0f;
+    camAngleY = catmullRom(k0.yaw, k1.yaw, k2.yaw, k3.yaw, u);
+    camAngleX = catmullRom(k0.pitch, k1.pitch, k2.pitch, k3.pitch, u);
+    camDist   = catmullRom(k0.dist, k1.dist, k2.dist, k3.dist, u);
+    targetX   = catmullRom(k0.x, k1.x, k2.x, k3.x, u);
+    targetY   = catmullRom(k0.y, k1.y, k2.y, k3.y, u);
+    targetZ   = catmullRom(k0.z, k1.z, k2.z, k3.z, u);
+}
+
+bool cameraPathDone() {
+    return !inputScript.path.empty() && inputScript.time > inputScript.path.back().time;
+}
+
+// Live callbacks: recorded when recording, ignored while a replay drives
+// the camera (except Esc)
+void recordedMouse(int button, int state, int x, int y) {
+    if (inputScript.replaying) return;
+    recordEvent(INPUT_MOUSE, button, state, x, y);
+    mouse(button, state, x, y);
+}
+
+void recordedMotion(int x, int y) {
+    if (inputScript.replaying) return;
+    recordEvent(INPUT_MOTION, x, y);
+    motion(x, y);
+}
+
+void recordedKeyboard(unsigned char key, int x, int y) {
+    if (inputScript.replaying && key != 27) return;
+    if (key != 27) recordEvent(INPUT_KEY, key, x, y);
+    keyboard(key, x, y);
+}
+
+void recordedSpecialKeyboard(int key, int x, int y) {
+    if (inputScript.replaying) return;
+    recordEvent(INPUT_SPECIAL, key, x, y);
+    specialKeyboard(key, x, y);
+}
+
+void recordedReshape(int w, int h) {
+    if (!inputScript.replaying) recordEvent(INPUT_RESHAPE, w, h);
+    reshape(w, h);
+}
+
+// Called once per update tick with the frame time measured (or fixed, in the
+// benchmark). Records it, or replays the events due before this tick and
+// swaps in the recorded frame time. False once a replay has run out, in
+// which case dt is left alone.
+bool scriptTick(float &dt, bool headless) {
+    InputScript &s = inputScript;
+    if (s.replaying) {
+        while (s.next < s.events.size() && s.events[s.next].type != INPUT_TICK) {
+            const InputEvent &e = s.events[s.next++];
+            if (headless && e.type == INPUT_KEY && e.v[0] == 27) {
+                // A recorded Esc ends the replay rather than quitting mid-benchmark
+                s.next = s.events.size();
+                break;
+            }
+            switch (e.type) {
+                case INPUT_MOUSE:   mouse(e.v[0], e.v[1], e.v[2], e.v[3]); break;
+                case INPUT_MOTION:  motion(e.v[0], e.v[1]); break;
+                case INPUT_KEY:     keyboard((unsigned char) e.v[0], e.v[1], e.v[2]); break;
+                case INPUT_SPECIAL: specialKeyboard(e.v[0], e.v[1], e.v[2]); break;
+                case INPUT_RESHAPE: if (!headless) glutReshapeWindow(e.v[0], e.v[1]); break;
+                default: break;
+            }
+        }
+        if (s.next >= s.events.size()) return false;
+        dt = s.events[s.next++].dt;
+    } else if (s.record) {
+        fprintf(s.record, "%d %.4f tick %.9g\n", s.frame, s.time, dt);
+    }
+    if (s.frame == 0) s.start = std::chrono::steady_clock::now();
+    s.frame++;
+    s.time += dt;
+    return true;
+}
+
+// End of an interactive replay or camera path
+void finishScript() {
+    const InputScript &s = inputScript;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - s.start).count();
+    printf("script finished: %d frames, %.2f s simulated, %.2f s wall, %.2f ms per frame\n",
+           s.frame, s.time, wall, s.frame > 0 ? 1000.0 * wall / s.frame : 0.0);
+    quit();
+}
+
+void update(int value) {
+    static auto lastTime = std::chrono::steady_clock::now();
+    auto now = std::chrono::steady_clock::now();
+    float elapsed = std::chrono::duration<float>(now - lastTime).count();
+    lastTime = now;
+    if (elapsed > MAX_FRAME_TIME) elapsed = MAX_FRAME_TIME;
+
+    if (!scriptTick(elapsed, false)) finishScript();
+    advanceSimulation(elapsed * timeScale);
+    if (!inputScript.path.empty()) {
+        if (cameraPathDone() && !inputScript.replaying) finishScript();
+        applyCameraPath((float) inputScript.time);
+    }
+
     glutPostRedisplay();
+    glutTimerFunc(TIMER_MS, update, 0);
 }
 
 void initGL() {
     glEnable(GL_DEPTH_TEST);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glShadeModel(GL_SMOOTH);
     glEnable(GL_NORMALIZE);
     glEnable(GL_LIGHTING);
@@ -1043,13 +6357,364 @@ void initGL() {
     glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, defS);
     glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 10.0f);
 
-    setupBuildings();
-    initActors();
+    bool sceneLoaded = sceneLoadPath && loadScene(sceneLoadPath);
+    if (sceneLoadPath && !sceneLoaded) exit(2);
+    initMeshLibrary();
+    initCarInstancing();
+    updateWeatherPalette();     // the static lists call its material lists
+    if (sceneLoaded) {
+        // buildings, trees, streets and grass came from the file
+    } else if (cityConfig.enabled) {
+        generateCity(cityConfig);
+        grassPatches.clear();
+    } else {
+        setupBuildings();
+        setupTrees();
+        setupStreets();
+        setupGrass();
+    }
+    buildStaticScene();
+    buildLanes();
+    if (sceneLoaded) {
+        // so did the cars and humans
+    } else if (cityConfig.enabled) {
+        generateActors(cityConfig);
+    } else {
+        initActors();
+    }
+    if (sceneExportPath && !exportScene(sceneExportPath)) exit(2);
+    initTraffic();
+    initCrowd();
+    saveSimState();
     initRain(); // Initialize rain system
+    streamStart();
+    glAccounting.frame = GlCallCounts();    // setup isn't part of any frame
+}
+
+// -------------------------- Headless benchmark --------------------------
+// --bench N renders N frames into an offscreen EGL pbuffer (Mesa's
+// surfaceless platform, so no X server or GPU is needed). Each frame runs
+// one fixed simulation step, moves the camera along a scripted orbit (or
+// the --camera-path / --replay script) and renders with glFinish(); the
+// summary goes to stdout (or --bench-out) as CSV or JSON, and each frame to
+// --bench-frames. A --replay that runs out first ends the run there; the
+// summary then covers the frames actually measured and the exit status is 4.
+struct BenchOptions {
+    int frames = 0;         // 0: interactive GLUT mode
+    int warmup = 10;        // frames run before measuring
+    int width = 1280, height = 720;
+    bool json = false;
+    const char* outPath = nullptr;
+    const char* framesPath = nullptr;   // per-frame CSV, for comparing runs frame by frame
+};
+BenchOptions benchOptions;
+
+// Orbit around the road while drifting along it, pitch and zoom oscillating
+void benchCamera(int frame, int total) {
+    float t = total > 1 ? (float) frame / (total - 1) : 0.0f;
+    camAngleY = 360.0f * t;
+    camAngleX = 22.0f + 12.0f * sinf(t * 4.0f * M_PI);
+    camDist   = 45.0f + 30.0f * sinf(t * 2.0f * M_PI);
+    targetX = 0.0f;
+    targetY = 2.5f;
+    targetZ = -60.0f + 120.0f * t;
+}
+
+// Quoted JSON string with quotes, backslashes and control characters escaped
+void writeJsonString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+struct SampleStats {
+    double min, mean, p50, p95, p99, max;
+};
+
+// Nearest-rank percentiles
+SampleStats summarize(std::vector<double> v) {
+    SampleStats st = { 0, 0, 0, 0, 0, 0 };
+    if (v.empty()) return st;
+    std::sort(v.begin(), v.end());
+    auto rank = [&](double p) { return v[std::min(v.size() - 1, (size_t) ceil(p * v.size()) - 1)]; };
+    double sum = 0.0;
+    for (double x : v) sum += x;
+    st.min = v.front();
+    st.max = v.back();
+    st.mean = sum / v.size();
+    st.p50 = rank(0.50);
+    st.p95 = rank(0.95);
+    st.p99 = rank(0.99);
+    return st;
+}
+
+#ifdef CITY_HEADLESS
+bool createHeadlessContext(int w, int h) {
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (dpy == EGL_NO_DISPLAY) dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, nullptr, nullptr)) {
+        fprintf(stderr, "bench: no EGL display\n");
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(dpy, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) {
+        fprintf(stderr, "bench: no pbuffer-capable EGL config\n");
+        return false;
+    }
+
+    const EGLint pbufferAttribs[] = { EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE };
+    EGLSurface surface = eglCreatePbufferSurface(dpy, config, pbufferAttribs);
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, nullptr);
+    if (surface == EGL_NO_SURFACE || ctx == EGL_NO_CONTEXT || !eglMakeCurrent(dpy, surface, surface, ctx)) {
+        fprintf(stderr, "bench: could not create a GL context (EGL error 0x%x)\n", eglGetError());
+        return false;
+    }
+    return true;
+}
+#endif
+
+int runBenchmark() {
+#ifndef CITY_HEADLESS
+    fprintf(stderr, "bench: built with CITY_NO_HEADLESS, no offscreen context available\n");
+    return 1;
+#else
+    const BenchOptions &opt = benchOptions;
+    if (!createHeadlessContext(opt.width, opt.height)) return 1;
+
+    initGL();
+    reshape(opt.width, opt.height);
+
+    FILE *perFrame = nullptr;
+    if (opt.framesPath) {
+        perFrame = fopen(opt.framesPath, "w");
+        if (!perFrame) {
+            fprintf(stderr, "bench: cannot write %s\n", opt.framesPath);
+            return 1;
+        }
+        fprintf(perFrame, "frame,sim_ms,frame_ms,gl_draws,gl_vertices,gl_materials\n");
+    }
+
+    std::vector<double> frameMs, simMs, drawCalls, listCalls, drawItems;
+    int total = opt.warmup + opt.frames;
+    for (int i = 0; i < total; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        float dt = SIM_DT;
+        if (!scriptTick(dt, true)) {
+            fprintf(stderr, "bench: replay ended after %d of %d frames (%d warmup)\n", i, total, opt.warmup);
+            break;
+        }
+        advanceSimulation(dt * timeScale);
+        auto t1 = std::chrono::steady_clock::now();
+        if (!inputScript.path.empty()) applyCameraPath((float) inputScript.time);
+        else if (!inputScript.replaying) benchCamera(i, total);
+        renderFrame();
+        if (i >= opt.warmup) captureFrame(opt.width, opt.height);
+        glFinish();
+        auto t2 = std::chrono::steady_clock::now();
+        profilerEndFrame();
+        glAccountingEndFrame(i >= opt.warmup);
+
+        if (i < opt.warmup) continue;
+        simMs.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        frameMs.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+        drawCalls.push_back(frameStats.drawCalls);
+        listCalls.push_back(frameStats.listCalls);
+        drawItems.push_back(frameStats.drawItems);
+        if (perFrame) {
+            const GlCallCounts &gl = glAccounting.last;
+            fprintf(perFrame, "%d,%.3f,%.3f,%ld,%ld,%ld\n", i - opt.warmup, simMs.back(), frameMs.back(),
+                    gl.draws, gl.vertices, gl.materials);
+        }
+    }
+    if (perFrame) fclose(perFrame);
+    captureStop();
+    streamStop();
+    profilerCloseTrace();
+
+    int frames = (int) frameMs.size();
+    SampleStats f = summarize(frameMs), sim = summarize(simMs);
+    SampleStats dc = summarize(drawCalls), lc = summarize(listCalls), di = summarize(drawItems);
+    const GlCallCounts &gl = glAccounting.peak;
+    const char *renderer = (const char*) glGetString(GL_RENDERER);
+    const char *version = (const char*) glGetString(GL_VERSION);
+
+    FILE *out = opt.outPath ? fopen(opt.outPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "bench: cannot write %s\n", opt.outPath);
+        return 1;
+    }
+    if (opt.json) {
+        fprintf(out, "{\n  \"frames\": %d, \"width\": %d, \"height\": %d, \"seed\": %u,\n",
+                frames, opt.width, opt.height, worldSeed);
+        fprintf(out, "  \"renderer\": ");
+        writeJsonString(out, renderer ? renderer : "unknown");
+        fprintf(out, ", \"gl_version\": ");
+        writeJsonString(out, version ? version : "unknown");
+        fprintf(out, ",\n");
+        fprintf(out, "  \"frame_ms\": { \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+                f.min, f.mean, f.p50, f.p95, f.p99, f.max);
+        fprintf(out, "  \"sim_ms\": { \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+                sim.min, sim.mean, sim.p50, sim.p95, sim.p99, sim.max);
+        fprintf(out, "  \"draw_calls\": { \"mean\": %.1f, \"max\": %.0f },\n", dc.mean, dc.max);
+        fprintf(out, "  \"list_calls\": { \"mean\": %.1f, \"max\": %.0f },\n", lc.mean, lc.max);
+        fprintf(out, "  \"draw_items\": { \"mean\": %.1f, \"max\": %.0f },\n", di.mean, di.max);
+        fprintf(out, "  \"gl_max\": { \"draws\": %ld, \"lists\": %ld, \"vertices\": %ld, \"materials\": %ld, \"readbacks\": %ld, \"matrix_depth\": %ld },\n",
+                gl.draws, gl.lists, gl.vertices, gl.materials, gl.readbacks, gl.matrixDepth);
+        fprintf(out, "  \"gl_frames_over_budget\": %d\n}\n", glAccounting.framesOver);
+    } else {
+        fprintf(out, "frames,width,height,seed,frame_min_ms,frame_mean_ms,frame_p50_ms,frame_p95_ms,frame_p99_ms,frame_max_ms,"
+                     "sim_mean_ms,sim_p99_ms,draw_calls_mean,draw_calls_max,list_calls_mean,draw_items_mean,"
+                     "gl_draws_max,gl_lists_max,gl_vertices_max,gl_materials_max,gl_readbacks_max,gl_matrix_depth_max,gl_frames_over_budget\n");
+        fprintf(out, "%d,%d,%d,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.0f,%.1f,%.1f,%ld,%ld,%ld,%ld,%ld,%ld,%d\n",
+                frames, opt.width, opt.height, worldSeed, f.min, f.mean, f.p50, f.p95, f.p99, f.max,
+                sim.mean, sim.p99, dc.mean, dc.max, lc.mean, di.mean, gl.draws, gl.lists, gl.vertices,
+                gl.materials, gl.readbacks, gl.matrixDepth, glAccounting.framesOver);
+    }
+    if (out != stdout) fclose(out);
+    if (glAccounting.framesOver > 0) {
+        fprintf(stderr, "gl budget: %d of %d frames over budget\n", glAccounting.framesOver, glAccounting.framesChecked);
+        return 3;
+    }
+    return frames < opt.frames ? 4 : 0;
+#endif
+}
+
+// Options that shape the world or its simulation, as recorded with --record
+// and checked on --replay (the seed has a line of its own). Rendering,
+// benchmark and output options are left out, so a replay may change them.
+bool isWorldOption(const char *arg) {
+    static const char *world[] = { "--grass-blades", "--city", "--city-seed", "--city-density", "--city-block",
+                                   "--city-street", "--city-lots", "--city-heights", "--cars", "--humans",
+                                   "--rain-drops", "--weather", "--scene", "--stream" };
+    for (const char *o : world)
+        if (!strcmp(arg, o)) return true;
+    return false;
+}
+
+// Command-line options; anything unrecognised is left for glutInit
+void parseOptions(int argc, char** argv) {
+    bool seedGiven = false;
+    const char *recordPath = nullptr, *replayPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (hasValue && isWorldOption(arg)) {
+            char *args = inputScript.args;
+            size_t len = strlen(args);
+            snprintf(args + len, sizeof(inputScript.args) - len, " %s %s", arg, argv[i + 1]);
+        }
+        if (!strcmp(arg, "--grass-blades") && hasValue) {
+            grassBladesPerPatch = atoi(argv[++i]);
+            if (grassBladesPerPatch < 0) grassBladesPerPatch = 0;
+        } else if (!strcmp(arg, "--seed") && hasValue) {
+            worldSeed = (unsigned int) strtoul(argv[++i], nullptr, 10);
+            seedGiven = true;
+        } else if (!strcmp(arg, "--city") && hasValue) {
+            cityConfig.enabled = sscanf(argv[++i], "%dx%d", &cityConfig.blocksX, &cityConfig.blocksZ) == 2
+                                 && cityConfig.blocksX > 0 && cityConfig.blocksZ > 0;
+        } else if (!strcmp(arg, "--city-seed") && hasValue) {
+            cityConfig.seed = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(arg, "--city-density") && hasValue) {
+            cityConfig.density = (float) atof(argv[++i]);
+        } else if (!strcmp(arg, "--city-block") && hasValue) {
+            cityConfig.blockSize = std::max(12.0f, (float) atof(argv[++i]));
+        } else if (!strcmp(arg, "--city-street") && hasValue) {
+            cityConfig.streetWidth = std::max(7.0f, (float) atof(argv[++i]));
+        } else if (!strcmp(arg, "--city-lots") && hasValue) {
+            cityConfig.lotsPerSide = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--city-heights") && hasValue) {
+            sscanf(argv[++i], "%f:%f:%f", &cityConfig.minHeight, &cityConfig.maxHeight, &cityConfig.heightSkew);
+        } else if (!strcmp(arg, "--cars") && hasValue) {
+            cityConfig.cars = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--humans") && hasValue) {
+            cityConfig.humans = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--threads") && hasValue) {
+            jobThreads = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--rain-drops") && hasValue) {
+            rain.capacity = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--rain-kernel") && hasValue) {
+            const char *k = argv[++i];
+            rain.kernel = !strcmp(k, "scalar") ? RAIN_SCALAR : !strcmp(k, "sse2") ? RAIN_SSE2
+                        : !strcmp(k, "avx2") ? RAIN_AVX2 : RAIN_AUTO;
+        } else if (!strcmp(arg, "--weather") && hasValue) {
+            if (!strcmp(argv[++i], "rainy")) {
+                currentWeather = RAINY;
+                rainIntensity = 1.0f;
+            }
+        } else if (!strcmp(arg, "--bench") && hasValue) {
+            benchOptions.frames = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--bench-warmup") && hasValue) {
+            benchOptions.warmup = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--bench-size") && hasValue) {
+            sscanf(argv[++i], "%dx%d", &benchOptions.width, &benchOptions.height);
+        } else if (!strcmp(arg, "--bench-format") && hasValue) {
+            benchOptions.json = !strcmp(argv[++i], "json");
+        } else if (!strcmp(arg, "--bench-out") && hasValue) {
+            benchOptions.outPath = argv[++i];
+        } else if (!strcmp(arg, "--profile-trace") && hasValue) {
+            profilerOpenTrace(argv[++i]);
+        } else if (!strcmp(arg, "--gl-budget") && hasValue) {
+            if (!parseGlBudget(argv[++i], glAccounting.budget)) exit(2);
+        } else if (!strcmp(arg, "--bench-frames") && hasValue) {
+            benchOptions.framesPath = argv[++i];
+        } else if (!strcmp(arg, "--record") && hasValue) {
+            recordPath = argv[++i];
+        } else if (!strcmp(arg, "--replay") && hasValue) {
+            replayPath = argv[++i];
+        } else if (!strcmp(arg, "--stream") && hasValue) {
+            worldStream.radius = std::max(1, atoi(argv[++i]));
+            worldStream.enabled = true;
+        } else if (!strcmp(arg, "--stream-cap") && hasValue) {
+            worldStream.capMB = std::max(1.0, atof(argv[++i]));
+        } else if (!strcmp(arg, "--stream-budget") && hasValue) {
+            worldStream.budgetMs = std::max(0.0, atof(argv[++i]));
+        } else if (!strcmp(arg, "--cell-budget") && hasValue) {
+            cellBudgetMs = std::max(0.0, atof(argv[++i]));
+        } else if (!strcmp(arg, "--instancing") && hasValue) {
+            carInstancing.enabled = strcmp(argv[++i], "off") != 0;
+        } else if (!strcmp(arg, "--occlusion") && hasValue) {
+            occlusion.enabled = strcmp(argv[++i], "off") != 0;
+        } else if (!strcmp(arg, "--capture") && hasValue) {
+            if (!setCapturePattern(argv[++i])) exit(2);
+        } else if (!strcmp(arg, "--scene") && hasValue) {
+            sceneLoadPath = argv[++i];
+        } else if (!strcmp(arg, "--export-scene") && hasValue) {
+            sceneExportPath = argv[++i];
+        } else if (!strcmp(arg, "--camera-path") && hasValue) {
+            if (!loadCameraPath(argv[++i])) exit(2);
+        }
+    }
+    if (replayPath) {
+        if (!loadReplay(replayPath)) exit(2);
+        seedGiven = true;
+    }
+    if (!seedGiven) worldSeed = benchOptions.frames > 0 ? 1u : (unsigned int) time(0);
+    if (recordPath && !openRecording(recordPath)) exit(2);
 }
 
 int main(int argc, char** argv) {
-    srand(time(0)); // Use time-based seed for better randomness
+    parseOptions(argc, argv);
+    jobSystem.start(jobThreads > 0 ? jobThreads : (int) std::thread::hardware_concurrency());
+    srand(worldSeed); // time-based unless --seed or benchmark mode
+
+    if (benchOptions.frames > 0) return runBenchmark();
 
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
@@ -1059,11 +6724,11 @@ int main(int argc, char** argv) {
     initGL();
 
     glutDisplayFunc(display);
-    glutReshapeFunc(reshape);
-    glutMouseFunc(mouse);
-    glutMotionFunc(motion);
-    glutKeyboardFunc(keyboard);
-    glutSpecialFunc(specialKeyboard);
+    glutReshapeFunc(recordedReshape);
+    glutMouseFunc(recordedMouse);
+    glutMotionFunc(recordedMotion);
+    glutKeyboardFunc(recordedKeyboard);
+    glutSpecialFunc(recordedSpecialKeyboard);
     glutTimerFunc(TIMER_MS, update, 0);
 
     glutMainLoop();